@@ -0,0 +1,423 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+
+// Microbenchmarks for the hot paths of the library
+//
+// Results are printed as tab-separated lines of the form:
+//     <benchmark> <value> <unit>
+// Lines starting with '#' are comments.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <mobile.h>
+#include <mobile_data.h>
+
+#define PACKET_ITERATIONS 20000
+#define PROCESS_ITERATIONS 20000
+#define DNS_ITERATIONS 50000
+#define LOOP_ITERATIONS 1000000
+
+static uint64_t clock_ns(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Cost of a pair of clock_ns() calls, subtracted from short measurements
+static double clock_overhead;
+
+static void clock_calibrate(void)
+{
+    uint64_t total = 0;
+    for (unsigned i = 0; i < 100000; i++) {
+        uint64_t start = clock_ns();
+        total += clock_ns() - start;
+    }
+    clock_overhead = total / 100000.0;
+}
+
+static void result(const char *name, const char *suffix, double value, const char *unit)
+{
+    printf("%s%s\t%.2f\t%s\n", name, suffix, value, unit);
+}
+
+// Callbacks
+// Sockets always connect, and echo anything sent to them through the DATA
+//   command (see command_data()). DNS responses are crafted from the last
+//   query that was sent.
+
+static uint32_t bench_time;
+
+static uint32_t bench_time_now_ms(void *user)
+{
+    (void)user;
+    return bench_time;
+}
+
+static const struct mobile_addr4 dns_server = {
+    .type = MOBILE_ADDRTYPE_IPV4,
+    .port = MOBILE_DNS_PORT,
+    .host = {10, 0, 0, 1}
+};
+static unsigned char dns_query[MOBILE_DNS_PACKET_SIZE];
+static unsigned dns_query_size;
+
+static int bench_sock_send(void *user, unsigned conn, const void *data, unsigned size, const struct mobile_addr *addr)
+{
+    (void)user;
+    (void)conn;
+    if (addr && size <= sizeof(dns_query)) {
+        // Only keep the header and question, the answer has to come before
+        //   the additional section (e.g. the EDNS OPT record).
+        const unsigned char *query = data;
+        unsigned end = 12;
+        while (end < size && query[end]) end += query[end] + 1;
+        end += 1 + 4;  // Root label, type and class
+        if (end > size) end = size;
+
+        memcpy(dns_query, data, end);
+        dns_query_size = end;
+    }
+    return size;
+}
+
+static int bench_sock_recv(void *user, unsigned conn, void *data, unsigned size, struct mobile_addr *addr)
+{
+    (void)user;
+    (void)conn;
+    if (!addr) return -10;
+
+    static const unsigned char answer[] = {
+        0xC0, 0x0C,  // Name: pointer to question
+        0x00, 0x01,  // Type: A
+        0x00, 0x01,  // Class: IN
+        0x00, 0x00, 0x0E, 0x10,  // TTL
+        0x00, 0x04,  // Length
+        127, 0, 0, 1
+    };
+    unsigned char *res = data;
+    if (dns_query_size + sizeof(answer) > size) return -1;
+    memcpy(res, dns_query, dns_query_size);
+    res[2] = 0x81;  // Response, Recursion Desired
+    res[3] = 0x80;  // Recursion Available
+    res[7] = 1;  // Answers: 1
+    res[10] = 0;
+    res[11] = 0;  // Additional: 0
+    memcpy(res + dns_query_size, answer, sizeof(answer));
+    memcpy(addr, &dns_server, sizeof(dns_server));
+    return dns_query_size + sizeof(answer);
+}
+
+static struct mobile_adapter *bench_adapter(bool time_now)
+{
+    struct mobile_adapter *adapter = mobile_new(NULL);
+    if (time_now) mobile_def_time_now_ms(adapter, bench_time_now_ms);
+    mobile_def_sock_send(adapter, bench_sock_send);
+    mobile_def_sock_recv(adapter, bench_sock_recv);
+    mobile_start(adapter);
+    mobile_loop(adapter);  // Write config
+    return adapter;
+}
+
+// Serial data as sent by the console, split into the sections that are timed
+//   separately. In 32bit mode, the sections are rounded up to whole words.
+struct stream {
+    unsigned char data[6 + MOBILE_MAX_DATA_SIZE + 3 + 2 + 4 + 4];
+    unsigned header;
+    unsigned body;
+    unsigned footer;
+};
+
+static void stream_packet(struct stream *s, bool mode_32bit, unsigned char command, const unsigned char *data, unsigned size)
+{
+    unsigned char *p = s->data;
+    unsigned checksum = command + size;
+
+    *p++ = 0x99;
+    *p++ = 0x66;
+    *p++ = command;
+    *p++ = 0;
+    *p++ = 0;
+    *p++ = size;
+    s->header = p - s->data;
+
+    for (unsigned i = 0; i < size; i++) checksum += data[i];
+    memcpy(p, data, size);
+    p += size;
+    if (mode_32bit) while ((p - s->data) % 4 != 2) *p++ = 0;
+    s->body = p - s->data;
+
+    // Checksum, device ID, acknowledgement and padding, and the idle byte
+    //   that starts the processing of the packet
+    *p++ = checksum >> 8;
+    *p++ = checksum;
+    *p++ = MOBILE_ADAPTER_GAMEBOY | 0x80;
+    *p++ = 0;
+    if (mode_32bit) {
+        *p++ = 0;
+        *p++ = 0;
+        for (unsigned i = 0; i < 4; i++) *p++ = 0x4B;
+    } else {
+        *p++ = 0x4B;
+    }
+    s->footer = p - s->data;
+
+    if (mode_32bit) {
+        s->header += 2;
+        s->body += 2;
+    }
+}
+
+static uint32_t word(const unsigned char *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | p[2] << 8 | p[3];
+}
+
+// Feed a part of the stream to the adapter, returning the time it took
+static uint64_t stream_send(struct mobile_adapter *adapter, bool mode_32bit, const unsigned char *data, unsigned size)
+{
+    uint64_t start = clock_ns();
+    if (mode_32bit) {
+        for (unsigned i = 0; i < size; i += 4) {
+            mobile_transfer_32bit(adapter, word(data + i));
+        }
+    } else {
+        for (unsigned i = 0; i < size; i++) mobile_transfer(adapter, data[i]);
+    }
+    return clock_ns() - start;
+}
+
+static void stream_exchange(struct mobile_adapter *adapter, bool mode_32bit, const struct stream *s)
+{
+    stream_send(adapter, mode_32bit, s->data, s->footer);
+    while (adapter->serial.state == MOBILE_SERIAL_RESPONSE_WAITING) {
+        mobile_loop(adapter);
+    }
+    while (adapter->serial.state != MOBILE_SERIAL_WAITING) {
+        if (mode_32bit) {
+            mobile_transfer_32bit(adapter, MOBILE_SERIAL_IDLE_WORD);
+        } else {
+            mobile_transfer(adapter, 0x4B);
+        }
+    }
+
+    // Let any other action, such as a serial mode change, run
+    for (unsigned i = 0; i < 4; i++) mobile_loop(adapter);
+}
+
+static void packet_exchange(struct mobile_adapter *adapter, bool mode_32bit, unsigned char command, const void *data, unsigned size)
+{
+    struct stream s;
+    stream_packet(&s, mode_32bit, command, data, size);
+    stream_exchange(adapter, mode_32bit, &s);
+}
+
+// Start a session, optionally switch to 32bit mode, and place a call, so DATA
+//   packets can be echoed.
+static struct mobile_adapter *bench_session(bool mode_32bit)
+{
+    struct mobile_adapter *adapter = bench_adapter(false);
+    packet_exchange(adapter, false, MOBILE_COMMAND_START,
+        (unsigned char *)"NINTENDO", 8);
+    if (mode_32bit) {
+        packet_exchange(adapter, false, MOBILE_COMMAND_CHANGE_CLOCK,
+            (unsigned char *)"\x01", 1);
+    }
+    packet_exchange(adapter, mode_32bit, MOBILE_COMMAND_TEL,
+        (unsigned char *)"\x00" "127000000001", 13);
+    if (adapter->commands.state != MOBILE_CONNECTION_CALL ||
+            adapter->serial.mode_32bit != mode_32bit) {
+        fprintf(stderr, "bench: couldn't set up a session\n");
+        exit(1);
+    }
+    return adapter;
+}
+
+static void bench_serial(bool mode_32bit)
+{
+    const char *suffix = mode_32bit ? "_32bit" : "_8bit";
+    struct mobile_adapter *adapter = bench_session(mode_32bit);
+
+    unsigned char data[MOBILE_MAX_DATA_SIZE];
+    data[0] = 0xFF;
+    for (unsigned i = 1; i < sizeof(data); i++) data[i] = i;
+    struct stream s;
+    stream_packet(&s, mode_32bit, MOBILE_COMMAND_DATA, data, sizeof(data));
+
+    uint64_t t_header = 0, t_data = 0, t_footer = 0, t_response = 0;
+    unsigned n_response = 0;
+    for (unsigned i = 0; i < PACKET_ITERATIONS; i++) {
+        t_header += stream_send(adapter, mode_32bit, s.data, s.header);
+        t_data += stream_send(adapter, mode_32bit, s.data + s.header,
+            s.body - s.header);
+        t_footer += stream_send(adapter, mode_32bit, s.data + s.body,
+            s.footer - s.body);
+
+        while (adapter->serial.state == MOBILE_SERIAL_RESPONSE_WAITING) {
+            mobile_loop(adapter);
+        }
+
+        uint64_t start = clock_ns();
+        while (adapter->serial.state != MOBILE_SERIAL_WAITING) {
+            if (mode_32bit) {
+                mobile_transfer_32bit(adapter, MOBILE_SERIAL_IDLE_WORD);
+                n_response += 4;
+            } else {
+                mobile_transfer(adapter, 0x4B);
+                n_response += 1;
+            }
+        }
+        t_response += clock_ns() - start;
+    }
+
+    double n = PACKET_ITERATIONS;
+    result("serial_header", suffix,
+        (t_header - clock_overhead * n) / (s.header * n), "ns/byte");
+    result("serial_data", suffix,
+        (t_data - clock_overhead * n) / ((s.body - s.header) * n), "ns/byte");
+    result("serial_footer", suffix,
+        (t_footer - clock_overhead * n) / ((s.footer - s.body) * n),
+        "ns/byte");
+    result("serial_response", suffix,
+        (t_response - clock_overhead * n) / n_response, "ns/byte");
+
+    // The same packet exchanged through mobile_transfer_buffer()
+    unsigned char out[sizeof(s.data)];
+    uint32_t in_words[sizeof(s.data) / 4];
+    uint32_t out_words[sizeof(s.data) / 4];
+    for (unsigned x = 0; x < s.footer / 4; x++) {
+        in_words[x] = word(s.data + x * 4);
+    }
+    uint64_t t_bulk = 0;
+    for (unsigned i = 0; i < PACKET_ITERATIONS; i++) {
+        uint64_t start = clock_ns();
+        if (mode_32bit) {
+            mobile_transfer_buffer_32bit(adapter, in_words, out_words,
+                s.footer / 4);
+        } else {
+            mobile_transfer_buffer(adapter, s.data, out, s.footer);
+        }
+        t_bulk += clock_ns() - start;
+
+        while (adapter->serial.state == MOBILE_SERIAL_RESPONSE_WAITING) {
+            mobile_loop(adapter);
+        }
+        while (adapter->serial.state != MOBILE_SERIAL_WAITING) {
+            if (mode_32bit) {
+                mobile_transfer_32bit(adapter, MOBILE_SERIAL_IDLE_WORD);
+            } else {
+                mobile_transfer(adapter, 0x4B);
+            }
+        }
+    }
+    result("serial_bulk", suffix,
+        (t_bulk - clock_overhead * n) / (s.footer * n), "ns/byte");
+
+    free(adapter);
+}
+
+// Time the processing of DATA packets, which build a reply packet of the
+//   same size through packet_create().
+static void bench_process(void)
+{
+    static const unsigned sizes[] = {1, 16, 64, 128, MOBILE_MAX_DATA_SIZE};
+    struct mobile_adapter *adapter = bench_session(false);
+
+    for (unsigned x = 0; x < sizeof(sizes) / sizeof(*sizes); x++) {
+        unsigned size = sizes[x];
+        unsigned char data[MOBILE_MAX_DATA_SIZE];
+        data[0] = 0xFF;
+        for (unsigned i = 1; i < size; i++) data[i] = i;
+        struct stream s;
+        stream_packet(&s, false, MOBILE_COMMAND_DATA, data, size);
+
+        uint64_t total = 0;
+        for (unsigned i = 0; i < PROCESS_ITERATIONS; i++) {
+            stream_send(adapter, false, s.data, s.footer);
+            uint64_t start = clock_ns();
+            while (adapter->serial.state == MOBILE_SERIAL_RESPONSE_WAITING) {
+                mobile_loop(adapter);
+            }
+            total += clock_ns() - start;
+            while (adapter->serial.state != MOBILE_SERIAL_WAITING) {
+                mobile_transfer(adapter, 0x4B);
+            }
+        }
+
+        char suffix[8];
+        sprintf(suffix, "_%u", size);
+        result("process_data", suffix,
+            total / (double)PROCESS_ITERATIONS - clock_overhead, "ns/packet");
+    }
+
+    free(adapter);
+}
+
+static void bench_dns(void)
+{
+    struct mobile_adapter *adapter = bench_adapter(false);
+    static const char host[] = "gameboy.datacenter.ne.jp";
+    const struct mobile_addr *addr = (struct mobile_addr *)&dns_server;
+    unsigned char ip[MOBILE_HOSTLEN_IPV4];
+    struct mobile_dns_query query = {
+        .addr = addr,
+        .type = MOBILE_ADDRTYPE_IPV4
+    };
+    unsigned answered;
+
+    uint64_t t_send = 0, t_recv = 0;
+    for (unsigned i = 0; i < DNS_ITERATIONS; i++) {
+        uint64_t start = clock_ns();
+        mobile_dns_request_send(adapter, 0, addr, MOBILE_ADDRTYPE_IPV4, host,
+            sizeof(host) - 1, &query.id);
+        uint64_t mid = clock_ns();
+        int rc = mobile_dns_request_recv(adapter, 0, &query, 1, host,
+            sizeof(host) - 1, ip, &answered);
+        t_recv += clock_ns() - mid;
+        t_send += mid - start;
+        if (rc != 1) {
+            fprintf(stderr, "bench: DNS request failed\n");
+            exit(1);
+        }
+    }
+
+    double n = DNS_ITERATIONS;
+    result("dns_query", "", t_send / n - clock_overhead, "ns/op");
+    result("dns_response", "", t_recv / n - clock_overhead, "ns/op");
+
+    free(adapter);
+}
+
+static void bench_loop(bool time_now)
+{
+    struct mobile_adapter *adapter = bench_adapter(time_now);
+
+    uint64_t start = clock_ns();
+    for (unsigned i = 0; i < LOOP_ITERATIONS; i++) mobile_loop(adapter);
+    uint64_t total = clock_ns() - start;
+
+    result("loop_idle", time_now ? "_time_now" : "_time_check",
+        total / (double)LOOP_ITERATIONS, "ns/call");
+
+    free(adapter);
+}
+
+int main(void)
+{
+    clock_calibrate();
+
+    printf("# libmobile %u.%u.%u\n", mobile_version_major,
+        mobile_version_minor, mobile_version_patch);
+    printf("# benchmark\tvalue\tunit\n");
+
+    bench_serial(false);
+    bench_serial(true);
+    bench_process();
+    bench_dns();
+    bench_loop(false);
+    bench_loop(true);
+    return 0;
+}
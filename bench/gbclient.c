@@ -0,0 +1,475 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+#include "gbclient.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <mobile_data.h>
+
+// Amount of times a packet is resent after a checksum error
+#define PACKET_RETRIES 4
+
+// Amount of exchanges to wait for a reply before giving up
+#define REPLY_EXCHANGES 100000000
+
+#define DEVICE_ID(mode_32bit) \
+    ((mode_32bit ? MOBILE_ADAPTER_GAMEBOY_ADVANCE : MOBILE_ADAPTER_GAMEBOY) | 0x80)
+
+// Library functions, recorded when tracing
+#ifdef GBCLIENT_TRACE
+#define def(name, func) (client->trace.cb.name = func)
+#define adapter_start(client) \
+    mobile_trace_start(&(client)->trace, (client)->adapter)
+#define adapter_stop(client) \
+    mobile_trace_stop(&(client)->trace, (client)->adapter)
+#define adapter_loop(client) \
+    mobile_trace_loop(&(client)->trace, (client)->adapter)
+#define adapter_transfer(client, c) \
+    mobile_trace_transfer(&(client)->trace, (client)->adapter, c)
+#define adapter_transfer_32bit(client, c) \
+    mobile_trace_transfer_32bit(&(client)->trace, (client)->adapter, c)
+#else
+#define def(name, func) mobile_def_ ## name(client->adapter, func)
+#define adapter_start(client) mobile_start((client)->adapter)
+#define adapter_stop(client) mobile_stop((client)->adapter)
+#define adapter_loop(client) mobile_loop((client)->adapter)
+#define adapter_transfer(client, c) mobile_transfer((client)->adapter, c)
+#define adapter_transfer_32bit(client, c) \
+    mobile_transfer_32bit((client)->adapter, c)
+#endif
+
+// Callbacks
+
+static void client_serial_enable(void *user, bool mode_32bit)
+{
+    struct gbclient *client = user;
+    client->serial_32bit = mode_32bit;
+}
+
+static uint32_t client_time_now_ms(void *user)
+{
+    (void)user;
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (uint32_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static bool client_sock_open(void *user, unsigned conn, enum mobile_socktype type, enum mobile_addrtype addrtype, unsigned bindport)
+{
+    struct gbclient *client = user;
+    (void)addrtype;
+    (void)bindport;
+
+    if (conn >= MOBILE_MAX_CONNECTIONS) return false;
+    struct gbclient_sock *sock = &client->socks[conn];
+    if (sock->open) return false;
+
+    sock->open = true;
+    sock->type = type;
+    sock->echo_size = 0;
+    sock->peer.type = MOBILE_ADDRTYPE_NONE;
+    sock->dns_size = 0;
+    return true;
+}
+
+static void client_sock_close(void *user, unsigned conn)
+{
+    struct gbclient *client = user;
+    client->socks[conn].open = false;
+}
+
+static int client_sock_connect(void *user, unsigned conn, const struct mobile_addr *addr)
+{
+    (void)user;
+    (void)conn;
+    (void)addr;
+    return 1;
+}
+
+// Answer a DNS query with a single A record, pointing to 127.0.0.1
+static int dns_respond(struct gbclient_sock *sock, const unsigned char *query, unsigned size, const struct mobile_addr *addr)
+{
+    static const unsigned char answer[] = {
+        0xC0, 0x0C,  // Name: pointer to question
+        0x00, 0x01,  // Type: A
+        0x00, 0x01,  // Class: IN
+        0x00, 0x00, 0x0E, 0x10,  // TTL
+        0x00, 0x04,  // Length
+        127, 0, 0, 1
+    };
+
+    // Only the header and question are echoed back, the answer has to come
+    //   before the additional section (e.g. the EDNS OPT record).
+    if (size < 12) return -1;
+    unsigned end = 12;
+    while (end < size && query[end]) end += query[end] + 1;
+    end += 1 + 4;  // Root label, type and class
+    if (end > size || end + sizeof(answer) > sizeof(sock->dns)) return -1;
+
+    memcpy(sock->dns, query, end);
+    sock->dns[2] = 0x81;  // Response, Recursion Desired
+    sock->dns[3] = 0x80;  // Recursion Available
+    sock->dns[6] = 0;
+    sock->dns[7] = 1;  // Answers: 1
+    sock->dns[8] = 0;
+    sock->dns[9] = 0;  // Authority: 0
+    sock->dns[10] = 0;
+    sock->dns[11] = 0;  // Additional: 0
+    memcpy(sock->dns + end, answer, sizeof(answer));
+    sock->dns_size = end + sizeof(answer);
+    sock->dns_addr = *addr;
+    return size;
+}
+
+// Queue a datagram, keeping its boundaries
+static bool echo_datagram(struct gbclient_sock *sock, const void *data, unsigned size)
+{
+    if (size + 2 > GBCLIENT_ECHO_SIZE - sock->echo_size) return false;
+    sock->echo[sock->echo_size++] = size >> 8;
+    sock->echo[sock->echo_size++] = size;
+    memcpy(sock->echo + sock->echo_size, data, size);
+    sock->echo_size += size;
+    return true;
+}
+
+static int client_sock_send(void *user, unsigned conn, const void *data, unsigned size, const struct mobile_addr *addr)
+{
+    struct gbclient *client = user;
+    struct gbclient_sock *sock = &client->socks[conn];
+    if (!sock->open) return -1;
+
+    if (addr && addr->type == MOBILE_ADDRTYPE_IPV4 &&
+            ((struct mobile_addr4 *)addr)->port == MOBILE_DNS_PORT) {
+        return dns_respond(sock, data, size, addr);
+    }
+
+    // Datagrams that don't fit are dropped, like on a real network
+    if (sock->type == MOBILE_SOCKTYPE_UDP) {
+        if (addr) sock->peer = *addr;
+        echo_datagram(sock, data, size);
+        return size;
+    }
+
+    if (size > GBCLIENT_ECHO_SIZE - sock->echo_size) {
+        size = GBCLIENT_ECHO_SIZE - sock->echo_size;
+    }
+    memcpy(sock->echo + sock->echo_size, data, size);
+    sock->echo_size += size;
+    return size;
+}
+
+static int client_sock_recv(void *user, unsigned conn, void *data, unsigned size, struct mobile_addr *addr)
+{
+    struct gbclient *client = user;
+    struct gbclient_sock *sock = &client->socks[conn];
+    if (!sock->open) return -1;
+    if (!data) return 0;
+
+    if (sock->dns_size) {
+        if (size < sock->dns_size) return -1;
+        size = sock->dns_size;
+        memcpy(data, sock->dns, size);
+        if (addr) *addr = sock->dns_addr;
+        sock->dns_size = 0;
+        return size;
+    }
+
+    // Datagrams are received one at a time, truncated to the buffer size
+    if (sock->type == MOBILE_SOCKTYPE_UDP) {
+        if (!sock->echo_size) return 0;
+        unsigned length = sock->echo[0] << 8 | sock->echo[1];
+        if (size > length) size = length;
+        memcpy(data, sock->echo + 2, size);
+        sock->echo_size -= 2 + length;
+        memmove(sock->echo, sock->echo + 2 + length, sock->echo_size);
+        if (addr) *addr = sock->peer;
+        return size;
+    }
+
+    if (size > sock->echo_size) size = sock->echo_size;
+    memcpy(data, sock->echo, size);
+    sock->echo_size -= size;
+    memmove(sock->echo, sock->echo + size, sock->echo_size);
+    return size;
+}
+
+static int client_sock_poll(void *user, unsigned conn)
+{
+    struct gbclient *client = user;
+    struct gbclient_sock *sock = &client->socks[conn];
+    if (!sock->open) return -1;
+
+    int res = 0;
+    if (sock->echo_size || sock->dns_size) res |= MOBILE_SOCKPOLL_READABLE;
+    if (sock->echo_size < GBCLIENT_ECHO_SIZE) res |= MOBILE_SOCKPOLL_WRITABLE;
+    return res;
+}
+
+static void client_init(struct gbclient *client, FILE *file)
+{
+    memset(client, 0, sizeof(*client));
+
+#ifdef GBCLIENT_TRACE
+    mobile_trace_init(&client->trace, file, client);
+    client->adapter = mobile_new(&client->trace);
+#else
+    (void)file;
+    client->adapter = mobile_new(client);
+#endif
+    if (!client->adapter) abort();
+    def(serial_enable, client_serial_enable);
+    def(time_now_ms, client_time_now_ms);
+    def(sock_open, client_sock_open);
+    def(sock_close, client_sock_close);
+    def(sock_connect, client_sock_connect);
+    def(sock_send, client_sock_send);
+    def(sock_recv, client_sock_recv);
+    def(sock_poll, client_sock_poll);
+#ifdef GBCLIENT_TRACE
+    mobile_trace_attach(&client->trace, client->adapter);
+#endif
+
+    adapter_start(client);
+    client->next = client->mode_32bit ?
+        MOBILE_SERIAL_IDLE_WORD : MOBILE_SERIAL_IDLE_BYTE;
+}
+
+#ifdef GBCLIENT_TRACE
+void gbclient_init_trace(struct gbclient *client, FILE *file)
+{
+    client_init(client, file);
+}
+#else
+void gbclient_init(struct gbclient *client)
+{
+    client_init(client, NULL);
+}
+#endif
+
+void gbclient_free(struct gbclient *client)
+{
+    adapter_stop(client);
+    free(client->adapter);
+    client->adapter = NULL;
+}
+
+// Serial
+
+// Exchange a single byte, or a word in 32bit mode.
+// The data received is the one the adapter returned during the previous
+//   exchange, like with the real serial hardware.
+static uint32_t exchange(struct gbclient *client, uint32_t out)
+{
+    uint32_t in = client->next;
+    if (client->mode_32bit) {
+        client->next = adapter_transfer_32bit(client, out);
+    } else {
+        client->next = adapter_transfer(client, out);
+    }
+    client->exchanges++;
+    return in;
+}
+
+// Exchange a byte stream, split into words in 32bit mode.
+// The size must be a multiple of 4 in 32bit mode.
+static void exchange_stream(struct gbclient *client, const unsigned char *out, unsigned char *in, unsigned size)
+{
+    if (!client->mode_32bit) {
+        for (unsigned i = 0; i < size; i++) in[i] = exchange(client, out[i]);
+        return;
+    }
+
+    for (unsigned i = 0; i < size; i += 4) {
+        uint32_t w = exchange(client,
+            (uint32_t)out[i + 0] << 24 | (uint32_t)out[i + 1] << 16 |
+            out[i + 2] << 8 | out[i + 3]);
+        in[i + 0] = w >> 24;
+        in[i + 1] = w >> 16;
+        in[i + 2] = w >> 8;
+        in[i + 3] = w >> 0;
+    }
+}
+
+// Send a packet, returning the acknowledgement byte sent by the adapter
+static unsigned char packet_send(struct gbclient *client, unsigned char command, const unsigned char *data, unsigned size)
+{
+    unsigned char out[6 + GBCLIENT_MAX_DATA_SIZE + 3 + 2 + 4];
+    unsigned char in[sizeof(out)];
+    unsigned char *p = out;
+    unsigned checksum = command + size;
+
+    *p++ = 0x99;
+    *p++ = 0x66;
+    *p++ = command;
+    *p++ = 0;
+    *p++ = 0;
+    *p++ = size;
+    for (unsigned i = 0; i < size; i++) checksum += data[i];
+    if (size) memcpy(p, data, size);
+    p += size;
+    if (client->mode_32bit) while ((p - out) % 4 != 2) *p++ = 0;
+    *p++ = checksum >> 8;
+    *p++ = checksum;
+    *p++ = DEVICE_ID(client->mode_32bit);
+    *p++ = 0;
+    if (client->mode_32bit) {
+        *p++ = 0;
+        *p++ = 0;
+    }
+
+    unsigned total = (unsigned)(p - out);
+    exchange_stream(client, out, in, total);
+
+    // The acknowledgement is received along with the byte after the device
+    //   ID, or in the word after the checksum in 32bit mode.
+    return in[total - (client->mode_32bit ? 3 : 1)];
+}
+
+enum reply_state {
+    REPLY_SYNC1,
+    REPLY_SYNC2,
+    REPLY_HEADER,
+    REPLY_DATA,
+    REPLY_PAD,
+    REPLY_CHECKSUM,
+    REPLY_DONE
+};
+
+// Wait for and receive the reply to a packet, returning whether its checksum
+//   was valid.
+static bool packet_recv(struct gbclient *client)
+{
+    enum reply_state state = REPLY_SYNC1;
+    unsigned current = 0;
+    unsigned char header[4];
+    unsigned char footer[2];
+    uint16_t checksum = 0;
+
+    for (unsigned long i = 0; state != REPLY_DONE; i++) {
+        if (i >= REPLY_EXCHANGES) return false;
+
+        unsigned char in[4];
+        unsigned char idle[4] = {0x4B, 0x4B, 0x4B, 0x4B};
+        unsigned size = client->mode_32bit ? 4 : 1;
+        exchange_stream(client, idle, in, size);
+
+        for (unsigned x = 0; x < size; x++) {
+            unsigned char c = in[x];
+            switch (state) {
+            case REPLY_SYNC1:
+                if (c == 0x99) state = REPLY_SYNC2;
+                break;
+
+            case REPLY_SYNC2:
+                state = c == 0x66 ? REPLY_HEADER : REPLY_SYNC1;
+                current = 0;
+                checksum = 0;
+                break;
+
+            case REPLY_HEADER:
+                header[current++] = c;
+                checksum += c;
+                if (current < sizeof(header)) break;
+                client->reply_command = header[0];
+                client->reply_size = header[3];
+                current = 0;
+                state = client->reply_size ? REPLY_DATA : REPLY_PAD;
+                break;
+
+            case REPLY_DATA:
+                client->reply[current++] = c;
+                checksum += c;
+                if (current < client->reply_size) break;
+                current = 0;
+                state = REPLY_PAD;
+                break;
+
+            case REPLY_PAD:
+                if (client->mode_32bit && (client->reply_size + current) % 4) {
+                    current++;
+                    break;
+                }
+                footer[0] = c;
+                current = 1;
+                state = REPLY_CHECKSUM;
+                break;
+
+            case REPLY_CHECKSUM:
+                footer[current++] = c;
+                state = REPLY_DONE;
+                break;
+
+            default:
+                break;
+            }
+        }
+
+        // Let the adapter process the packet until the reply starts
+        if (state == REPLY_SYNC1) adapter_loop(client);
+    }
+
+    bool valid = (footer[0] << 8 | footer[1]) == checksum;
+    unsigned char ack = valid ?
+        client->reply_command ^ 0x80 : MOBILE_SERIAL_ERROR_CHECKSUM;
+
+    // The adapter catches the acknowledgement while the checksum is being
+    //   received in 32bit mode, so the one sent here only completes the
+    //   footer, and errors can't be reported.
+    unsigned char out[4] = {DEVICE_ID(client->mode_32bit), 0, ack, 0};
+    unsigned char in[4];
+    if (client->mode_32bit) {
+        exchange_stream(client, out, in, 4);
+    } else {
+        exchange_stream(client, out, in, 1);
+        exchange_stream(client, out + 2, in, 1);
+    }
+    return valid;
+}
+
+bool gbclient_packet(struct gbclient *client, unsigned char command, const void *data, unsigned size)
+{
+    if (size > GBCLIENT_MAX_DATA_SIZE) return false;
+
+    for (unsigned retry = 0;; retry++) {
+        unsigned char ack = packet_send(client, command, data, size);
+        if (ack == (command ^ 0x80)) break;
+        if (retry >= PACKET_RETRIES || (ack != MOBILE_SERIAL_ERROR_CHECKSUM &&
+                ack != MOBILE_SERIAL_ERROR_INTERNAL)) {
+            client->errors++;
+            return false;
+        }
+        client->retries++;
+    }
+
+    for (unsigned retry = 0;; retry++) {
+        if (packet_recv(client)) break;
+        if (client->mode_32bit || retry >= PACKET_RETRIES) {
+            client->errors++;
+            return false;
+        }
+        client->retries++;
+    }
+    client->packets++;
+
+    // Follow the adapter into 32bit mode, once it's ready for it
+    if (client->reply_command == (MOBILE_COMMAND_CHANGE_CLOCK | 0x80) &&
+            size >= 1) {
+        bool mode_32bit = ((const unsigned char *)data)[0] & 1;
+        while (client->serial_32bit != mode_32bit) {
+            adapter_loop(client);
+        }
+        client->mode_32bit = mode_32bit;
+        client->next = mode_32bit ?
+            MOBILE_SERIAL_IDLE_WORD : MOBILE_SERIAL_IDLE_BYTE;
+    }
+    return true;
+}
+
+bool gbclient_datagram(struct gbclient *client, unsigned conn, const void *data, unsigned size)
+{
+    if (conn >= MOBILE_MAX_CONNECTIONS) return false;
+    struct gbclient_sock *sock = &client->socks[conn];
+    if (!sock->open || sock->type != MOBILE_SOCKTYPE_UDP) return false;
+    return echo_datagram(sock, data, size);
+}
@@ -0,0 +1,80 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+#pragma once
+
+// Simulated Game Boy client
+//
+// Drives a struct mobile_adapter through the serial protocol the same way a
+// game would: every packet is sent byte by byte (or word by word in 32bit
+// mode), the acknowledgement is checked, and the reply is received and
+// acknowledged, keeping the one-exchange delay of a real serial link.
+//
+// The adapter's sockets are backed by an in-memory loopback: stream data is
+// echoed back to the sender, datagrams are echoed back one by one, and any
+// datagram sent to port 53 is answered as a DNS query, resolving every name
+// to 127.0.0.1.
+//
+// When built with GBCLIENT_TRACE defined, the adapter is driven through the
+// recorder in tools/trace.h, and gbclient_init_trace() replaces gbclient_init()
+// to record the session into a file that can be replayed with mobile_replay.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <mobile.h>
+#ifdef GBCLIENT_TRACE
+#include <trace.h>
+#endif
+
+#define GBCLIENT_MAX_DATA_SIZE 0xFF
+#define GBCLIENT_ECHO_SIZE 0x400
+
+struct gbclient_sock {
+    bool open;
+    enum mobile_socktype type;
+    unsigned echo_size;
+    unsigned char echo[GBCLIENT_ECHO_SIZE];  // Datagrams have a u16 size prefix
+    struct mobile_addr peer;  // Where the last datagram was sent
+
+    // Pending DNS response
+    unsigned dns_size;
+    unsigned char dns[512];
+    struct mobile_addr dns_addr;
+};
+
+struct gbclient {
+    struct mobile_adapter *adapter;
+#ifdef GBCLIENT_TRACE
+    struct mobile_trace trace;
+#endif
+    bool mode_32bit;
+    bool serial_32bit;  // Mode set through mobile_func_serial_enable()
+
+    // Data received during the last exchange
+    uint32_t next;
+
+    // Last reply received
+    unsigned char reply_command;
+    unsigned char reply_size;
+    unsigned char reply[GBCLIENT_MAX_DATA_SIZE];
+
+    // Statistics
+    unsigned long packets;
+    unsigned long exchanges;
+    unsigned long retries;
+    unsigned long errors;
+
+    struct gbclient_sock socks[MOBILE_MAX_CONNECTIONS];
+};
+
+#ifdef GBCLIENT_TRACE
+void gbclient_init_trace(struct gbclient *client, FILE *file);
+#else
+void gbclient_init(struct gbclient *client);
+#endif
+void gbclient_free(struct gbclient *client);
+bool gbclient_packet(struct gbclient *client, unsigned char command, const void *data, unsigned size);
+
+// Queue a datagram to be received on a UDP connection, as if its peer sent it.
+// Returns false if the connection isn't open or has no room for it.
+bool gbclient_datagram(struct gbclient *client, unsigned conn, const void *data, unsigned size);
@@ -0,0 +1,137 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+
+// End-to-end throughput of a simulated game session
+//
+// A simulated Game Boy client (see gbclient.h) logs into the internet,
+// resolves a host, opens a TCP connection and exchanges DATA packets through
+// the loopback socket backend, for both serial modes.
+//
+// Results use the same format as mobile_bench:
+//     <benchmark> <value> <unit>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <mobile_data.h>
+
+#include "gbclient.h"
+
+#define DATA_PACKETS 20000
+
+static uint64_t clock_ns(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void result(const char *name, const char *suffix, double value, const char *unit)
+{
+    printf("%s%s\t%.2f\t%s\n", name, suffix, value, unit);
+}
+
+// Send a packet, and make sure the adapter replied to it without an error
+static void packet(struct gbclient *client, unsigned char command, const void *data, unsigned size)
+{
+    if (!gbclient_packet(client, command, data, size)) {
+        fprintf(stderr, "throughput: packet 0x%02X: serial error\n", command);
+        exit(1);
+    }
+    if (client->reply_command != (command | 0x80)) {
+        fprintf(stderr, "throughput: packet 0x%02X: replied 0x%02X\n",
+            command, client->reply_command);
+        exit(1);
+    }
+}
+
+static void session(bool mode_32bit)
+{
+    const char *suffix = mode_32bit ? "_32bit" : "_8bit";
+    struct gbclient *client = malloc(sizeof(struct gbclient));
+    if (!client) abort();
+    gbclient_init(client);
+
+    uint64_t start = clock_ns();
+
+    packet(client, MOBILE_COMMAND_START, "NINTENDO", 8);
+    if (mode_32bit) packet(client, MOBILE_COMMAND_CHANGE_CLOCK, "\x01", 1);
+    packet(client, MOBILE_COMMAND_TEL, "\x00" "#9677", 6);
+
+    // ID, password, DNS1 and DNS2
+    static const unsigned char login[] = {
+        4, 'g', '1', '0', '0',
+        4, 'p', 'a', 's', 's',
+        10, 0, 0, 1,
+        10, 0, 0, 2
+    };
+    packet(client, MOBILE_COMMAND_PPP_CONNECT, login, sizeof(login));
+
+    static const char host[] = "gameboy.datacenter.ne.jp";
+    packet(client, MOBILE_COMMAND_DNS_REQUEST, host, sizeof(host) - 1);
+    if (client->reply_size != 4) {
+        fprintf(stderr, "throughput: DNS request failed\n");
+        exit(1);
+    }
+
+    unsigned char addr[6];
+    memcpy(addr, client->reply, 4);
+    addr[4] = 80 >> 8;
+    addr[5] = 80 & 0xFF;
+    packet(client, MOBILE_COMMAND_TCP_CONNECT, addr, sizeof(addr));
+    unsigned char conn = client->reply[0];
+
+    uint64_t setup = clock_ns() - start;
+
+    // Exchange full DATA packets, which are echoed back
+    unsigned char data[1 + MOBILE_MAX_TRANSFER_SIZE];
+    data[0] = conn;
+    for (unsigned i = 1; i < sizeof(data); i++) data[i] = i;
+
+    unsigned long packets = client->packets;
+    unsigned long exchanges = client->exchanges;
+    unsigned long payload = 0;
+    start = clock_ns();
+    for (unsigned i = 0; i < DATA_PACKETS; i++) {
+        packet(client, MOBILE_COMMAND_DATA, data, sizeof(data));
+        if (client->reply_size != sizeof(data) ||
+                memcmp(client->reply + 1, data + 1, sizeof(data) - 1) != 0) {
+            fprintf(stderr, "throughput: DATA wasn't echoed\n");
+            exit(1);
+        }
+        payload += (sizeof(data) - 1) + (client->reply_size - 1);
+    }
+    double seconds = (clock_ns() - start) / 1e9;
+    packets = client->packets - packets;
+    exchanges = client->exchanges - exchanges;
+
+    start = clock_ns();
+    packet(client, MOBILE_COMMAND_TCP_DISCONNECT, &conn, 1);
+    packet(client, MOBILE_COMMAND_PPP_DISCONNECT, NULL, 0);
+    packet(client, MOBILE_COMMAND_OFFLINE, NULL, 0);
+    packet(client, MOBILE_COMMAND_END, NULL, 0);
+    uint64_t teardown = clock_ns() - start;
+
+    result("session_setup", suffix, setup / 1e3, "us");
+    result("session_teardown", suffix, teardown / 1e3, "us");
+    result("data_packets", suffix, packets / seconds, "packets/s");
+    result("data_payload", suffix, payload / seconds, "bytes/s");
+    result("data_exchanges", suffix, exchanges / (double)packets,
+        mode_32bit ? "words/packet" : "bytes/packet");
+    result("serial_retries", suffix, client->retries, "packets");
+
+    gbclient_free(client);
+    free(client);
+}
+
+int main(void)
+{
+    printf("# libmobile %u.%u.%u\n", mobile_version_major,
+        mobile_version_minor, mobile_version_patch);
+    printf("# benchmark\tvalue\tunit\n");
+
+    session(false);
+    session(true);
+    return 0;
+}
@@ -0,0 +1,163 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+
+// UDP sessions of a simulated Game Boy client
+//
+// A simulated Game Boy client (see gbclient.h) logs into the internet and
+// opens a UDP connection. Datagrams sent through DATA packets are echoed back
+// by the loopback, and bursts of datagrams are queued by the peer while the
+// adapter is left to read them ahead of time, if it has a receive buffer.
+// Every DATA packet must receive exactly one datagram, in order and intact,
+// and DATA packets must return right away when there's nothing to receive.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <mobile_data.h>
+
+#include "gbclient.h"
+
+#define BURSTS 50
+#define EMPTY_PACKETS 10
+
+static uint64_t clock_ms(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void fail(const char *msg, unsigned index)
+{
+    fprintf(stderr, "udp: datagram %u: %s\n", index, msg);
+    exit(1);
+}
+
+// Send a packet, and make sure the adapter replied to it without an error
+static void packet(struct gbclient *client, unsigned char command, const void *data, unsigned size)
+{
+    if (!gbclient_packet(client, command, data, size)) {
+        fprintf(stderr, "udp: packet 0x%02X: serial error\n", command);
+        exit(1);
+    }
+    if (client->reply_command != (command | 0x80)) {
+        fprintf(stderr, "udp: packet 0x%02X: replied 0x%02X\n",
+            command, client->reply_command);
+        exit(1);
+    }
+}
+
+// Sizes cycle through full and small datagrams, so the queued datagrams end
+//   up at every possible offset of the receive buffer.
+static unsigned datagram_size(unsigned index)
+{
+    static const unsigned sizes[] = {MOBILE_MAX_TRANSFER_SIZE, 1, 100, 37,
+        MOBILE_MAX_TRANSFER_SIZE, 200, 2, MOBILE_MAX_TRANSFER_SIZE - 1};
+    return sizes[index % (sizeof(sizes) / sizeof(*sizes))];
+}
+
+static void datagram_fill(unsigned char *data, unsigned index)
+{
+    unsigned size = datagram_size(index);
+    for (unsigned i = 0; i < size; i++) data[i] = index * 7 + i;
+}
+
+// Receive the next datagram, which must be the one with the given index
+static void receive(struct gbclient *client, unsigned char conn, unsigned index)
+{
+    unsigned char expect[MOBILE_MAX_TRANSFER_SIZE];
+    datagram_fill(expect, index);
+    unsigned size = datagram_size(index);
+
+    packet(client, MOBILE_COMMAND_DATA, &conn, 1);
+    if (client->reply_size != 1 + size) fail("wrong size", index);
+    if (memcmp(client->reply + 1, expect, size) != 0) {
+        fail("wrong contents", index);
+    }
+}
+
+int main(void)
+{
+    struct gbclient *client = malloc(sizeof(struct gbclient));
+    if (!client) abort();
+    gbclient_init(client);
+
+    packet(client, MOBILE_COMMAND_START, "NINTENDO", 8);
+    packet(client, MOBILE_COMMAND_TEL, "\x00" "#9677", 6);
+
+    // ID, password, DNS1 and DNS2
+    static const unsigned char login[] = {
+        4, 'g', '1', '0', '0',
+        4, 'p', 'a', 's', 's',
+        10, 0, 0, 1,
+        10, 0, 0, 2
+    };
+    packet(client, MOBILE_COMMAND_PPP_CONNECT, login, sizeof(login));
+
+    static const unsigned char addr[] = {127, 0, 0, 1, 0x23, 0x28};
+    packet(client, MOBILE_COMMAND_UDP_CONNECT, addr, sizeof(addr));
+    unsigned char conn = client->reply[0];
+
+    // Every datagram sent is echoed back into the same DATA packet
+    unsigned index = 0;
+    for (; index < 8; index++) {
+        unsigned char data[1 + MOBILE_MAX_TRANSFER_SIZE];
+        data[0] = conn;
+        datagram_fill(data + 1, index);
+        unsigned size = datagram_size(index);
+        packet(client, MOBILE_COMMAND_DATA, data, 1 + size);
+        if (client->reply_size != 1 + size ||
+                memcmp(client->reply + 1, data + 1, size) != 0) {
+            fail("wasn't echoed", index);
+        }
+    }
+
+    // Queue bursts of datagrams, giving the adapter the chance to read them
+    //   ahead between every DATA packet
+    unsigned long received = 0;
+    for (unsigned burst = 0; burst < BURSTS; burst++) {
+        unsigned first = index;
+        unsigned char data[MOBILE_MAX_TRANSFER_SIZE];
+        for (;;) {
+            datagram_fill(data, index);
+            if (!gbclient_datagram(client, conn, data,
+                    datagram_size(index))) {
+                break;
+            }
+            index++;
+        }
+        if (index == first) fail("couldn't be queued", index);
+
+        for (unsigned i = first; i < index; i++) {
+            for (unsigned x = 0; x < 4; x++) mobile_loop(client->adapter);
+            receive(client, conn, i);
+            received++;
+        }
+    }
+
+    // Nothing is left, DATA packets mustn't wait for more
+    uint64_t start = clock_ms();
+    for (unsigned i = 0; i < EMPTY_PACKETS; i++) {
+        packet(client, MOBILE_COMMAND_DATA, &conn, 1);
+        if (client->reply_size != 1) fail("unexpected", index);
+    }
+    uint64_t empty_ms = clock_ms() - start;
+    if (empty_ms >= 1000) {
+        fprintf(stderr, "udp: %u empty DATA packets took %lu ms\n",
+            EMPTY_PACKETS, (unsigned long)empty_ms);
+        return 1;
+    }
+
+    packet(client, MOBILE_COMMAND_UDP_DISCONNECT, &conn, 1);
+    packet(client, MOBILE_COMMAND_PPP_DISCONNECT, NULL, 0);
+    packet(client, MOBILE_COMMAND_OFFLINE, NULL, 0);
+    packet(client, MOBILE_COMMAND_END, NULL, 0);
+
+    printf("udp: %lu datagrams received, %u empty DATA in %lu ms\n",
+        received, EMPTY_PACKETS, (unsigned long)empty_ms);
+
+    gbclient_free(client);
+    free(client);
+    return 0;
+}
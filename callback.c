@@ -100,6 +100,19 @@ IMPL void mobile_impl_update_number(A_UNUSED void *user, A_UNUSED enum mobile_nu
 {
     return;
 }
+
+#endif
+
+// The notify callback is optional
+#ifdef MOBILE_ENABLE_IMPL_WEAK
+#ifdef A_WEAK
+A_WEAK void mobile_impl_notify(void *user);
+#define has_notify(adapter) (mobile_impl_notify != NULL)
+#else
+#define has_notify(adapter) false
+#endif
+#else
+#define has_notify(adapter) (adapter->callback.notify != NULL)
 #endif
 
 void mobile_callback_init(struct mobile_adapter *adapter)
@@ -113,6 +126,7 @@ void mobile_callback_init(struct mobile_adapter *adapter)
     adapter->callback.config_write = mobile_impl_config_write;
     adapter->callback.time_latch = mobile_impl_time_latch;
     adapter->callback.time_check_ms = mobile_impl_time_check_ms;
+    adapter->callback.time_now_ms = NULL;  // Optional, see timer.c
     adapter->callback.sock_open = mobile_impl_sock_open;
     adapter->callback.sock_close = mobile_impl_sock_close;
     adapter->callback.sock_connect = mobile_impl_sock_connect;
@@ -120,10 +134,22 @@ void mobile_callback_init(struct mobile_adapter *adapter)
     adapter->callback.sock_accept = mobile_impl_sock_accept;
     adapter->callback.sock_send = mobile_impl_sock_send;
     adapter->callback.sock_recv = mobile_impl_sock_recv;
+    adapter->callback.sock_poll = NULL;  // Optional, see commands.c
+    adapter->callback.dns_resolve = NULL;  // Optional, see commands.c
+    adapter->callback.dns_poll = NULL;  // Optional, see commands.c
     adapter->callback.update_number = mobile_impl_update_number;
+    adapter->callback.notify = NULL;  // Optional, see below
 #endif
 }
 
+// Wakes up the mobile_loop() thread, if the user is able to be woken up.
+void mobile_callback_notify(struct mobile_adapter *adapter)
+{
+    (void)adapter;
+    if (!has_notify(adapter)) return;
+    mobile_cb_notify(adapter);
+}
+
 #ifndef MOBILE_ENABLE_IMPL_WEAK
 #define def(name) \
 void mobile_def_ ## name(struct mobile_adapter *adapter, mobile_func_ ## name func) \
@@ -138,6 +164,7 @@ def(config_read)
 def(config_write)
 def(time_latch)
 def(time_check_ms)
+def(time_now_ms)
 def(sock_open)
 def(sock_close)
 def(sock_connect)
@@ -145,5 +172,9 @@ def(sock_listen)
 def(sock_accept)
 def(sock_send)
 def(sock_recv)
+def(sock_poll)
+def(dns_resolve)
+def(dns_poll)
 def(update_number)
+def(notify)
 #endif
@@ -10,8 +10,9 @@
 enum mobile_timers {
     MOBILE_TIMER_SERIAL,
     MOBILE_TIMER_COMMAND,
-    MOBILE_TIMER_RESERVED3,
-    MOBILE_TIMER_RESERVED4,
+    MOBILE_TIMER_DNS,
+    MOBILE_TIMER_DNS_PREFETCH,
+    MOBILE_TIMER_SOCKET_IO,
     _MOBILE_MAX_TIMERS
 };
 
@@ -24,6 +25,7 @@ struct mobile_adapter_callback {
     mobile_func_config_write config_write;
     mobile_func_time_latch time_latch;
     mobile_func_time_check_ms time_check_ms;
+    mobile_func_time_now_ms time_now_ms;
     mobile_func_sock_open sock_open;
     mobile_func_sock_close sock_close;
     mobile_func_sock_connect sock_connect;
@@ -31,10 +33,15 @@ struct mobile_adapter_callback {
     mobile_func_sock_accept sock_accept;
     mobile_func_sock_send sock_send;
     mobile_func_sock_recv sock_recv;
+    mobile_func_sock_poll sock_poll;
+    mobile_func_dns_resolve dns_resolve;
+    mobile_func_dns_poll dns_poll;
     mobile_func_update_number update_number;
+    mobile_func_notify notify;
 #endif
 };
 void mobile_callback_init(struct mobile_adapter *adapter);
+void mobile_callback_notify(struct mobile_adapter *adapter);
 
 #ifdef MOBILE_ENABLE_IMPL_WEAK
 #define mobile_cb(name, adapter, ...) \
@@ -55,6 +62,7 @@ void mobile_callback_init(struct mobile_adapter *adapter);
 #define mobile_cb_config_write(...) _mobile_cb(config_write, __VA_ARGS__)
 #define mobile_cb_time_latch(...) _mobile_cb(time_latch, __VA_ARGS__)
 #define mobile_cb_time_check_ms(...) _mobile_cb(time_check_ms, __VA_ARGS__)
+#define mobile_cb_time_now_ms(...) _mobile_cb(time_now_ms, __VA_ARGS__)
 #define mobile_cb_sock_open(...) _mobile_cb(sock_open, __VA_ARGS__)
 #define mobile_cb_sock_close(...) _mobile_cb(sock_close, __VA_ARGS__)
 #define mobile_cb_sock_connect(...) _mobile_cb(sock_connect, __VA_ARGS__)
@@ -62,4 +70,8 @@ void mobile_callback_init(struct mobile_adapter *adapter);
 #define mobile_cb_sock_accept(...) _mobile_cb(sock_accept, __VA_ARGS__)
 #define mobile_cb_sock_send(...) _mobile_cb(sock_send, __VA_ARGS__)
 #define mobile_cb_sock_recv(...) _mobile_cb(sock_recv, __VA_ARGS__)
+#define mobile_cb_sock_poll(...) _mobile_cb(sock_poll, __VA_ARGS__)
+#define mobile_cb_dns_resolve(...) _mobile_cb(dns_resolve, __VA_ARGS__)
+#define mobile_cb_dns_poll(...) _mobile_cb(dns_poll, __VA_ARGS__)
 #define mobile_cb_update_number(...) _mobile_cb(update_number, __VA_ARGS__)
+#define mobile_cb_notify(...) _mobile_cb(notify, __VA_ARGS__)
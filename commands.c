@@ -12,6 +12,40 @@
 #include <mobile_config.h>
 #endif
 
+// The sock_poll callback is optional, check if it has been provided
+#ifdef MOBILE_ENABLE_IMPL_WEAK
+#ifdef A_WEAK
+A_WEAK int mobile_impl_sock_poll(void *user, unsigned conn);
+#define has_sock_poll(adapter) (mobile_impl_sock_poll != NULL)
+#else
+#define has_sock_poll(adapter) false
+#endif
+#else
+#define has_sock_poll(adapter) (adapter->callback.sock_poll != NULL)
+#endif
+
+// The dns_resolve and dns_poll callbacks are optional, and only used together
+#ifdef MOBILE_ENABLE_IMPL_WEAK
+#ifdef A_WEAK
+A_WEAK bool mobile_impl_dns_resolve(void *user, const char *host, unsigned size);
+A_WEAK int mobile_impl_dns_poll(void *user, struct mobile_addr *addr);
+#define has_dns_resolve(adapter) \
+    (mobile_impl_dns_resolve != NULL && mobile_impl_dns_poll != NULL)
+#else
+#define has_dns_resolve(adapter) false
+#endif
+#else
+#define has_dns_resolve(adapter) \
+    (adapter->callback.dns_resolve != NULL && \
+     adapter->callback.dns_poll != NULL)
+#endif
+
+// UDP datagrams are only read ahead if the receive buffer can fit a whole one
+#define UDP_READ_AHEAD (MOBILE_RECV_BUFFER_SIZE > MOBILE_MAX_TRANSFER_SIZE)
+
+// Interval between background reads from connections that can't be polled
+#define SOCKET_IO_INTERVAL_MS 10
+
 // Accessible area of the mobile config by the game boy
 #define MOBILE_CONFIG_SIZE_REAL 0x100
 static_assert(MOBILE_CONFIG_SIZE >= MOBILE_CONFIG_SIZE_REAL,
@@ -24,6 +58,26 @@ static_assert(MOBILE_CONFIG_SIZE >= MOBILE_CONFIG_SIZE_REAL,
 
 // Connection number to use for p2p comms
 static const int p2p_conn = 0;
+static_assert(MOBILE_GAME_CONNECTIONS >= 1,
+    "The game needs at least one connection!");
+
+// Mask of the connection numbers below <n>, which must be at least 1
+#define conn_mask(n) ((mobile_connmask)((2UL << ((n) - 1)) - 1))
+#define conn_bit(conn) ((mobile_connmask)1 << (conn))
+
+// Connections the game can use, and the ones used for the library's own
+//   requests, which exclude the one reserved for MOBILE_NUMBER_FETCH_CONN.
+#define GAME_CONNS conn_mask(MOBILE_GAME_CONNECTIONS)
+#if MOBILE_INTERNAL_CONNECTIONS > 1
+#define INTERNAL_CONNS (conn_mask(MOBILE_MAX_CONNECTIONS - 1) & ~GAME_CONNS)
+#elif MOBILE_INTERNAL_CONNECTIONS
+#define INTERNAL_CONNS (conn_mask(MOBILE_MAX_CONNECTIONS) & ~GAME_CONNS)
+#else
+#define INTERNAL_CONNS GAME_CONNS
+#endif
+
+// Stored in place of a connection number when there's no connection
+#define CONN_NONE 0xFF
 
 // Static keys
 static const char nintendo[] PROGMEM = {
@@ -54,6 +108,8 @@ void mobile_commands_init(struct mobile_adapter *adapter)
 {
     adapter->commands.session_started = false;
     adapter->commands.mode_32bit = false;
+    adapter->commands.state = MOBILE_CONNECTION_DISCONNECTED;
+    mobile_stats_reset(adapter);
 }
 
 static struct mobile_packet *error_packet(struct mobile_packet *packet, unsigned char error)
@@ -66,17 +122,195 @@ static struct mobile_packet *error_packet(struct mobile_packet *packet, unsigned
     return packet;
 }
 
+// Find the lowest free connection among the ones in <mask>
+static int connection_alloc(struct mobile_adapter *adapter, mobile_connmask mask)
+{
+    mobile_connmask free = mask & ~adapter->commands.connections;
+    if (!free) return -1;
+
+    int conn = 0;
+    while (!(free & 1)) {
+        free >>= 1;
+        conn++;
+    }
+    return conn;
+}
+
 static int connection_new(struct mobile_adapter *adapter)
+{
+    return connection_alloc(adapter, GAME_CONNS);
+}
+
+// Find a free connection for a request made by the library itself
+static int connection_new_internal(struct mobile_adapter *adapter)
+{
+    return connection_alloc(adapter, INTERNAL_CONNS);
+}
+
+static bool connection_open(struct mobile_adapter *adapter, unsigned char conn)
+{
+    return adapter->commands.connections & conn_bit(conn);
+}
+
+static void connection_close(struct mobile_adapter *adapter, unsigned char conn)
 {
     struct mobile_adapter_commands *s = &adapter->commands;
 
-    // Find a free connection slot
-    unsigned char conn;
-    for (conn = 0; conn < MOBILE_MAX_CONNECTIONS; conn++) {
-        if (!s->connections[conn]) break;
+    mobile_cb_sock_close(adapter, conn);
+    s->connections &= ~conn_bit(conn);
+
+    // Internal connections don't have any of the state below
+    if (conn >= MOBILE_GAME_CONNECTIONS) return;
+    s->udp_addr[conn].type = MOBILE_ADDRTYPE_NONE;
+#if MOBILE_RECV_BUFFER_SIZE
+    s->recv[conn].head = 0;
+    s->recv[conn].size = 0;
+    s->recv[conn].error = 0;
+#endif
+#if MOBILE_SEND_BUFFER_SIZE
+    s->send[conn].head = 0;
+    s->send[conn].size = 0;
+    s->send[conn].error = 0;
+#endif
+}
+
+// Whether a connection has been opened by the UDP_CONNECT command
+static bool connection_udp(struct mobile_adapter *adapter, unsigned char conn)
+{
+    return adapter->commands.udp_addr[conn].type != MOBILE_ADDRTYPE_NONE;
+}
+
+// Check whether a connection is ready for any of the specified
+//   MOBILE_SOCKPOLL_* events.
+// Without a sock_poll callback, or if it fails, the connection is assumed to
+//   be ready, and the socket functions are left to figure it out.
+static bool connection_ready(struct mobile_adapter *adapter, unsigned char conn, int events)
+{
+    if (!has_sock_poll(adapter)) return true;
+    int rc = mobile_cb_sock_poll(adapter, conn);
+    if (rc < 0) return true;
+    return rc & events;
+}
+
+// Receive data from a connection, taking any data read ahead of time by
+//   mobile_commands_socket_io() first.
+// UDP connections receive a single datagram at a time.
+// Returns 0 without calling sock_recv if the connection has nothing to offer.
+static int connection_recv(struct mobile_adapter *adapter, unsigned char conn, unsigned char *data, unsigned size)
+{
+#if MOBILE_RECV_BUFFER_SIZE
+    struct mobile_commands_recv *r = &adapter->commands.recv[conn];
+
+#if UDP_READ_AHEAD
+    if (r->size && connection_udp(adapter, conn)) {
+        unsigned length = r->data[r->head];
+        if (size > length) size = length;
+        memcpy(data, r->data + r->head + 1, size);
+
+        r->head += 1 + length;
+        r->size -= 1 + length;
+        if (!r->size) r->head = 0;
+        return size;
     }
-    if (conn >= MOBILE_MAX_CONNECTIONS) return -1;
-    return conn;
+#endif
+    if (r->size) {
+        if (size > r->size) size = r->size;
+        unsigned first = MOBILE_RECV_BUFFER_SIZE - r->head;
+        if (first > size) first = size;
+        memcpy(data, r->data + r->head, first);
+        memcpy(data + first, r->data, size - first);
+
+        r->head = (r->head + size) % MOBILE_RECV_BUFFER_SIZE;
+        r->size -= size;
+        if (!r->size) r->head = 0;
+        return size;
+    }
+    if (r->error) {
+        int rc = r->error;
+        r->error = 0;
+        return rc;
+    }
+#endif
+
+    if (!connection_ready(adapter, conn,
+            MOBILE_SOCKPOLL_READABLE | MOBILE_SOCKPOLL_HANGUP)) {
+        return 0;
+    }
+    return mobile_cb_sock_recv(adapter, conn, data, size, NULL);
+}
+
+#if MOBILE_SEND_BUFFER_SIZE
+// Send as much of the queued data as the connection accepts right now.
+// Errors stick until the connection is closed.
+static int connection_flush(struct mobile_adapter *adapter, unsigned char conn)
+{
+    struct mobile_commands_send *q = &adapter->commands.send[conn];
+
+    if (!q->size || q->error) return q->error;
+    if (!connection_ready(adapter, conn,
+            MOBILE_SOCKPOLL_WRITABLE | MOBILE_SOCKPOLL_HANGUP)) {
+        return 0;
+    }
+
+    while (q->size && !q->error) {
+        unsigned size = MOBILE_SEND_BUFFER_SIZE - q->head;
+        if (size > q->size) size = q->size;
+
+        int rc = mobile_cb_sock_send(adapter, conn, q->data + q->head, size,
+            NULL);
+        if (rc < 0) {
+            q->error = rc;
+            break;
+        }
+        q->head = (q->head + rc) % MOBILE_SEND_BUFFER_SIZE;
+        q->size -= rc;
+        if ((unsigned)rc < size) break;
+    }
+    if (!q->size) q->head = 0;
+    return q->error;
+}
+#endif
+
+// Send data over a connection, queueing whatever can't be sent right away.
+// UDP connections send the data as a single datagram, which is never queued.
+// Returns the amount of data that was either sent or queued.
+static int connection_send(struct mobile_adapter *adapter, unsigned char conn, const unsigned char *data, unsigned size)
+{
+    if (connection_udp(adapter, conn)) {
+        int rc = mobile_cb_sock_send(adapter, conn, data, size,
+            &adapter->commands.udp_addr[conn]);
+        if (rc > 0) return size;
+        return rc;
+    }
+
+#if MOBILE_SEND_BUFFER_SIZE
+    struct mobile_commands_send *q = &adapter->commands.send[conn];
+
+    int rc = connection_flush(adapter, conn);
+    if (rc < 0) return rc;
+
+    unsigned sent = 0;
+    if (!q->size) {
+        rc = mobile_cb_sock_send(adapter, conn, data, size, NULL);
+        if (rc < 0) return rc;
+        sent = rc;
+    }
+
+    unsigned queue = size - sent;
+    if (queue > MOBILE_SEND_BUFFER_SIZE - q->size) {
+        queue = MOBILE_SEND_BUFFER_SIZE - q->size;
+    }
+    unsigned tail = (q->head + q->size) % MOBILE_SEND_BUFFER_SIZE;
+    unsigned first = MOBILE_SEND_BUFFER_SIZE - tail;
+    if (first > queue) first = queue;
+    memcpy(q->data + tail, data + sent, first);
+    memcpy(q->data, data + sent + first, queue - first);
+    q->size += queue;
+
+    return sent + queue;
+#else
+    return mobile_cb_sock_send(adapter, conn, data, size, NULL);
+#endif
 }
 
 static bool do_ppp_disconnect(struct mobile_adapter *adapter)
@@ -86,11 +320,15 @@ static bool do_ppp_disconnect(struct mobile_adapter *adapter)
     // Clean up internet connections if connected to the internet
     if (s->state != MOBILE_CONNECTION_INTERNET) return false;
     for (unsigned char conn = 0; conn < MOBILE_MAX_CONNECTIONS; conn++) {
-        if (s->connections[conn]) {
-            mobile_cb_sock_close(adapter, conn);
-            s->connections[conn] = false;
-        }
+        if (connection_open(adapter, conn)) connection_close(adapter, conn);
     }
+#if MOBILE_INTERNAL_CONNECTIONS
+    s->dns_conn = CONN_NONE;
+#endif
+#if MOBILE_DNS_PREFETCH_SIZE
+    s->dns_prefetch_send = false;
+    mobile_dns_prefetch_cancel(adapter);
+#endif
     s->state = MOBILE_CONNECTION_CALL_ISP;
     return true;
 }
@@ -111,9 +349,8 @@ static bool do_offline(struct mobile_adapter *adapter)
     mobile_cb_update_number(adapter, MOBILE_NUMBER_PEER, NULL);
 
     // Clean up p2p connections if in a call
-    if (s->connections[p2p_conn]) {
-        mobile_cb_sock_close(adapter, p2p_conn);
-        s->connections[p2p_conn] = false;
+    if (connection_open(adapter, p2p_conn)) {
+        connection_close(adapter, p2p_conn);
     }
 
     s->state = MOBILE_CONNECTION_DISCONNECTED;
@@ -128,7 +365,7 @@ static void do_end_session(struct mobile_adapter *adapter)
 
     // Clean up a possibly residual connection that wasn't established by
     //   the command_wait_call function
-    if (s->connections[p2p_conn]) mobile_cb_sock_close(adapter, p2p_conn);
+    if (connection_open(adapter, p2p_conn)) mobile_cb_sock_close(adapter, p2p_conn);
 
     s->session_started = false;
     s->mode_32bit = false;
@@ -140,9 +377,19 @@ static void do_start_session(struct mobile_adapter *adapter)
 
     s->session_started = true;
     s->state = MOBILE_CONNECTION_DISCONNECTED;
-    memset(s->connections, false, sizeof(s->connections));
+    s->connections = 0;
+    memset(s->udp_addr, 0, sizeof(s->udp_addr));
+#if MOBILE_RECV_BUFFER_SIZE
+    memset(s->recv, 0, sizeof(s->recv));
+#endif
+#if MOBILE_SEND_BUFFER_SIZE
+    memset(s->send, 0, sizeof(s->send));
+#endif
 
     mobile_number_fetch_cancel(adapter);
+
+    // Background I/O may be tried right away, see mobile_commands_socket_io()
+    mobile_timer_latch(adapter, MOBILE_TIMER_SOCKET_IO);
 }
 
 void mobile_commands_reset(struct mobile_adapter *adapter)
@@ -202,18 +449,11 @@ static struct mobile_packet *command_tel_begin(struct mobile_adapter *adapter, s
     struct mobile_adapter_commands *s = &adapter->commands;
     struct mobile_buffer_commands *b = &adapter->buffer.commands;
 
-    if (s->state != MOBILE_CONNECTION_DISCONNECTED &&
-            s->state != MOBILE_CONNECTION_WAIT &&
-            s->state != MOBILE_CONNECTION_WAIT_RELAY &&
-            s->state != MOBILE_CONNECTION_WAIT_TIMEOUT) {
-        return error_packet(packet, 1);
-    }
     if (packet->length < 1) return error_packet(packet, 2);
 
     // Close any connection created by command_wait_call
-    if (s->connections[p2p_conn]) {
-        mobile_cb_sock_close(adapter, p2p_conn);
-        s->connections[p2p_conn] = false;
+    if (connection_open(adapter, p2p_conn)) {
+        connection_close(adapter, p2p_conn);
     }
     s->state = MOBILE_CONNECTION_DISCONNECTED;
 
@@ -274,7 +514,7 @@ static struct mobile_packet *command_tel_begin(struct mobile_adapter *adapter, s
                 b->processing_addr.type, 0)) {
             return error_packet(packet, 3);
         }
-        s->connections[p2p_conn] = true;
+        s->connections |= conn_bit(p2p_conn);
 
         b->processing = PROCESS_TEL_RELAY;
         return NULL;
@@ -294,7 +534,7 @@ static struct mobile_packet *command_tel_begin(struct mobile_adapter *adapter, s
                 b->processing_addr.type, 0)) {
             return error_packet(packet, 3);
         }
-        s->connections[p2p_conn] = true;
+        s->connections |= conn_bit(p2p_conn);
 
         b->processing = PROCESS_TEL_IP;
         return NULL;
@@ -312,8 +552,7 @@ static struct mobile_packet *command_tel_ip(struct mobile_adapter *adapter, stru
     int rc = mobile_cb_sock_connect(adapter, p2p_conn, &b->processing_addr);
     if (rc == 0) return NULL;
     if (rc < 0) {
-        mobile_cb_sock_close(adapter, p2p_conn);
-        s->connections[p2p_conn] = false;
+        connection_close(adapter, p2p_conn);
         return error_packet(packet, 3);
     }
 
@@ -339,8 +578,7 @@ static struct mobile_packet *command_tel_relay(struct mobile_adapter *adapter, s
         (char *)packet->data + 1, packet->length - 1);
     if (rc == 0) return NULL;
     if (rc < 0) {
-        mobile_cb_sock_close(adapter, p2p_conn);
-        s->connections[p2p_conn] = false;
+        connection_close(adapter, p2p_conn);
         return error_packet(packet, 3);
     }
 
@@ -354,8 +592,7 @@ static struct mobile_packet *command_tel_relay(struct mobile_adapter *adapter, s
         default: errcode = 3; break;
     }
     if (errcode != -1) {
-        mobile_cb_sock_close(adapter, p2p_conn);
-        s->connections[p2p_conn] = false;
+        connection_close(adapter, p2p_conn);
         return error_packet(packet, errcode);
     }
 
@@ -373,26 +610,23 @@ static struct mobile_packet *command_tel_relay(struct mobile_adapter *adapter, s
 // 4 - "REDIAL ERROR"
 static struct mobile_packet *command_tel(struct mobile_adapter *adapter, struct mobile_packet *packet)
 {
-    struct mobile_adapter_commands *s = &adapter->commands;
     struct mobile_buffer_commands *b = &adapter->buffer.commands;
 
     switch (b->processing) {
     case PROCESS_TEL_BEGIN:
-        mobile_cb_time_latch(adapter, MOBILE_TIMER_COMMAND);
+        mobile_timer_latch(adapter, MOBILE_TIMER_COMMAND);
         return command_tel_begin(adapter, packet);
 
     case PROCESS_TEL_IP:
-        if (mobile_cb_time_check_ms(adapter, MOBILE_TIMER_COMMAND, 60000)) {
-            mobile_cb_sock_close(adapter, p2p_conn);
-            s->connections[p2p_conn] = false;
+        if (mobile_timer_check_ms(adapter, MOBILE_TIMER_COMMAND, 60000)) {
+            connection_close(adapter, p2p_conn);
             return error_packet(packet, 3);
         }
         return command_tel_ip(adapter, packet);
 
     case PROCESS_TEL_RELAY:
-        if (mobile_cb_time_check_ms(adapter, MOBILE_TIMER_COMMAND, 60000)) {
-            mobile_cb_sock_close(adapter, p2p_conn);
-            s->connections[p2p_conn] = false;
+        if (mobile_timer_check_ms(adapter, MOBILE_TIMER_COMMAND, 60000)) {
+            connection_close(adapter, p2p_conn);
             return error_packet(packet, 3);
         }
         return command_tel_relay(adapter, packet);
@@ -433,7 +667,7 @@ static struct mobile_packet *command_wait_call_begin(struct mobile_adapter *adap
                 b->processing_addr.type, 0)) {
             return error_packet(packet, 0);
         }
-        s->connections[p2p_conn] = true;
+        s->connections |= conn_bit(p2p_conn);
 
         s->state = MOBILE_CONNECTION_WAIT_RELAY;
         return NULL;
@@ -448,7 +682,7 @@ static struct mobile_packet *command_wait_call_begin(struct mobile_adapter *adap
         mobile_cb_sock_close(adapter, p2p_conn);
         return error_packet(packet, 0);
     }
-    s->connections[p2p_conn] = true;
+    s->connections |= conn_bit(p2p_conn);
 
     s->state = MOBILE_CONNECTION_WAIT;
     return NULL;
@@ -476,8 +710,7 @@ static struct mobile_packet *command_wait_call_relay(struct mobile_adapter *adap
     int rc = mobile_relay_proc_wait(adapter, p2p_conn, &b->processing_addr);
     if (rc == 0) return NULL;
     if (rc < 0) {
-        mobile_cb_sock_close(adapter, p2p_conn);
-        s->connections[p2p_conn] = false;
+        connection_close(adapter, p2p_conn);
         s->state = MOBILE_CONNECTION_WAIT_TIMEOUT;
         return error_packet(packet, 3);
     }
@@ -490,8 +723,7 @@ static struct mobile_packet *command_wait_call_relay(struct mobile_adapter *adap
         default: errcode = 3; break;
     }
     if (errcode != -1) {
-        mobile_cb_sock_close(adapter, p2p_conn);
-        s->connections[p2p_conn] = false;
+        connection_close(adapter, p2p_conn);
         s->state = MOBILE_CONNECTION_WAIT_TIMEOUT;
         return error_packet(packet, errcode);
     }
@@ -511,24 +743,17 @@ static struct mobile_packet *command_wait_call(struct mobile_adapter *adapter, s
     struct mobile_adapter_commands *s = &adapter->commands;
     struct mobile_buffer_commands *b = &adapter->buffer.commands;
 
-    if (s->state != MOBILE_CONNECTION_DISCONNECTED &&
-            s->state != MOBILE_CONNECTION_WAIT &&
-            s->state != MOBILE_CONNECTION_WAIT_RELAY &&
-            s->state != MOBILE_CONNECTION_WAIT_TIMEOUT) {
-        return error_packet(packet, 1);
-    }
-
     if (b->processing == PROCESS_WAIT_CALL_INIT) {
         // If a previous timeout is in effect, wait it out
         if (s->state == MOBILE_CONNECTION_WAIT_TIMEOUT) {
-            if (!mobile_cb_time_check_ms(adapter, MOBILE_TIMER_COMMAND,
+            if (!mobile_timer_check_ms(adapter, MOBILE_TIMER_COMMAND,
                     1000)) {
                 return NULL;
             }
             s->state = MOBILE_CONNECTION_DISCONNECTED;
         }
 
-        mobile_cb_time_latch(adapter, MOBILE_TIMER_COMMAND);
+        mobile_timer_latch(adapter, MOBILE_TIMER_COMMAND);
         b->processing = PROCESS_WAIT_CALL_INIT_DONE;
     }
 
@@ -540,18 +765,17 @@ static struct mobile_packet *command_wait_call(struct mobile_adapter *adapter, s
         return command_wait_call_begin(adapter, packet);
 
     case MOBILE_CONNECTION_WAIT:
-        if (mobile_cb_time_check_ms(adapter, MOBILE_TIMER_COMMAND, 1000)) {
+        if (mobile_timer_check_ms(adapter, MOBILE_TIMER_COMMAND, 1000)) {
             return error_packet(packet, 0);
         }
         return command_wait_call_ip(adapter, packet);
 
     case MOBILE_CONNECTION_WAIT_RELAY:
-        if (mobile_cb_time_check_ms(adapter, MOBILE_TIMER_COMMAND, 1000)) {
+        if (mobile_timer_check_ms(adapter, MOBILE_TIMER_COMMAND, 1000)) {
             // If not done connecting to the server, the connection is hanging
             // Treat it as if the connection failed
             if (adapter->relay.state != MOBILE_RELAY_RECV_WAIT) {
-                mobile_cb_sock_close(adapter, p2p_conn);
-                s->connections[p2p_conn] = false;
+                connection_close(adapter, p2p_conn);
                 s->state = MOBILE_CONNECTION_DISCONNECTED;
                 return error_packet(packet, 3);
             }
@@ -563,7 +787,8 @@ static struct mobile_packet *command_wait_call(struct mobile_adapter *adapter, s
 
 enum process_data {
     PROCESS_DATA_INIT,
-    PROCESS_DATA_INIT_DONE
+    PROCESS_DATA_INIT_DONE,
+    PROCESS_DATA_REMOTE_CLOSED
 };
 
 enum procdata_data {
@@ -578,11 +803,6 @@ static struct mobile_packet *command_data(struct mobile_adapter *adapter, struct
     struct mobile_adapter_commands *s = &adapter->commands;
     struct mobile_buffer_commands *b = &adapter->buffer.commands;
 
-    if (s->state != MOBILE_CONNECTION_CALL &&
-            s->state != MOBILE_CONNECTION_CALL_RECV &&
-            s->state != MOBILE_CONNECTION_INTERNET) {
-        return error_packet(packet, 1);
-    }
     if (packet->length < 1) return error_packet(packet, 0);
     const bool internet = s->state == MOBILE_CONNECTION_INTERNET;
 
@@ -591,13 +811,13 @@ static struct mobile_packet *command_data(struct mobile_adapter *adapter, struct
     // P2P connections use ID 0xff, but the adapter ignores this
     if (!internet) conn = p2p_conn;
 
-    if (conn >= MOBILE_MAX_CONNECTIONS || !s->connections[conn]) {
+    if (conn >= MOBILE_GAME_CONNECTIONS || !connection_open(adapter, conn)) {
         return error_packet(packet, 0);
     }
 
     if (b->processing == PROCESS_DATA_INIT) {
         b->processing_data[PROCDATA_DATA_SENT_SIZE] = 0;
-        mobile_cb_time_latch(adapter, MOBILE_TIMER_COMMAND);
+        mobile_timer_latch(adapter, MOBILE_TIMER_COMMAND);
         b->processing = PROCESS_DATA_INIT_DONE;
     }
 
@@ -606,8 +826,8 @@ static struct mobile_packet *command_data(struct mobile_adapter *adapter, struct
     unsigned send_size = packet->length - 1;
 
     if (send_size > sent_size) {
-        int rc = mobile_cb_sock_send(adapter, conn, data + sent_size,
-            send_size - sent_size, NULL);
+        int rc = connection_send(adapter, conn, data + sent_size,
+            send_size - sent_size);
         if (rc < 0) return error_packet(packet, 0);
         sent_size += rc;
         b->processing_data[PROCDATA_DATA_SENT_SIZE] = sent_size;
@@ -615,7 +835,7 @@ static struct mobile_packet *command_data(struct mobile_adapter *adapter, struct
         // Attempt to send again while not everything has been sent
         if (send_size > sent_size) {
             // TODO: Verify the timeout with a game
-            if (mobile_cb_time_check_ms(adapter, MOBILE_TIMER_COMMAND,
+            if (mobile_timer_check_ms(adapter, MOBILE_TIMER_COMMAND,
                     10000)) {
                 return error_packet(packet, 0);
             }
@@ -623,15 +843,34 @@ static struct mobile_packet *command_data(struct mobile_adapter *adapter, struct
         }
     }
 
-    int recv_size = mobile_cb_sock_recv(adapter, conn, data,
-        MOBILE_MAX_TRANSFER_SIZE, NULL);
+    int recv_size = -2;
+    if (b->processing != PROCESS_DATA_REMOTE_CLOSED) {
+        recv_size = connection_recv(adapter, conn, data,
+            MOBILE_MAX_TRANSFER_SIZE);
+    }
 
     if (recv_size == -2) {
         // If connected to the internet, and a disconnect is received, we
         // should inform the game about a remote disconnect.
         if (internet) {
-            mobile_cb_sock_close(adapter, conn);
-            s->connections[conn] = false;
+#if MOBILE_SEND_BUFFER_SIZE
+            // The remote may only have shut down its end, give any queued
+            //   data a chance to be sent before closing.
+            b->processing = PROCESS_DATA_REMOTE_CLOSED;
+            int rc = connection_flush(adapter, conn);
+            if (rc == 0 && s->send[conn].size) {
+                if (!mobile_timer_check_ms(adapter, MOBILE_TIMER_COMMAND,
+                        10000)) {
+                    return NULL;
+                }
+                rc = -1;
+            }
+            if (rc < 0) {
+                connection_close(adapter, conn);
+                return error_packet(packet, 0);
+            }
+#endif
+            connection_close(adapter, conn);
             packet->command = MOBILE_COMMAND_DATA_END;
         }
         packet->length = 1;
@@ -645,9 +884,10 @@ static struct mobile_packet *command_data(struct mobile_adapter *adapter, struct
     if (recv_size < 0) return error_packet(packet, 0);
 
     // If nothing was sent, try to receive for at least one second
-    // TODO: Don't delay for UDP connections
+    // UDP connections return right away, as there's no stream to wait on
     if (internet && !send_size && !recv_size &&
-            !mobile_cb_time_check_ms(adapter, MOBILE_TIMER_COMMAND, 1000)) {
+            !connection_udp(adapter, conn) &&
+            !mobile_timer_check_ms(adapter, MOBILE_TIMER_COMMAND, 1000)) {
         return NULL;
     }
 
@@ -782,12 +1022,10 @@ static struct mobile_packet *command_ppp_connect(struct mobile_adapter *adapter,
 
     // TODO: The original adapter allows logging in multiple times without
     //         logging out first, but I'm unsure if that's a bug.
-    if (s->state != MOBILE_CONNECTION_CALL_ISP) {
-        return error_packet(packet, 1);
-    }
+    //       Only CALL_ISP is accepted, see the command table.
 
     // Make sure we aren't connected to an actual phone
-    if (s->connections[p2p_conn]) return error_packet(packet, 3);
+    if (connection_open(adapter, p2p_conn)) return error_packet(packet, 3);
 
     const unsigned char *data = packet->data;
     if (packet->data + packet->length < data + 1) {
@@ -838,6 +1076,16 @@ static struct mobile_packet *command_ppp_connect(struct mobile_adapter *adapter,
     }
 
     s->dns2_use = 0;
+#if MOBILE_INTERNAL_CONNECTIONS
+    s->dns_conn = CONN_NONE;
+#endif
+#ifdef MOBILE_ENABLE_DNS_RACE
+    memset(s->dns_server, 0, sizeof(s->dns_server));
+#endif
+#if MOBILE_DNS_PREFETCH_SIZE
+    // Look up the prefetch list once the reply is out of the way
+    s->dns_prefetch_send = !has_dns_resolve(adapter);
+#endif
     s->state = MOBILE_CONNECTION_INTERNET;
 
     // Return 3 IP addresses, the phone's IP, and the chosen DNS servers.
@@ -874,19 +1122,31 @@ static struct mobile_packet *command_tcp_connect_begin(struct mobile_adapter *ad
     struct mobile_adapter_commands *s = &adapter->commands;
     struct mobile_buffer_commands *b = &adapter->buffer.commands;
 
-    if (s->state != MOBILE_CONNECTION_INTERNET) {
-        return error_packet(packet, 1);
-    }
     if (packet->length < 6) return error_packet(packet, 3);
 
     int conn = connection_new(adapter);
     if (conn < 0) return error_packet(packet, 0);
 
+    // Addresses handed out by DNS_REQUEST in place of an IPv6 host are
+    //   connected to through IPv6
+    unsigned port = packet->data[4] << 8 | packet->data[5];
+    struct mobile_addr6 *addr6 = (struct mobile_addr6 *)&b->processing_addr;
+    if (mobile_dns_token_get(adapter, packet->data, addr6->host)) {
+        addr6->type = MOBILE_ADDRTYPE_IPV6;
+        addr6->port = port;
+    } else {
+        struct mobile_addr4 *addr4 =
+            (struct mobile_addr4 *)&b->processing_addr;
+        addr4->type = MOBILE_ADDRTYPE_IPV4;
+        addr4->port = port;
+        memcpy(addr4->host, packet->data, MOBILE_HOSTLEN_IPV4);
+    }
+
     if (!mobile_cb_sock_open(adapter, conn, MOBILE_SOCKTYPE_TCP,
-            MOBILE_ADDRTYPE_IPV4, 0)) {
+            b->processing_addr.type, 0)) {
         return error_packet(packet, 3);
     }
-    s->connections[conn] = true;
+    s->connections |= conn_bit(conn);
 
     b->processing_data[PROCDATA_TCP_CONNECT_CONN] = conn;
     b->processing = PROCESS_TCP_CONNECT_CONNECTING;
@@ -895,23 +1155,14 @@ static struct mobile_packet *command_tcp_connect_begin(struct mobile_adapter *ad
 
 static struct mobile_packet *command_tcp_connect_connecting(struct mobile_adapter *adapter, struct mobile_packet *packet)
 {
-    struct mobile_adapter_commands *s = &adapter->commands;
     struct mobile_buffer_commands *b = &adapter->buffer.commands;
 
     unsigned char conn = b->processing_data[PROCDATA_TCP_CONNECT_CONN];
 
-    struct mobile_addr4 addr = {
-        .type = MOBILE_ADDRTYPE_IPV4,
-        .port = packet->data[4] << 8 | packet->data[5],
-    };
-    memcpy(addr.host, packet->data, 4);
-
-    int rc = mobile_cb_sock_connect(adapter, conn,
-        (struct mobile_addr *)&addr);
+    int rc = mobile_cb_sock_connect(adapter, conn, &b->processing_addr);
     if (rc == 0) return NULL;
     if (rc < 0) {
-        mobile_cb_sock_close(adapter, conn);
-        s->connections[conn] = false;
+        connection_close(adapter, conn);
         return error_packet(packet, 3);
     }
 
@@ -926,21 +1177,19 @@ static struct mobile_packet *command_tcp_connect_connecting(struct mobile_adapte
 // 3 - Connection failed
 static struct mobile_packet *command_tcp_connect(struct mobile_adapter *adapter, struct mobile_packet *packet)
 {
-    struct mobile_adapter_commands *s = &adapter->commands;
     struct mobile_buffer_commands *b = &adapter->buffer.commands;
 
     switch (b->processing) {
     case PROCESS_TCP_CONNECT_BEGIN:
-        mobile_cb_time_latch(adapter, MOBILE_TIMER_COMMAND);
+        mobile_timer_latch(adapter, MOBILE_TIMER_COMMAND);
         return command_tcp_connect_begin(adapter, packet);
 
     case PROCESS_TCP_CONNECT_CONNECTING:
         // TODO: Verify this timeout with a game
-        if (mobile_cb_time_check_ms(adapter, MOBILE_TIMER_COMMAND, 60000)) {
+        if (mobile_timer_check_ms(adapter, MOBILE_TIMER_COMMAND, 60000)) {
             unsigned char conn =
                 b->processing_data[PROCDATA_TCP_CONNECT_CONN];
-            mobile_cb_sock_close(adapter, conn);
-            s->connections[conn] = false;
+            connection_close(adapter, conn);
             return error_packet(packet, 3);
         }
         return command_tcp_connect_connecting(adapter, packet);
@@ -950,27 +1199,44 @@ static struct mobile_packet *command_tcp_connect(struct mobile_adapter *adapter,
     }
 }
 
+enum process_tcp_disconnect {
+    PROCESS_TCP_DISCONNECT_INIT,
+    PROCESS_TCP_DISCONNECT_FLUSH
+};
+
 // Errors:
 // 0 - Invalid connection (Not connected)
 // 1 - Invalid use (Not logged in)
 // 2 - Unknown error (???)
 static struct mobile_packet *command_tcp_disconnect(struct mobile_adapter *adapter, struct mobile_packet *packet)
 {
+#if MOBILE_SEND_BUFFER_SIZE
     struct mobile_adapter_commands *s = &adapter->commands;
+    struct mobile_buffer_commands *b = &adapter->buffer.commands;
+#endif
 
-    if (s->state != MOBILE_CONNECTION_INTERNET) {
-        return error_packet(packet, 1);
-    }
     if (packet->length < 1) {
         return error_packet(packet, 0);
     }
 
     unsigned char conn = packet->data[0];
-    if (conn >= MOBILE_MAX_CONNECTIONS || !s->connections[conn]) {
+    if (conn >= MOBILE_GAME_CONNECTIONS || !connection_open(adapter, conn) ||
+            connection_udp(adapter, conn)) {
         return error_packet(packet, 0);  // UNKERR
     }
-    mobile_cb_sock_close(adapter, conn);
-    s->connections[conn] = false;
+
+#if MOBILE_SEND_BUFFER_SIZE
+    // Give any queued data a chance to be sent before closing
+    if (b->processing == PROCESS_TCP_DISCONNECT_INIT) {
+        mobile_timer_latch(adapter, MOBILE_TIMER_COMMAND);
+        b->processing = PROCESS_TCP_DISCONNECT_FLUSH;
+    }
+    if (connection_flush(adapter, conn) == 0 && s->send[conn].size &&
+            !mobile_timer_check_ms(adapter, MOBILE_TIMER_COMMAND, 10000)) {
+        return NULL;
+    }
+#endif
+    connection_close(adapter, conn);
 
     packet->length = 1;
     return packet;
@@ -982,9 +1248,39 @@ static struct mobile_packet *command_tcp_disconnect(struct mobile_adapter *adapt
 // 2 - Connection failed (though this can't happen)
 static struct mobile_packet *command_udp_connect(struct mobile_adapter *adapter, struct mobile_packet *packet)
 {
-    // TODO: Implement
-    (void)adapter;
-    return error_packet(packet, 1);
+    struct mobile_adapter_commands *s = &adapter->commands;
+
+    if (packet->length < 6) return error_packet(packet, 2);
+
+    int conn = connection_new(adapter);
+    if (conn < 0) return error_packet(packet, 0);
+
+    // There's nothing to connect, every datagram is sent to this address.
+    // Like with TCP_CONNECT, tokens handed out by DNS_REQUEST are mapped back
+    //   to their IPv6 host.
+    struct mobile_addr addr;
+    unsigned port = packet->data[4] << 8 | packet->data[5];
+    struct mobile_addr6 *addr6 = (struct mobile_addr6 *)&addr;
+    if (mobile_dns_token_get(adapter, packet->data, addr6->host)) {
+        addr6->type = MOBILE_ADDRTYPE_IPV6;
+        addr6->port = port;
+    } else {
+        struct mobile_addr4 *addr4 = (struct mobile_addr4 *)&addr;
+        addr4->type = MOBILE_ADDRTYPE_IPV4;
+        addr4->port = port;
+        memcpy(addr4->host, packet->data, MOBILE_HOSTLEN_IPV4);
+    }
+
+    if (!mobile_cb_sock_open(adapter, conn, MOBILE_SOCKTYPE_UDP,
+            addr.type, 0)) {
+        return error_packet(packet, 2);
+    }
+    s->connections |= conn_bit(conn);
+    s->udp_addr[conn] = addr;
+
+    packet->data[0] = conn;
+    packet->length = 1;
+    return packet;
 }
 
 // Errors:
@@ -993,19 +1289,41 @@ static struct mobile_packet *command_udp_connect(struct mobile_adapter *adapter,
 // 2 - Unknown error (???)
 static struct mobile_packet *command_udp_disconnect(struct mobile_adapter *adapter, struct mobile_packet *packet)
 {
-    // TODO: Implement
-    (void)adapter;
-    return error_packet(packet, 1);
+    if (packet->length < 1) {
+        return error_packet(packet, 0);
+    }
+
+    unsigned char conn = packet->data[0];
+    if (conn >= MOBILE_GAME_CONNECTIONS || !connection_open(adapter, conn) ||
+            !connection_udp(adapter, conn)) {
+        return error_packet(packet, 0);  // UNKERR
+    }
+    connection_close(adapter, conn);
+
+    packet->length = 1;
+    return packet;
 }
 
 enum process_dns_request {
     PROCESS_DNS_REQUEST_BEGIN,
-    PROCESS_DNS_REQUEST_CHECK
+    PROCESS_DNS_REQUEST_CHECK,
+    PROCESS_DNS_REQUEST_RACE,
+    PROCESS_DNS_REQUEST_AAAA,
+    PROCESS_DNS_REQUEST_RESOLVE,
+    PROCESS_DNS_REQUEST_PREFETCH,
+    PROCESS_DNS_REQUEST_TCP_CONNECT,
+    PROCESS_DNS_REQUEST_TCP_SEND,
+    PROCESS_DNS_REQUEST_TCP_RECV
 };
 
 enum procdata_dns_request {
     PROCDATA_DNS_REQUEST_CONN,
-    PROCDATA_DNS_REQUEST_ADDR_ID
+    PROCDATA_DNS_REQUEST_ADDR_ID,
+    PROCDATA_DNS_REQUEST_RACE_CONN,
+    PROCDATA_DNS_REQUEST_RACE_ADDR_ID,
+
+    // Only used while querying over TCP
+    PROCDATA_DNS_REQUEST_TCP_TYPE = PROCDATA_DNS_REQUEST_ADDR_ID
 };
 
 static struct mobile_addr *dns_get_addr(struct mobile_adapter *adapter, unsigned char id)
@@ -1027,11 +1345,159 @@ static struct mobile_addr *dns_get_addr(struct mobile_adapter *adapter, unsigned
     }
 }
 
-static int dns_request_start(struct mobile_adapter *adapter, struct mobile_packet *packet, unsigned conn, unsigned addr_id)
+#ifdef MOBILE_ENABLE_DNS_RACE
+// Server (0 for DNS1, 1 for DNS2) a dns_get_addr() ID belongs to
+static struct mobile_commands_dns_server *dns_server(struct mobile_adapter *adapter, unsigned char addr_id)
 {
     struct mobile_adapter_commands *s = &adapter->commands;
-    struct mobile_buffer_commands *b = &adapter->buffer.commands;
+    return &s->dns_server[(addr_id + s->dns2_use * 2) % 4 / 2];
+}
+
+// Time may only be measured if mobile_func_time_now_ms() is available,
+//   otherwise the servers are told apart by their failures alone.
+static void dns_server_answered(struct mobile_adapter *adapter, unsigned char addr_id)
+{
+    struct mobile_commands_dns_server *server = dns_server(adapter, addr_id);
+    uint32_t time = adapter->timer.now - server->start;
+    if (time > 3000) time = 3000;
+    server->latency = (server->latency * 3 + (unsigned)time) / 4;
+    server->failures = 0;
+}
+
+static void dns_server_failed(struct mobile_adapter *adapter, unsigned char addr_id)
+{
+    struct mobile_commands_dns_server *server = dns_server(adapter, addr_id);
+    server->latency = (server->latency * 3 + 3000) / 4;
+    if (server->failures != 0xFF) server->failures++;
+}
+
+// The server that lost a race took longer than the winner, but it's unknown
+//   by how much.
+static void dns_server_lost(struct mobile_adapter *adapter, unsigned char addr_id)
+{
+    struct mobile_commands_dns_server *server = dns_server(adapter, addr_id);
+    uint32_t time = adapter->timer.now - server->start;
+    if (time > 3000) time = 3000;
+    if (server->latency <= time) server->latency = (unsigned)time + 1;
+}
+
+// Query the server that has been failing the least first, and out of those,
+//   the fastest one.
+static void dns_server_prefer(struct mobile_adapter *adapter)
+{
+    struct mobile_adapter_commands *s = &adapter->commands;
+    struct mobile_commands_dns_server *dns1 = &s->dns_server[0];
+    struct mobile_commands_dns_server *dns2 = &s->dns_server[1];
+
+    if (dns1->failures != dns2->failures) {
+        s->dns2_use = dns2->failures < dns1->failures;
+    } else if (dns1->latency != dns2->latency) {
+        s->dns2_use = dns2->latency < dns1->latency;
+    }
+}
+#endif
+
+// Get a connection to send a DNS query from. With internal connections, the
+//   first one is kept open until the internet is disconnected, and used for
+//   every query to a server of the same address type.
+static int dns_conn_open(struct mobile_adapter *adapter, enum mobile_addrtype type)
+{
+    struct mobile_adapter_commands *s = &adapter->commands;
+
+#if MOBILE_INTERNAL_CONNECTIONS
+    if (s->dns_conn != CONN_NONE && s->dns_conn_type == type) {
+        return s->dns_conn;
+    }
+#endif
+
+    int conn = connection_new_internal(adapter);
+    if (conn < 0) return -1;
+    if (!mobile_cb_sock_open(adapter, conn, MOBILE_SOCKTYPE_UDP, type, 0)) {
+        return -1;
+    }
+    s->connections |= conn_bit(conn);
+
+#if MOBILE_INTERNAL_CONNECTIONS
+    if (s->dns_conn == CONN_NONE) {
+        s->dns_conn = conn;
+        s->dns_conn_type = type;
+    }
+#endif
+    return conn;
+}
+
+// Close a connection once its DNS queries are done with, unless it's kept
+//   open and hasn't failed.
+static void dns_conn_close(struct mobile_adapter *adapter, unsigned char conn, bool failed)
+{
+#if MOBILE_INTERNAL_CONNECTIONS
+    struct mobile_adapter_commands *s = &adapter->commands;
+
+    if (conn == s->dns_conn) {
+        if (!failed) return;
+        s->dns_conn = CONN_NONE;
+#if MOBILE_DNS_PREFETCH_SIZE
+        mobile_dns_prefetch_cancel(adapter);
+#endif
+    }
+#else
+    (void)failed;
+#endif
+    connection_close(adapter, conn);
+}
+
+#if MOBILE_DNS_PREFETCH_SIZE
+// Send the queries for the hosts set through mobile_dns_prefetch_set() to the
+//   preferred server. They go through the connection kept for DNS queries, and
+//   are answered in the background, see mobile_commands_socket_io().
+static void dns_prefetch_start(struct mobile_adapter *adapter)
+{
+    struct mobile_adapter_commands *s = &adapter->commands;
+
+    struct mobile_addr *addr_send;
+    unsigned char addr_id;
+    for (addr_id = 0; addr_id < 4; addr_id++) {
+        addr_send = dns_get_addr(adapter, addr_id);
+        if (addr_send->type != MOBILE_ADDRTYPE_NONE) break;
+    }
+    if (addr_id >= 4) return;
+
+    int conn = dns_conn_open(adapter, addr_send->type);
+    if (conn < 0) return;
+    if (conn != s->dns_conn) {
+        // The kept connection is being used for a different address type
+        connection_close(adapter, conn);
+        return;
+    }
+    if (!mobile_dns_prefetch_send(adapter, conn, addr_send)) {
+        dns_conn_close(adapter, conn, true);
+        return;
+    }
+    mobile_timer_latch(adapter, MOBILE_TIMER_DNS_PREFETCH);
+}
+
+// Receive the answers to the prefetch queries, giving up on them once any
+//   other query would've timed out.
+static void dns_prefetch_poll(struct mobile_adapter *adapter)
+{
+    struct mobile_adapter_commands *s = &adapter->commands;
+
+    if (!mobile_dns_prefetch_pending(adapter, NULL, 0)) return;
+
+    int rc = mobile_dns_prefetch_recv(adapter, s->dns_conn);
+    if (rc < 0) {
+        dns_conn_close(adapter, s->dns_conn, true);
+        return;
+    }
+    if (rc == 0 && mobile_timer_check_ms(adapter, MOBILE_TIMER_DNS_PREFETCH,
+            3000)) {
+        mobile_dns_prefetch_cancel(adapter);
+    }
+}
+#endif
 
+static int dns_request_start(struct mobile_adapter *adapter, struct mobile_packet *packet, unsigned addr_id, enum mobile_addrtype type, unsigned char *conn, unsigned *id)
+{
     // Check any of the DNS addresses to see if they can be used
     // Fall through from DNS1 into DNS2 if DNS1 can't be used
     struct mobile_addr *addr_send;
@@ -1040,103 +1506,493 @@ static int dns_request_start(struct mobile_adapter *adapter, struct mobile_packe
         if (addr_send->type != MOBILE_ADDRTYPE_NONE) break;
     }
     if (addr_id >= 4) return -1;
-    mobile_addr_copy(&b->processing_addr, addr_send);
 
-    // Open connection and send query
-    if (!mobile_cb_sock_open(adapter, conn, MOBILE_SOCKTYPE_UDP,
-            b->processing_addr.type, 0)) {
-        return -1;
-    }
-    if (!mobile_dns_request_send(adapter, conn, &b->processing_addr,
-            (char *)packet->data, packet->length)) {
-        mobile_cb_sock_close(adapter, conn);
+    // Send query
+    int send_conn = dns_conn_open(adapter, addr_send->type);
+    if (send_conn < 0) return -1;
+    if (!mobile_dns_request_send(adapter, send_conn, addr_send, type,
+            (char *)packet->data, packet->length, id)) {
+        dns_conn_close(adapter, send_conn, true);
         return -1;
     }
-    s->connections[conn] = true;
+    *conn = send_conn;
 
-    mobile_cb_time_latch(adapter, MOBILE_TIMER_COMMAND);
+    mobile_timer_latch(adapter, MOBILE_TIMER_COMMAND);
+#ifdef MOBILE_ENABLE_DNS_RACE
+    dns_server(adapter, addr_id)->start = adapter->timer.now;
+#endif
 
     // Return the DNS ID that was used
     return (int)addr_id;
 }
 
-static struct mobile_packet *command_dns_request_begin(struct mobile_adapter *adapter, struct mobile_packet *packet)
+// Ask the server in processing_addr again over TCP, after it sent a truncated
+//   response.
+static struct mobile_packet *dns_request_tcp(struct mobile_adapter *adapter, struct mobile_packet *packet, enum mobile_addrtype type)
 {
     struct mobile_adapter_commands *s = &adapter->commands;
     struct mobile_buffer_commands *b = &adapter->buffer.commands;
 
-    if (s->state != MOBILE_CONNECTION_INTERNET) {
-        return error_packet(packet, 1);
-    }
-
-    // If it's an IP address, parse it right here, right now.
-    if (mobile_is_ipaddr((char *)packet->data, packet->length)) {
-        unsigned char ip[MOBILE_HOSTLEN_IPV4] = {255, 255, 255, 255};
-        mobile_inet_pton_length(MOBILE_INET_PTON_IPV4, (char *)packet->data,
-            packet->length, ip);
-
-        // The adapter weirdly enough only returns an error if the address is
-        //   0, despite the "parse error" value being -1 (it used inet_addr()).
-        const unsigned char ip0[MOBILE_HOSTLEN_IPV4] = {0};
-        if (memcmp(ip, ip0, sizeof(ip)) == 0) return error_packet(packet, 2);
-
-        memcpy(packet->data, ip, sizeof(ip));
-        packet->length = 4;
-        return packet;
+    int conn = connection_new_internal(adapter);
+#if MOBILE_INTERNAL_CONNECTIONS
+    // Make room by closing the connection kept for UDP queries
+    if (conn < 0 && s->dns_conn != CONN_NONE) {
+        dns_conn_close(adapter, s->dns_conn, true);
+        conn = connection_new_internal(adapter);
     }
-
-    int conn = connection_new(adapter);
+#endif
     if (conn < 0) return error_packet(packet, 2);
+    if (!mobile_cb_sock_open(adapter, conn, MOBILE_SOCKTYPE_TCP,
+            b->processing_addr.type, 0)) {
+        return error_packet(packet, 2);
+    }
+    s->connections |= conn_bit(conn);
 
-    int addr_id = dns_request_start(adapter, packet, conn, 0);
-    if (addr_id < 0) return error_packet(packet, 2);
+    if (!mobile_dns_request_tcp_query(adapter, type, (char *)packet->data,
+            packet->length)) {
+        connection_close(adapter, conn);
+        return error_packet(packet, 2);
+    }
 
+    mobile_timer_latch(adapter, MOBILE_TIMER_COMMAND);
     b->processing_data[PROCDATA_DNS_REQUEST_CONN] = conn;
-    b->processing_data[PROCDATA_DNS_REQUEST_ADDR_ID] = addr_id;
-    b->processing = PROCESS_DNS_REQUEST_CHECK;
+    b->processing_data[PROCDATA_DNS_REQUEST_TCP_TYPE] = type;
+    b->processing = PROCESS_DNS_REQUEST_TCP_CONNECT;
     return NULL;
 }
 
-static struct mobile_packet *command_dns_request_check(struct mobile_adapter *adapter, struct mobile_packet *packet)
+#ifdef MOBILE_ENABLE_DNS_RACE
+// Query DNS2 at the same time as DNS1, if possible. Otherwise, DNS2 is only
+//   queried once DNS1 fails.
+static bool dns_request_race(struct mobile_adapter *adapter, struct mobile_packet *packet, unsigned char addr_id)
 {
-    struct mobile_adapter_commands *s = &adapter->commands;
     struct mobile_buffer_commands *b = &adapter->buffer.commands;
 
-    unsigned char conn = b->processing_data[PROCDATA_DNS_REQUEST_CONN];
-    int addr_id = b->processing_data[PROCDATA_DNS_REQUEST_ADDR_ID];
+    if (addr_id >= 2) return false;
 
+    unsigned char conn;
+    int race_addr_id = dns_request_start(adapter, packet, 2,
+        MOBILE_ADDRTYPE_IPV4, &conn, &b->processing_id[1]);
+    if (race_addr_id < 0) return false;
+
+    b->processing_data[PROCDATA_DNS_REQUEST_RACE_CONN] = conn;
+    b->processing_data[PROCDATA_DNS_REQUEST_RACE_ADDR_ID] = race_addr_id;
+    b->processing = PROCESS_DNS_REQUEST_RACE;
+    return true;
+}
+#endif
+
+// Look up the IPv4 address of the host
+static struct mobile_packet *dns_request_ipv4(struct mobile_adapter *adapter, struct mobile_packet *packet)
+{
+    struct mobile_buffer_commands *b = &adapter->buffer.commands;
+
+    unsigned char conn;
+    int addr_id = dns_request_start(adapter, packet, 0, MOBILE_ADDRTYPE_IPV4,
+        &conn, &b->processing_id[0]);
+    if (addr_id < 0) return error_packet(packet, 2);
+    mobile_addr_copy(&b->processing_addr, dns_get_addr(adapter, addr_id));
+
+    b->processing_data[PROCDATA_DNS_REQUEST_CONN] = conn;
+    b->processing_data[PROCDATA_DNS_REQUEST_ADDR_ID] = addr_id;
+    b->processing = PROCESS_DNS_REQUEST_CHECK;
+#ifdef MOBILE_ENABLE_DNS_RACE
+    dns_request_race(adapter, packet, addr_id);
+#endif
+    return NULL;
+}
+
+// Look up the host through the user's resolver or the DNS servers
+static struct mobile_packet *dns_request_lookup(struct mobile_adapter *adapter, struct mobile_packet *packet)
+{
+    struct mobile_buffer_commands *b = &adapter->buffer.commands;
+
+    // Leave the lookup to the user's resolver, if there's one
+    if (has_dns_resolve(adapter)) {
+        if (!mobile_cb_dns_resolve(adapter, (char *)packet->data,
+                packet->length)) {
+            return error_packet(packet, 2);
+        }
+        mobile_timer_latch(adapter, MOBILE_TIMER_COMMAND);
+        b->processing = PROCESS_DNS_REQUEST_RESOLVE;
+        return NULL;
+    }
+
+#if MOBILE_IPV6_TOKENS
+    // Prefer the IPv6 address of the host, if it has any. Only the preferred
+    //   server is asked, as the IPv4 lookup is used as a fallback.
+    unsigned char conn;
+    int addr_id = dns_request_start(adapter, packet, 0, MOBILE_ADDRTYPE_IPV6,
+        &conn, &b->processing_id[0]);
+    if (addr_id >= 0) {
+        mobile_addr_copy(&b->processing_addr, dns_get_addr(adapter, addr_id));
+        b->processing_data[PROCDATA_DNS_REQUEST_CONN] = conn;
+        b->processing_data[PROCDATA_DNS_REQUEST_ADDR_ID] = addr_id;
+        b->processing = PROCESS_DNS_REQUEST_AAAA;
+        return NULL;
+    }
+#endif
+
+    return dns_request_ipv4(adapter, packet);
+}
+
+static struct mobile_packet *command_dns_request_begin(struct mobile_adapter *adapter, struct mobile_packet *packet)
+{
+    // If it's an IP address, parse it right here, right now.
+    if (mobile_is_ipaddr((char *)packet->data, packet->length)) {
+        unsigned char ip[MOBILE_HOSTLEN_IPV4] = {255, 255, 255, 255};
+        mobile_inet_pton_length(MOBILE_INET_PTON_IPV4, (char *)packet->data,
+            packet->length, ip);
+
+        // The adapter weirdly enough only returns an error if the address is
+        //   0, despite the "parse error" value being -1 (it used inet_addr()).
+        const unsigned char ip0[MOBILE_HOSTLEN_IPV4] = {0};
+        if (memcmp(ip, ip0, sizeof(ip)) == 0) return error_packet(packet, 2);
+
+        memcpy(packet->data, ip, sizeof(ip));
+        packet->length = 4;
+        return packet;
+    }
+
+    // Answer right away if the host has been configured by the user, or
+    //   looked up recently
+    unsigned char ip[MOBILE_HOSTLEN_IPV4];
+    if (mobile_config_host_lookup(adapter, (char *)packet->data,
+            packet->length, ip) ||
+            mobile_dns_cache_lookup(adapter, (char *)packet->data,
+                packet->length, ip)) {
+        memcpy(packet->data, ip, sizeof(ip));
+        packet->length = 4;
+        return packet;
+    }
+
+#if MOBILE_DNS_PREFETCH_SIZE
+    // Wait for the answer if the host is being looked up ahead of time
+    if (mobile_dns_prefetch_pending(adapter, (char *)packet->data,
+            packet->length)) {
+        mobile_timer_latch(adapter, MOBILE_TIMER_COMMAND);
+        adapter->buffer.commands.processing = PROCESS_DNS_REQUEST_PREFETCH;
+        return NULL;
+    }
+#endif
+
+    return dns_request_lookup(adapter, packet);
+}
+
+static struct mobile_packet *command_dns_request_check(struct mobile_adapter *adapter, struct mobile_packet *packet)
+{
+    struct mobile_buffer_commands *b = &adapter->buffer.commands;
+
+    unsigned char conn = b->processing_data[PROCDATA_DNS_REQUEST_CONN];
+    int addr_id = b->processing_data[PROCDATA_DNS_REQUEST_ADDR_ID];
+
+    struct mobile_dns_query query = {
+        .addr = &b->processing_addr,
+        .id = b->processing_id[0],
+        .type = MOBILE_ADDRTYPE_IPV4
+    };
+    unsigned answered = 0;
     unsigned char ip[MOBILE_HOSTLEN_IPV4] = {255, 255, 255, 255};
-    int rc = mobile_dns_request_recv(adapter, conn, &b->processing_addr,
-        (char *)packet->data, packet->length, ip);
+    int rc = mobile_dns_request_recv(adapter, conn, &query, 1,
+        (char *)packet->data, packet->length, ip, &answered);
     if (rc == 0 &&
-            !mobile_cb_time_check_ms(adapter, MOBILE_TIMER_COMMAND, 3000)) {
+            !mobile_timer_check_ms(adapter, MOBILE_TIMER_COMMAND, 3000)) {
         return NULL;
     }
 
-    mobile_cb_sock_close(adapter, conn);
-    s->connections[conn] = false;
+    dns_conn_close(adapter, conn, rc < 0 && answered >= 1);
+
+    if (rc == 2) return dns_request_tcp(adapter, packet, MOBILE_ADDRTYPE_IPV4);
 
     if (rc <= 0) {
+#ifdef MOBILE_ENABLE_DNS_RACE
+        dns_server_failed(adapter, addr_id);
+#endif
+
         // If we've checked DNS1 but not yet DNS2, check DNS2
         if (addr_id < 2) {
-            addr_id = dns_request_start(adapter, packet, conn, 2);
+            addr_id = dns_request_start(adapter, packet, 2,
+                MOBILE_ADDRTYPE_IPV4, &conn, &b->processing_id[0]);
             if (addr_id < 0) return error_packet(packet, 2);
+            mobile_addr_copy(&b->processing_addr,
+                dns_get_addr(adapter, addr_id));
+            b->processing_data[PROCDATA_DNS_REQUEST_CONN] = conn;
             b->processing_data[PROCDATA_DNS_REQUEST_ADDR_ID] = addr_id;
             return NULL;
         }
 
         // Otherwise we're done...
+#ifdef MOBILE_ENABLE_DNS_RACE
+        dns_server_prefer(adapter);
+#endif
         return error_packet(packet, 2);
     }
 
+#ifdef MOBILE_ENABLE_DNS_RACE
+    dns_server_answered(adapter, addr_id);
+    dns_server_prefer(adapter);
+#else
     // If we've checked DNS2 and it worked, store that
-    if (addr_id >= 2) s->dns2_use = !s->dns2_use;
+    if (addr_id >= 2) {
+        adapter->commands.dns2_use = !adapter->commands.dns2_use;
+    }
+#endif
+
+    memcpy(packet->data, ip, sizeof(ip));
+    packet->length = 4;
+    return packet;
+}
+
+#ifdef MOBILE_ENABLE_DNS_RACE
+static const unsigned char dns_race_procdata_conn[] = {
+    PROCDATA_DNS_REQUEST_CONN,
+    PROCDATA_DNS_REQUEST_RACE_CONN
+};
+static const unsigned char dns_race_procdata_addr_id[] = {
+    PROCDATA_DNS_REQUEST_ADDR_ID,
+    PROCDATA_DNS_REQUEST_RACE_ADDR_ID
+};
+
+// Forget about one of the queries, closing its connection unless the other
+//   query is still using it.
+static void dns_race_finish(struct mobile_adapter *adapter, unsigned query)
+{
+    struct mobile_buffer_commands *b = &adapter->buffer.commands;
+
+    unsigned char *conn = &b->processing_data[dns_race_procdata_conn[query]];
+    unsigned char *other = &b->processing_data[dns_race_procdata_conn[!query]];
+    if (*conn != *other) dns_conn_close(adapter, *conn, false);
+    *conn = CONN_NONE;
+}
+
+// Wait for either server to answer, whichever is first
+static struct mobile_packet *command_dns_request_race(struct mobile_adapter *adapter, struct mobile_packet *packet)
+{
+    struct mobile_buffer_commands *b = &adapter->buffer.commands;
+
+    unsigned char ip[MOBILE_HOSTLEN_IPV4] = {255, 255, 255, 255};
+    bool answered = false;
+    bool truncated = false;
+    for (unsigned i = 0; i < 2 && !answered; i++) {
+        unsigned char conn = b->processing_data[dns_race_procdata_conn[i]];
+        if (conn == CONN_NONE) continue;
+
+        // Both queries may be in flight on the same connection
+        struct mobile_dns_query queries[2];
+        unsigned char queries_race[2];
+        unsigned count = 0;
+        for (unsigned j = i; j < 2; j++) {
+            if (b->processing_data[dns_race_procdata_conn[j]] != conn) continue;
+            unsigned char addr_id =
+                b->processing_data[dns_race_procdata_addr_id[j]];
+            queries[count].addr = dns_get_addr(adapter, addr_id);
+            queries[count].id = b->processing_id[j];
+            queries[count].type = MOBILE_ADDRTYPE_IPV4;
+            queries_race[count++] = j;
+        }
+
+        unsigned query;
+        int rc = mobile_dns_request_recv(adapter, conn, queries, count,
+            (char *)packet->data, packet->length, ip, &query);
+        if (rc == 0) continue;
+
+        // If the connection failed, so did every query on it
+        if (query >= count) {
+            for (unsigned j = 0; j < count; j++) {
+                unsigned char addr_id = b->processing_data[
+                    dns_race_procdata_addr_id[queries_race[j]]];
+                dns_server_failed(adapter, addr_id);
+                b->processing_data[dns_race_procdata_conn[queries_race[j]]] =
+                    CONN_NONE;
+            }
+            dns_conn_close(adapter, conn, true);
+            continue;
+        }
+
+        unsigned race = queries_race[query];
+        unsigned char addr_id =
+            b->processing_data[dns_race_procdata_addr_id[race]];
+        if (rc > 0) {
+            dns_server_answered(adapter, addr_id);
+            answered = true;
+        } else {
+            dns_server_failed(adapter, addr_id);
+        }
+        if (rc == 2) {
+            // dns_get_addr() changes meaning once the race is over
+            mobile_addr_copy(&b->processing_addr,
+                dns_get_addr(adapter, addr_id));
+            truncated = true;
+        }
+        dns_race_finish(adapter, race);
+    }
+
+    if (!answered &&
+            (b->processing_data[PROCDATA_DNS_REQUEST_CONN] != CONN_NONE ||
+             b->processing_data[PROCDATA_DNS_REQUEST_RACE_CONN] != CONN_NONE) &&
+            !mobile_timer_check_ms(adapter, MOBILE_TIMER_COMMAND, 3000)) {
+        return NULL;
+    }
+
+    // Cancel the query that's left
+    for (unsigned i = 0; i < 2; i++) {
+        unsigned char conn = b->processing_data[dns_race_procdata_conn[i]];
+        unsigned char addr_id = b->processing_data[dns_race_procdata_addr_id[i]];
+        if (conn == CONN_NONE) continue;
+
+        if (answered) {
+            dns_server_lost(adapter, addr_id);
+        } else {
+            dns_server_failed(adapter, addr_id);
+        }
+        dns_race_finish(adapter, i);
+    }
+
+    // The servers must be picked through the same dns2_use until here
+    dns_server_prefer(adapter);
+
+    if (!answered) return error_packet(packet, 2);
+    if (truncated) {
+        return dns_request_tcp(adapter, packet, MOBILE_ADDRTYPE_IPV4);
+    }
+
+    memcpy(packet->data, ip, sizeof(ip));
+    packet->length = 4;
+    return packet;
+}
+#endif
+
+#if MOBILE_IPV6_TOKENS
+// The game is handed a token in place of the IPv6 address, which
+//   TCP_CONNECT recognizes.
+static struct mobile_packet *command_dns_request_aaaa(struct mobile_adapter *adapter, struct mobile_packet *packet)
+{
+    struct mobile_buffer_commands *b = &adapter->buffer.commands;
+
+    unsigned char conn = b->processing_data[PROCDATA_DNS_REQUEST_CONN];
+
+    struct mobile_dns_query query = {
+        .addr = &b->processing_addr,
+        .id = b->processing_id[0],
+        .type = MOBILE_ADDRTYPE_IPV6
+    };
+    unsigned answered = 0;
+    unsigned char ip[MOBILE_HOSTLEN_IPV4];
+    int rc = mobile_dns_request_recv(adapter, conn, &query, 1,
+        (char *)packet->data, packet->length, ip, &answered);
+    if (rc == 0 &&
+            !mobile_timer_check_ms(adapter, MOBILE_TIMER_COMMAND, 3000)) {
+        return NULL;
+    }
+
+    dns_conn_close(adapter, conn, rc < 0 && answered >= 1);
+
+    if (rc == 2) return dns_request_tcp(adapter, packet, MOBILE_ADDRTYPE_IPV6);
+    if (rc <= 0) return dns_request_ipv4(adapter, packet);
+
+    memcpy(packet->data, ip, sizeof(ip));
+    packet->length = 4;
+    return packet;
+}
+#endif
+
+// The connection is given as long as a UDP query would be
+static struct mobile_packet *command_dns_request_tcp(struct mobile_adapter *adapter, struct mobile_packet *packet)
+{
+    struct mobile_buffer_commands *b = &adapter->buffer.commands;
+
+    unsigned char conn = b->processing_data[PROCDATA_DNS_REQUEST_CONN];
+    unsigned char ip[MOBILE_HOSTLEN_IPV4];
+
+    int rc = 0;
+    if (b->processing == PROCESS_DNS_REQUEST_TCP_CONNECT) {
+        rc = mobile_cb_sock_connect(adapter, conn, &b->processing_addr);
+        if (rc > 0) b->processing = PROCESS_DNS_REQUEST_TCP_SEND;
+    }
+    if (b->processing == PROCESS_DNS_REQUEST_TCP_SEND) {
+        rc = mobile_dns_request_tcp_send(adapter, conn);
+        if (rc > 0) b->processing = PROCESS_DNS_REQUEST_TCP_RECV;
+    }
+    if (b->processing == PROCESS_DNS_REQUEST_TCP_RECV) {
+        rc = mobile_dns_request_tcp_recv(adapter, conn, (char *)packet->data,
+            packet->length, ip);
+    }
+    if (rc == 0 &&
+            !mobile_timer_check_ms(adapter, MOBILE_TIMER_COMMAND, 3000)) {
+        return NULL;
+    }
+
+    connection_close(adapter, conn);
+    if (rc <= 0) {
+#if MOBILE_IPV6_TOKENS
+        // Same as for UDP, look for an IPv4 address if there's no IPv6 one
+        if (b->processing_data[PROCDATA_DNS_REQUEST_TCP_TYPE] ==
+                MOBILE_ADDRTYPE_IPV6) {
+            return dns_request_ipv4(adapter, packet);
+        }
+#endif
+        return error_packet(packet, 2);
+    }
 
     memcpy(packet->data, ip, sizeof(ip));
     packet->length = 4;
     return packet;
 }
 
+// The user's resolver is given as long as querying both servers could take
+static struct mobile_packet *command_dns_request_resolve(struct mobile_adapter *adapter, struct mobile_packet *packet)
+{
+    // Only reached through dns_request_lookup(), this keeps mobile_impl_dns_poll
+    //   from being referenced when weak symbols aren't supported.
+    if (!has_dns_resolve(adapter)) return error_packet(packet, 2);
+
+    struct mobile_addr addr = {0};
+    int rc = mobile_cb_dns_poll(adapter, &addr);
+    if (rc == 0 &&
+            !mobile_timer_check_ms(adapter, MOBILE_TIMER_COMMAND, 6000)) {
+        return NULL;
+    }
+    if (rc <= 0) return error_packet(packet, 2);
+
+    if (addr.type == MOBILE_ADDRTYPE_IPV4) {
+        struct mobile_addr4 *addr4 = (struct mobile_addr4 *)&addr;
+        memcpy(packet->data, addr4->host, MOBILE_HOSTLEN_IPV4);
+#if MOBILE_IPV6_TOKENS
+    } else if (addr.type == MOBILE_ADDRTYPE_IPV6) {
+        struct mobile_addr6 *addr6 = (struct mobile_addr6 *)&addr;
+        mobile_dns_token_new(adapter, addr6->host, packet->data);
+#endif
+    } else {
+        return error_packet(packet, 2);
+    }
+
+    packet->length = 4;
+    return packet;
+}
+
+#if MOBILE_DNS_PREFETCH_SIZE
+static struct mobile_packet *command_dns_request_prefetch(struct mobile_adapter *adapter, struct mobile_packet *packet)
+{
+    dns_prefetch_poll(adapter);
+    if (mobile_dns_prefetch_pending(adapter, (char *)packet->data,
+                packet->length) &&
+            !mobile_timer_check_ms(adapter, MOBILE_TIMER_COMMAND, 3000)) {
+        return NULL;
+    }
+
+    unsigned char ip[MOBILE_HOSTLEN_IPV4];
+    if (mobile_dns_cache_lookup(adapter, (char *)packet->data,
+            packet->length, ip)) {
+        memcpy(packet->data, ip, sizeof(ip));
+        packet->length = 4;
+        return packet;
+    }
+
+    // The answer wasn't usable, ask again
+    return dns_request_lookup(adapter, packet);
+}
+#endif
+
 // Errors:
 // 1 - Invalid use (not logged in)
 // 2 - Invalid contents/lookup failed
@@ -1151,6 +2007,29 @@ static struct mobile_packet *command_dns_request(struct mobile_adapter *adapter,
     case PROCESS_DNS_REQUEST_CHECK:
         return command_dns_request_check(adapter, packet);
 
+#ifdef MOBILE_ENABLE_DNS_RACE
+    case PROCESS_DNS_REQUEST_RACE:
+        return command_dns_request_race(adapter, packet);
+#endif
+
+#if MOBILE_IPV6_TOKENS
+    case PROCESS_DNS_REQUEST_AAAA:
+        return command_dns_request_aaaa(adapter, packet);
+#endif
+
+    case PROCESS_DNS_REQUEST_RESOLVE:
+        return command_dns_request_resolve(adapter, packet);
+
+#if MOBILE_DNS_PREFETCH_SIZE
+    case PROCESS_DNS_REQUEST_PREFETCH:
+        return command_dns_request_prefetch(adapter, packet);
+#endif
+
+    case PROCESS_DNS_REQUEST_TCP_CONNECT:
+    case PROCESS_DNS_REQUEST_TCP_SEND:
+    case PROCESS_DNS_REQUEST_TCP_RECV:
+        return command_dns_request_tcp(adapter, packet);
+
     default:
         return error_packet(packet, 2);
     }
@@ -1166,80 +2045,377 @@ static struct mobile_packet *command_test_mode(struct mobile_adapter *adapter, s
     return error_packet(packet, 1);
 }
 
-struct mobile_packet *mobile_commands_process(struct mobile_adapter *adapter, struct mobile_packet *packet)
+typedef struct mobile_packet *(*command_func)(struct mobile_adapter *adapter, struct mobile_packet *packet);
+
+struct command_entry {
+    command_func func;
+    unsigned char flags;  // MOBILE_COMMAND_FLAG_*
+    unsigned char states;  // Bitmask of the enum mobile_connection_state values
+};
+
+#define COMMAND_FIRST MOBILE_COMMAND_NULL
+#define COMMAND_LAST MOBILE_COMMAND_TEST_MODE
+#define COMMAND_COUNT (COMMAND_LAST - COMMAND_FIRST + 1)
+
+#define EXISTS MOBILE_COMMAND_FLAG_EXISTS
+#define SESSIONLESS MOBILE_COMMAND_FLAG_SESSIONLESS
+#define STATE(x) (1 << MOBILE_CONNECTION_ ## x)
+#define STATE_ANY 0xFF
+#define STATE_IDLE \
+    (STATE(DISCONNECTED) | STATE(WAIT) | STATE(WAIT_RELAY) | STATE(WAIT_TIMEOUT))
+#define command(id, ...) [MOBILE_COMMAND_ ## id - COMMAND_FIRST] = {__VA_ARGS__}
+
+// Every command the adapter knows about, indexed by command ID.
+// Commands used in a state they don't accept fail with error 1, which is the
+//   "invalid use" error of every command that checks the state.
+static const struct command_entry command_table[COMMAND_COUNT] PROGMEM = {
+    command(NULL, NULL, EXISTS, STATE_ANY),
+    command(START, command_start, EXISTS | SESSIONLESS, STATE_ANY),
+    command(END, command_end, EXISTS, STATE_ANY),
+    command(TEL, command_tel, EXISTS, STATE_IDLE),
+    command(OFFLINE, command_offline, EXISTS, STATE_ANY),
+    command(WAIT_CALL, command_wait_call, EXISTS, STATE_IDLE),
+    command(DATA, command_data, EXISTS,
+        STATE(CALL) | STATE(CALL_RECV) | STATE(INTERNET)),
+    command(REINIT, command_reinit, EXISTS, STATE_ANY),
+    command(CHECK_STATUS, command_check_status, EXISTS, STATE_ANY),
+    command(CHANGE_CLOCK, command_change_clock, EXISTS, STATE_ANY),
+    command(EEPROM_READ, command_eeprom_read, EXISTS, STATE_ANY),
+    command(EEPROM_WRITE, command_eeprom_write, EXISTS, STATE_ANY),
+    command(PPP_CONNECT, command_ppp_connect, EXISTS, STATE(CALL_ISP)),
+    command(PPP_DISCONNECT, command_ppp_disconnect, EXISTS, STATE_ANY),
+    command(TCP_CONNECT, command_tcp_connect, EXISTS, STATE(INTERNET)),
+    command(TCP_DISCONNECT, command_tcp_disconnect, EXISTS, STATE(INTERNET)),
+    command(UDP_CONNECT, command_udp_connect, EXISTS, STATE(INTERNET)),
+    command(UDP_DISCONNECT, command_udp_disconnect, EXISTS, STATE(INTERNET)),
+    command(DNS_REQUEST, command_dns_request, EXISTS, STATE(INTERNET)),
+    command(TEST_MODE, command_test_mode, EXISTS, STATE_ANY),
+};
+
+#undef EXISTS
+#undef SESSIONLESS
+#undef STATE
+#undef STATE_ANY
+#undef STATE_IDLE
+#undef command
+
+static const struct command_entry *command_lookup(unsigned command)
 {
-    switch (packet->command) {
-    case MOBILE_COMMAND_START:
-        return command_start(adapter, packet);
-    case MOBILE_COMMAND_END:
-        return command_end(adapter, packet);
-    case MOBILE_COMMAND_TEL:
-        return command_tel(adapter, packet);
-    case MOBILE_COMMAND_OFFLINE:
-        return command_offline(adapter, packet);
-    case MOBILE_COMMAND_WAIT_CALL:
-        return command_wait_call(adapter, packet);
-    case MOBILE_COMMAND_DATA:
-        return command_data(adapter, packet);
-    case MOBILE_COMMAND_REINIT:
-        return command_reinit(adapter, packet);
-    case MOBILE_COMMAND_CHECK_STATUS:
-        return command_check_status(adapter, packet);
-    case MOBILE_COMMAND_CHANGE_CLOCK:
-        return command_change_clock(adapter, packet);
-    case MOBILE_COMMAND_EEPROM_READ:
-        return command_eeprom_read(adapter, packet);
-    case MOBILE_COMMAND_EEPROM_WRITE:
-        return command_eeprom_write(adapter, packet);
-    case MOBILE_COMMAND_PPP_CONNECT:
-        return command_ppp_connect(adapter, packet);
-    case MOBILE_COMMAND_PPP_DISCONNECT:
-        return command_ppp_disconnect(adapter, packet);
-    case MOBILE_COMMAND_TCP_CONNECT:
-        return command_tcp_connect(adapter, packet);
-    case MOBILE_COMMAND_TCP_DISCONNECT:
-        return command_tcp_disconnect(adapter, packet);
-    case MOBILE_COMMAND_UDP_CONNECT:
-        return command_udp_connect(adapter, packet);
-    case MOBILE_COMMAND_UDP_DISCONNECT:
-        return command_udp_disconnect(adapter, packet);
-    case MOBILE_COMMAND_DNS_REQUEST:
-        return command_dns_request(adapter, packet);
-    case MOBILE_COMMAND_TEST_MODE:
-        return command_test_mode(adapter, packet);
-    default:
-        // Nonexisting commands can't be used at any time
+    if (command < COMMAND_FIRST || command > COMMAND_LAST) return NULL;
+    return &command_table[command - COMMAND_FIRST];
+}
+
+static struct mobile_packet *command_dispatch(struct mobile_adapter *adapter, struct mobile_packet *packet)
+{
+    const struct command_entry *entry = command_lookup(packet->command);
+
+    // Nonexisting commands can't be used at any time
+    command_func func = entry ? pgm_read_ptr(&entry->func) : NULL;
+    if (!func) return error_packet(packet, 1);
+
+    unsigned char states = pgm_read_byte(&entry->states);
+    if (!(states & 1 << adapter->commands.state)) {
         return error_packet(packet, 1);
     }
+
+    return func(adapter, packet);
+}
+
+#ifdef MOBILE_ENABLE_STATS
+// Histogram bucket of a value: 0 for 0, N for 2^(N-1) to 2^N - 1
+static unsigned stats_bucket(uint32_t value)
+{
+    unsigned bucket = 0;
+    while (value && bucket < MOBILE_STATS_BUCKETS - 1) {
+        value >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+static void stats_hist_add(uint16_t *hist, uint32_t value)
+{
+    uint16_t *counter = &hist[stats_bucket(value)];
+    if (*counter != UINT16_MAX) (*counter)++;
+}
+
+static void stats_record(struct mobile_adapter *adapter, unsigned command, bool replied)
+{
+    struct mobile_adapter_commands *s = &adapter->commands;
+
+    if (!replied) {
+        s->stats_loops++;
+        return;
+    }
+
+    // Packets for nonexisting commands aren't kept track of
+    if (!command_lookup(command)) return;
+
+    struct mobile_stats_command *stats = &s->stats[command - COMMAND_FIRST];
+    uint32_t time = adapter->timer.now - s->stats_start;
+    stats->count++;
+    stats->time_ms += time;
+    stats->loops += s->stats_loops;
+    stats_hist_add(stats->time_hist, time);
+    stats_hist_add(stats->loops_hist, s->stats_loops);
+}
+#endif
+
+struct mobile_packet *mobile_commands_process(struct mobile_adapter *adapter, struct mobile_packet *packet)
+{
+#ifdef MOBILE_ENABLE_STATS
+    // The reply overwrites the packet
+    unsigned command = packet->command;
+    struct mobile_packet *send = command_dispatch(adapter, packet);
+    stats_record(adapter, command, send != NULL);
+    return send;
+#else
+    return command_dispatch(adapter, packet);
+#endif
 }
 
-bool mobile_commands_exists(enum mobile_command command)
+unsigned char mobile_commands_flags(unsigned command)
 {
     // Used by serial.c:mobile_serial_transfer() to check if a command may be used
 
-    switch (command) {
-    case MOBILE_COMMAND_NULL:
-    case MOBILE_COMMAND_START:
-    case MOBILE_COMMAND_END:
-    case MOBILE_COMMAND_TEL:
-    case MOBILE_COMMAND_OFFLINE:
-    case MOBILE_COMMAND_WAIT_CALL:
-    case MOBILE_COMMAND_DATA:
-    case MOBILE_COMMAND_REINIT:
-    case MOBILE_COMMAND_CHECK_STATUS:
-    case MOBILE_COMMAND_CHANGE_CLOCK:
-    case MOBILE_COMMAND_EEPROM_READ:
-    case MOBILE_COMMAND_EEPROM_WRITE:
-    case MOBILE_COMMAND_PPP_CONNECT:
-    case MOBILE_COMMAND_PPP_DISCONNECT:
-    case MOBILE_COMMAND_TCP_CONNECT:
-    case MOBILE_COMMAND_TCP_DISCONNECT:
-    case MOBILE_COMMAND_UDP_CONNECT:
-    case MOBILE_COMMAND_UDP_DISCONNECT:
-    case MOBILE_COMMAND_DNS_REQUEST:
-    case MOBILE_COMMAND_TEST_MODE:
+    const struct command_entry *entry = command_lookup(command);
+    if (!entry) return 0;
+    return pgm_read_byte(&entry->flags);
+}
+
+bool mobile_stats_get(struct mobile_adapter *adapter, unsigned command, struct mobile_stats_command *stats)
+{
+#ifdef MOBILE_ENABLE_STATS
+    const struct command_entry *entry = command_lookup(command);
+    if (!entry || !pgm_read_ptr(&entry->func)) return false;
+    *stats = adapter->commands.stats[command - COMMAND_FIRST];
+    return true;
+#else
+    (void)adapter;
+    (void)command;
+    (void)stats;
+    return false;
+#endif
+}
+
+void mobile_stats_reset(struct mobile_adapter *adapter)
+{
+#ifdef MOBILE_ENABLE_STATS
+    memset(adapter->commands.stats, 0, sizeof(adapter->commands.stats));
+#else
+    (void)adapter;
+#endif
+}
+
+#if MOBILE_RECV_BUFFER_SIZE || MOBILE_SEND_BUFFER_SIZE
+// Whether a connection carries data for the DATA command, which may be sent
+//   and received in the background. Connections are only used for something
+//   else while a command is being processed.
+static bool connection_background(struct mobile_adapter *adapter, unsigned char conn)
+{
+    struct mobile_adapter_commands *s = &adapter->commands;
+
+    if (!s->session_started) return false;
+    if (adapter->serial.state == MOBILE_SERIAL_RESPONSE_WAITING) return false;
+    if (!connection_open(adapter, conn)) return false;
+    switch (s->state) {
+    case MOBILE_CONNECTION_CALL:
+    case MOBILE_CONNECTION_CALL_RECV:
+        return conn == p2p_conn;
+    case MOBILE_CONNECTION_INTERNET:
         return true;
     default:
         return false;
     }
 }
+#endif
+
+#if UDP_READ_AHEAD
+// Queue every datagram waiting on a UDP connection, for as long as there's
+//   room for another one.
+static void connection_recv_datagrams(struct mobile_adapter *adapter, unsigned char conn)
+{
+    struct mobile_commands_recv *r = &adapter->commands.recv[conn];
+
+    if (!connection_ready(adapter, conn, MOBILE_SOCKPOLL_READABLE)) return;
+
+    while (MOBILE_RECV_BUFFER_SIZE - r->size > MOBILE_MAX_TRANSFER_SIZE) {
+        // Datagrams are never split, so move the queue back to the start
+        //   whenever the next one might not fit after it.
+        if (MOBILE_RECV_BUFFER_SIZE - r->head - r->size <=
+                MOBILE_MAX_TRANSFER_SIZE) {
+            memmove(r->data, r->data + r->head, r->size);
+            r->head = 0;
+        }
+
+        unsigned char *tail = r->data + r->head + r->size;
+        int rc = mobile_cb_sock_recv(adapter, conn, tail + 1,
+            MOBILE_MAX_TRANSFER_SIZE, NULL);
+        if (rc < 0) {
+            r->error = rc;
+            break;
+        }
+        if (!rc) break;
+        tail[0] = rc;
+        r->size += 1 + rc;
+    }
+}
+#endif
+
+#if MOBILE_DNS_PREFETCH_SIZE
+// Whether the prefetch queries have to be sent or received, which is done in
+//   the background while no command is using the connection they go through.
+static bool dns_prefetch_background(struct mobile_adapter *adapter)
+{
+    struct mobile_adapter_commands *s = &adapter->commands;
+
+    if (adapter->serial.state == MOBILE_SERIAL_RESPONSE_WAITING) return false;
+    if (s->state != MOBILE_CONNECTION_INTERNET) return false;
+    return s->dns_prefetch_send ||
+        mobile_dns_prefetch_pending(adapter, NULL, 0);
+}
+#endif
+
+#if MOBILE_RECV_BUFFER_SIZE || MOBILE_SEND_BUFFER_SIZE
+// Events a connection is waiting on to move data between it and its buffers
+//   in the background, as MOBILE_SOCKPOLL_* flags.
+static int connection_background_events(struct mobile_adapter *adapter, unsigned char conn)
+{
+    struct mobile_adapter_commands *s = &adapter->commands;
+
+    if (!connection_background(adapter, conn)) return 0;
+
+    int events = 0;
+#if MOBILE_RECV_BUFFER_SIZE
+    if (connection_udp(adapter, conn)) {
+#if UDP_READ_AHEAD
+        if (!s->recv[conn].error && MOBILE_RECV_BUFFER_SIZE -
+                s->recv[conn].size > MOBILE_MAX_TRANSFER_SIZE) {
+            events |= MOBILE_SOCKPOLL_READABLE;
+        }
+#endif
+        return events;
+    }
+    if (!s->recv[conn].error &&
+            s->recv[conn].size < MOBILE_RECV_BUFFER_SIZE) {
+        events |= MOBILE_SOCKPOLL_READABLE | MOBILE_SOCKPOLL_HANGUP;
+    }
+#endif
+#if MOBILE_SEND_BUFFER_SIZE
+    if (!s->send[conn].error && s->send[conn].size) {
+        events |= MOBILE_SOCKPOLL_WRITABLE | MOBILE_SOCKPOLL_HANGUP;
+    }
+#endif
+    return events;
+}
+#endif
+
+// Whether there's background work that can only be found out about by trying
+//   it, which is why it's only tried every SOCKET_IO_INTERVAL_MS.
+// This is the case for the DNS prefetch queries, which go through an internal
+//   connection, and for every connection if there's no sock_poll callback.
+bool mobile_commands_socket_io_waiting(struct mobile_adapter *adapter)
+{
+#if MOBILE_DNS_PREFETCH_SIZE
+    if (dns_prefetch_background(adapter)) return true;
+#endif
+#if MOBILE_RECV_BUFFER_SIZE || MOBILE_SEND_BUFFER_SIZE
+    if (has_sock_poll(adapter)) return false;
+    for (unsigned char conn = 0; conn < MOBILE_GAME_CONNECTIONS; conn++) {
+        if (connection_background_events(adapter, conn)) return true;
+    }
+#endif
+    (void)adapter;
+    return false;
+}
+
+bool mobile_commands_socket_io_pending(struct mobile_adapter *adapter)
+{
+    mobile_timer_arm(adapter, MOBILE_TIMER_SOCKET_IO);
+
+#if MOBILE_DNS_PREFETCH_SIZE
+    if (dns_prefetch_background(adapter) &&
+            adapter->commands.dns_prefetch_send) {
+        return true;
+    }
+#endif
+#if MOBILE_RECV_BUFFER_SIZE || MOBILE_SEND_BUFFER_SIZE
+    // Only the connections that are ready have to be looked at right away
+    if (has_sock_poll(adapter)) {
+        for (unsigned char conn = 0; conn < MOBILE_GAME_CONNECTIONS; conn++) {
+            int events = connection_background_events(adapter, conn);
+            if (events && connection_ready(adapter, conn, events)) {
+                return true;
+            }
+        }
+    }
+#endif
+
+    if (!mobile_commands_socket_io_waiting(adapter)) return false;
+    return mobile_timer_check_ms(adapter, MOBILE_TIMER_SOCKET_IO,
+        SOCKET_IO_INTERVAL_MS);
+}
+
+void mobile_commands_socket_io(struct mobile_adapter *adapter)
+{
+    mobile_timer_latch(adapter, MOBILE_TIMER_SOCKET_IO);
+
+#if MOBILE_DNS_PREFETCH_SIZE
+    if (dns_prefetch_background(adapter)) {
+        struct mobile_adapter_commands *s = &adapter->commands;
+        if (s->dns_prefetch_send) {
+            s->dns_prefetch_send = false;
+            dns_prefetch_start(adapter);
+        } else {
+            dns_prefetch_poll(adapter);
+        }
+    }
+#endif
+
+#if MOBILE_RECV_BUFFER_SIZE || MOBILE_SEND_BUFFER_SIZE
+    for (unsigned char conn = 0; conn < MOBILE_GAME_CONNECTIONS; conn++) {
+        if (!connection_background(adapter, conn)) continue;
+
+        // Keep sending any data the DATA command couldn't send right away
+#if MOBILE_SEND_BUFFER_SIZE
+        connection_flush(adapter, conn);
+#endif
+
+        // Fill the receive buffer with whatever data is available, so the
+        //   DATA command doesn't have to wait for it.
+        // Only the contiguous free space after the buffered data is filled,
+        //   the rest is picked up on the next call.
+#if MOBILE_RECV_BUFFER_SIZE
+        struct mobile_commands_recv *r = &adapter->commands.recv[conn];
+        if (r->error) continue;
+        if (connection_udp(adapter, conn)) {
+#if UDP_READ_AHEAD
+            connection_recv_datagrams(adapter, conn);
+#endif
+            continue;
+        }
+
+        unsigned tail = (r->head + r->size) % MOBILE_RECV_BUFFER_SIZE;
+        unsigned size = MOBILE_RECV_BUFFER_SIZE - r->size;
+        if (size > MOBILE_RECV_BUFFER_SIZE - tail) {
+            size = MOBILE_RECV_BUFFER_SIZE - tail;
+        }
+        if (!size) continue;
+
+        if (!connection_ready(adapter, conn,
+                MOBILE_SOCKPOLL_READABLE | MOBILE_SOCKPOLL_HANGUP)) {
+            continue;
+        }
+        int rc = mobile_cb_sock_recv(adapter, conn, r->data + tail, size,
+            NULL);
+        if (rc < 0) {
+            r->error = rc;
+            continue;
+        }
+        r->size += rc;
+#endif
+    }
+#else
+    (void)adapter;
+#endif
+}
@@ -2,9 +2,43 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #include "mobile.h"
 #include "atomic.h"
+#include "dns.h"
+
+#ifdef MOBILE_LIBCONF_USE
+#include <mobile_config.h>
+#endif
+
+#ifndef MOBILE_RECV_BUFFER_SIZE
+#define MOBILE_RECV_BUFFER_SIZE 0
+#endif
+#ifndef MOBILE_SEND_BUFFER_SIZE
+#define MOBILE_SEND_BUFFER_SIZE 0
+#endif
+
+// Bitmap of connection numbers, one bit per connection
+#if MOBILE_MAX_CONNECTIONS <= 8
+typedef uint8_t mobile_connmask;
+#elif MOBILE_MAX_CONNECTIONS <= 16
+typedef uint16_t mobile_connmask;
+#elif MOBILE_MAX_CONNECTIONS <= 32
+typedef uint32_t mobile_connmask;
+#else
+#error "MOBILE_MAX_CONNECTIONS can't be bigger than 32"
+#endif
+
+// The connection used to fetch the user's number, which is the last internal
+//   one. With a single internal connection it's shared with the DNS requests,
+//   and without any, with the game's connections. This only works because the
+//   number is never fetched during a session.
+#if MOBILE_INTERNAL_CONNECTIONS
+#define MOBILE_NUMBER_FETCH_CONN (MOBILE_MAX_CONNECTIONS - 1)
+#else
+#define MOBILE_NUMBER_FETCH_CONN 0
+#endif
 
 enum mobile_command {
     MOBILE_COMMAND_NULL = 0xF,
@@ -42,6 +76,12 @@ enum mobile_connection_state {
     MOBILE_CONNECTION_INTERNET
 };
 
+// Flags returned by mobile_commands_flags()
+enum mobile_command_flags {
+    MOBILE_COMMAND_FLAG_EXISTS = 1 << 0,  // Accepted by the adapter
+    MOBILE_COMMAND_FLAG_SESSIONLESS = 1 << 1  // Accepted before START
+};
+
 struct mobile_packet {
     enum mobile_command command;
     unsigned char length;
@@ -56,22 +96,81 @@ struct mobile_buffer_commands {
     unsigned char processing;  // Set to 0 every time a command is parsed
     unsigned char processing_data[4];
     struct mobile_addr processing_addr;
+    unsigned processing_id[2];  // IDs of the DNS queries in flight
+};
+
+#if MOBILE_RECV_BUFFER_SIZE
+// Data received ahead of time from a connection, see mobile_commands_socket_io()
+// UDP connections store whole datagrams instead, each prefixed by its length.
+struct mobile_commands_recv {
+    unsigned head;
+    unsigned size;
+    signed char error;  // Pending error returned by mobile_cb_sock_recv()
+    unsigned char data[MOBILE_RECV_BUFFER_SIZE];
+};
+#endif
+
+#if MOBILE_SEND_BUFFER_SIZE
+// Data waiting to be sent over a connection, see mobile_commands_socket_io()
+struct mobile_commands_send {
+    unsigned head;
+    unsigned size;
+    signed char error;  // Error returned by mobile_cb_sock_send() while flushing
+    unsigned char data[MOBILE_SEND_BUFFER_SIZE];
+};
+#endif
+
+#ifdef MOBILE_ENABLE_DNS_RACE
+// How well a DNS server has been answering, used to pick the preferred one
+struct mobile_commands_dns_server {
+    uint32_t start;  // Time at which the current query was sent
+    unsigned latency;  // Smoothed time taken to answer, in ms
+    unsigned char failures;  // Queries in a row that went unanswered
 };
+#endif
 
 struct mobile_adapter_commands {
     _Atomic volatile bool session_started;
     _Atomic volatile bool mode_32bit;
 
     enum mobile_connection_state state;
-    bool connections[MOBILE_MAX_CONNECTIONS];
+    mobile_connmask connections;
     bool dns2_use;
     struct mobile_addr4 dns1;
     struct mobile_addr4 dns2;
+#if MOBILE_INTERNAL_CONNECTIONS
+    // Connection kept open for the DNS queries while connected to the internet
+    unsigned char dns_conn;
+    enum mobile_addrtype dns_conn_type;
+#endif
+#ifdef MOBILE_ENABLE_DNS_RACE
+    struct mobile_commands_dns_server dns_server[2];  // DNS1 and DNS2
+#endif
+#if MOBILE_DNS_PREFETCH_SIZE
+    bool dns_prefetch_send;  // Prefetch queries have yet to be sent
+#endif
+    struct mobile_addr udp_addr[MOBILE_GAME_CONNECTIONS];  // UDP_CONNECT peers
+#if MOBILE_RECV_BUFFER_SIZE
+    struct mobile_commands_recv recv[MOBILE_GAME_CONNECTIONS];
+#endif
+#if MOBILE_SEND_BUFFER_SIZE
+    struct mobile_commands_send send[MOBILE_GAME_CONNECTIONS];
+#endif
+#ifdef MOBILE_ENABLE_STATS
+    // Indexed by command ID, starting at MOBILE_COMMAND_NULL
+    struct mobile_stats_command stats[MOBILE_COMMAND_TEST_MODE -
+        MOBILE_COMMAND_NULL + 1];
+    uint32_t stats_start;  // Time at which the current packet was parsed
+    uint32_t stats_loops;  // Iterations spent on the current packet
+#endif
 };
 
 void mobile_commands_init(struct mobile_adapter *adapter);
 void mobile_commands_reset(struct mobile_adapter *adapter);
 struct mobile_packet *mobile_commands_process(struct mobile_adapter *adapter, struct mobile_packet *packet);
-bool mobile_commands_exists(enum mobile_command command);
+unsigned char mobile_commands_flags(unsigned command);
+bool mobile_commands_socket_io_waiting(struct mobile_adapter *adapter);
+bool mobile_commands_socket_io_pending(struct mobile_adapter *adapter);
+void mobile_commands_socket_io(struct mobile_adapter *adapter);
 
 #undef _Atomic  // "atomic.h"
@@ -33,6 +33,7 @@
 #else
 #define PROGMEM
 #define PSTR(...) __VA_ARGS__
+#define pgm_read_byte(x) (*x)
 #define pgm_read_ptr(x) (*x)
 #define memcmp_P(...) memcmp(__VA_ARGS__)
 #define memcpy_P(...) memcpy(__VA_ARGS__)
@@ -14,6 +14,17 @@
 #define MOBILE_CONFIG_SIZE_LIBRARY 0x60
 static_assert(MOBILE_CONFIG_SIZE >= MOBILE_CONFIG_OFFSET_LIBRARY +
     MOBILE_CONFIG_SIZE_LIBRARY, "MOBILE_CONFIG_SIZE isn't big enough!");
+// Host overrides, kept apart so older configs still load
+#define MOBILE_CONFIG_OFFSET_HOSTS 0x160
+#define MOBILE_CONFIG_SIZE_HOSTS 0xA0
+#define MOBILE_CONFIG_SIZE_HOST_ENTRY 0x24
+static_assert(MOBILE_CONFIG_OFFSET_HOSTS >= MOBILE_CONFIG_OFFSET_LIBRARY +
+    MOBILE_CONFIG_SIZE_LIBRARY, "Config areas overlap!");
+static_assert(MOBILE_CONFIG_SIZE >= MOBILE_CONFIG_OFFSET_HOSTS +
+    MOBILE_CONFIG_SIZE_HOSTS, "MOBILE_CONFIG_SIZE isn't big enough!");
+static_assert(MOBILE_CONFIG_SIZE_HOSTS >= 0x10 +
+    MOBILE_CONFIG_SIZE_HOST_ENTRY * MOBILE_CONFIG_HOSTS,
+    "MOBILE_CONFIG_SIZE_HOSTS isn't big enough!");
 
 static uint16_t checksum(unsigned char *buf, unsigned len)
 {
@@ -181,6 +192,78 @@ static void config_library_save(struct mobile_adapter *adapter)
         sizeof(buffer));
 }
 
+static bool config_hosts_load(struct mobile_adapter *adapter)
+{
+    struct mobile_adapter_config *config = &adapter->config;
+
+    unsigned char buffer[MOBILE_CONFIG_SIZE_HOSTS];
+    if (!mobile_cb_config_read(adapter, buffer, MOBILE_CONFIG_OFFSET_HOSTS,
+            sizeof(buffer))) {
+        return false;
+    }
+
+    if (buffer[0] != 'L') return false;
+    if (buffer[1] != 'H') return false;
+    if (buffer[2] != 0) return false;
+    uint16_t sum = checksum(buffer + 5, sizeof(buffer) - 5);
+    uint16_t config_sum = buffer[3] | buffer[4] << 8;
+    if (sum != config_sum) return false;
+
+    for (unsigned i = 0; i < MOBILE_CONFIG_HOSTS; i++) {
+        unsigned char *entry = buffer + 0x10 +
+            MOBILE_CONFIG_SIZE_HOST_ENTRY * i;
+        if (entry[MOBILE_CONFIG_HOST_SIZE - 1] != 0) return false;
+    }
+
+    for (unsigned i = 0; i < MOBILE_CONFIG_HOSTS; i++) {
+        struct mobile_config_host *host = &config->hosts[i];
+        unsigned char *entry = buffer + 0x10 +
+            MOBILE_CONFIG_SIZE_HOST_ENTRY * i;
+        memcpy(host->host, entry, MOBILE_CONFIG_HOST_SIZE);
+        memcpy(host->ip, entry + MOBILE_CONFIG_HOST_SIZE, MOBILE_HOSTLEN_IPV4);
+    }
+
+    return true;
+}
+
+// Configs that never had any host set don't get the hosts area written
+static bool config_hosts_empty(struct mobile_adapter *adapter)
+{
+    for (unsigned i = 0; i < MOBILE_CONFIG_HOSTS; i++) {
+        if (adapter->config.hosts[i].host[0]) return false;
+    }
+    return true;
+}
+
+static void config_hosts_save(struct mobile_adapter *adapter)
+{
+    struct mobile_adapter_config *config = &adapter->config;
+    if (!config->hosts_init && config_hosts_empty(adapter)) return;
+
+    unsigned char buffer[MOBILE_CONFIG_SIZE_HOSTS] = {0};
+    buffer[0] = 'L';
+    buffer[1] = 'H';
+    buffer[2] = 0;
+
+    // 0x05 - 0x0f unused
+
+    for (unsigned i = 0; i < MOBILE_CONFIG_HOSTS; i++) {
+        const struct mobile_config_host *host = &config->hosts[i];
+        unsigned char *entry = buffer + 0x10 +
+            MOBILE_CONFIG_SIZE_HOST_ENTRY * i;
+        memcpy(entry, host->host, MOBILE_CONFIG_HOST_SIZE);
+        memcpy(entry + MOBILE_CONFIG_HOST_SIZE, host->ip, MOBILE_HOSTLEN_IPV4);
+    }
+
+    uint16_t sum = checksum(buffer + 5, sizeof(buffer) - 5);
+    buffer[0x03] = sum & 0xff;
+    buffer[0x04] = sum >> 8;
+
+    mobile_cb_config_write(adapter, buffer, MOBILE_CONFIG_OFFSET_HOSTS,
+        sizeof(buffer));
+    config->hosts_init = true;
+}
+
 void mobile_config_init(struct mobile_adapter *adapter)
 {
     adapter->config.loaded = false;
@@ -192,6 +275,8 @@ void mobile_config_init(struct mobile_adapter *adapter)
     adapter->config.relay = (struct mobile_addr){.type = MOBILE_ADDRTYPE_NONE};
     adapter->config.relay_token_init = false;
     memset(adapter->config.relay_token, 0, MOBILE_RELAY_TOKEN_SIZE);
+    adapter->config.hosts_init = false;
+    memset(adapter->config.hosts, 0, sizeof(adapter->config.hosts));
 }
 
 void mobile_config_load(struct mobile_adapter *adapter)
@@ -199,6 +284,10 @@ void mobile_config_load(struct mobile_adapter *adapter)
     if (adapter->global.start) return;
     if (!config_internal_verify(adapter)) config_internal_clear(adapter);
     if (config_library_load(adapter)) adapter->config.dirty = false;
+    adapter->config.hosts_init = config_hosts_load(adapter);
+    if (!adapter->config.hosts_init) {
+        memset(adapter->config.hosts, 0, sizeof(adapter->config.hosts));
+    }
     adapter->config.loaded = true;
 }
 
@@ -206,13 +295,17 @@ void mobile_config_save(struct mobile_adapter *adapter)
 {
     if (!adapter->config.dirty) return;
     config_library_save(adapter);
+    config_hosts_save(adapter);
     adapter->config.dirty = false;
 }
 
 static void mobile_config_apply(struct mobile_adapter *adapter)
 {
+    // Only wake up mobile_loop() if it isn't already going to save
+    bool dirty = adapter->config.dirty;
     adapter->config.dirty = true;
     adapter->config.loaded = true;
+    if (!dirty) mobile_callback_notify(adapter);
 }
 
 void mobile_config_set_device(struct mobile_adapter *adapter, enum mobile_adapter_device device, bool unmetered)
@@ -307,3 +400,44 @@ bool mobile_config_get_relay_token(struct mobile_adapter *adapter, unsigned char
     memcpy(token, adapter->config.relay_token, MOBILE_RELAY_TOKEN_SIZE);
     return true;
 }
+
+void mobile_config_set_host(struct mobile_adapter *adapter, unsigned num, const char *host, const unsigned char *ip)
+{
+    // Looked up by every DNS_REQUEST, see mobile_config_host_lookup()
+    if (num >= MOBILE_CONFIG_HOSTS) return;
+    struct mobile_config_host *cfg = &adapter->config.hosts[num];
+    if (host) {
+        size_t host_len = strlen(host);
+        if (host_len >= MOBILE_CONFIG_HOST_SIZE) return;
+        memset(cfg->host, 0, MOBILE_CONFIG_HOST_SIZE);
+        memcpy(cfg->host, host, host_len);
+        memcpy(cfg->ip, ip, MOBILE_HOSTLEN_IPV4);
+    } else {
+        memset(cfg, 0, sizeof(*cfg));
+    }
+
+    mobile_config_apply(adapter);
+}
+
+bool mobile_config_get_host(struct mobile_adapter *adapter, unsigned num, char *host, unsigned char *ip)
+{
+    if (num >= MOBILE_CONFIG_HOSTS) return false;
+    const struct mobile_config_host *cfg = &adapter->config.hosts[num];
+    if (!cfg->host[0]) return false;
+    memcpy(host, cfg->host, MOBILE_CONFIG_HOST_SIZE);
+    memcpy(ip, cfg->ip, MOBILE_HOSTLEN_IPV4);
+    return true;
+}
+
+bool mobile_config_host_lookup(struct mobile_adapter *adapter, const char *host, unsigned host_len, unsigned char *ip)
+{
+    if (host_len == 0 || host_len >= MOBILE_CONFIG_HOST_SIZE) return false;
+    for (unsigned i = 0; i < MOBILE_CONFIG_HOSTS; i++) {
+        const struct mobile_config_host *cfg = &adapter->config.hosts[i];
+        if (strlen(cfg->host) != host_len) continue;
+        if (memcmp(cfg->host, host, host_len) != 0) continue;
+        memcpy(ip, cfg->ip, MOBILE_HOSTLEN_IPV4);
+        return true;
+    }
+    return false;
+}
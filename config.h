@@ -9,6 +9,11 @@
 // We have no idea of the effects of this in other games.
 #define MOBILE_CONFIG_DEVICE_UNMETERED 0x80
 
+struct mobile_config_host {
+    char host[MOBILE_CONFIG_HOST_SIZE];  // Empty if unused
+    unsigned char ip[MOBILE_HOSTLEN_IPV4];
+};
+
 struct mobile_adapter_config {
     // Whether the config has already been loaded
     bool loaded: 1;
@@ -19,6 +24,9 @@ struct mobile_adapter_config {
     // Whether relay_token has been set
     bool relay_token_init: 1;
 
+    // Whether the hosts have been loaded from or saved to the config
+    bool hosts_init: 1;
+
     // What device to emulate
     _Atomic volatile unsigned char device;  // Read by serial thread
 
@@ -36,9 +44,13 @@ struct mobile_adapter_config {
 
     // Authentication token used for relay connections
     unsigned char relay_token[MOBILE_RELAY_TOKEN_SIZE];
+
+    // Hosts answered without querying the DNS servers
+    struct mobile_config_host hosts[MOBILE_CONFIG_HOSTS];
 };
 
 void mobile_config_init(struct mobile_adapter *adapter);
 void mobile_config_set_relay_token_internal(struct mobile_adapter *adapter, const unsigned char *token);
+bool mobile_config_host_lookup(struct mobile_adapter *adapter, const char *host, unsigned host_len, unsigned char *ip);
 
 #undef _Atomic  // "atomic.h"
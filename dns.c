@@ -11,23 +11,46 @@
 // RFC1035 - DOMAIN NAMES - IMPLEMENTATION AND SPECIFICATION
 // RFC6895 - Domain Name System (DNS) IANA Considerations
 // RFC3596 - DNS Extensions to Support IP Version 6
+// RFC6891 - Extension Mechanisms for DNS (EDNS(0))
+// RFC7766 - DNS Transport over TCP - Implementation Requirements
 
 // Not implemented but possibly relevant for the future:
-// RFC6891 - Extension Mechanisms for DNS (EDNS(0))
 // RFC7873 - Domain Name System (DNS) Cookies
 
 #define DNS_HEADER_SIZE 12
 #define DNS_QD_SIZE 4
 #define DNS_RR_SIZE 10
+#define DNS_TCP_LENGTH_SIZE 2
+
+#ifdef MOBILE_ENABLE_DNS_EDNS
+#define DNS_EDNS true
+#else
+#define DNS_EDNS false
+#endif
+
+// Longest time an answer is cached for, in seconds
+#define DNS_CACHE_TTL_MAX 86400
+#define DNS_CACHE_TTL_MAX_NOCLOCK 60
 
 enum dns_qtype {
     DNS_QTYPE_A = 1,
-    DNS_QTYPE_AAAA = 28
+    DNS_QTYPE_AAAA = 28,
+    DNS_QTYPE_OPT = 41
 };
 
 void mobile_dns_init(struct mobile_adapter *adapter)
 {
     adapter->dns.id = 0;
+#if MOBILE_DNS_CACHE_SIZE
+    adapter->dns.cache_count = 0;
+#endif
+#if MOBILE_IPV6_TOKENS
+    adapter->dns.token_count = 0;
+    adapter->dns.token_next = 0;
+#endif
+#if MOBILE_DNS_PREFETCH_SIZE
+    memset(adapter->dns.prefetch, 0, sizeof(adapter->dns.prefetch));
+#endif
 }
 
 static void debug_prefix(struct mobile_adapter *adapter)
@@ -124,7 +147,9 @@ static int dns_name_len(struct mobile_buffer_dns *state, unsigned offset)
     return (unsigned)(pcmp - state->data) + 1 - offset;
 }
 
-static bool dns_make_query(struct mobile_buffer_dns *state, unsigned id, enum dns_qtype type, const char *name, unsigned name_len)
+// With <edns>, the buffer size is advertised through an OPT record, so the
+//   server may send responses bigger than 512 bytes over UDP.
+static bool dns_make_query(struct mobile_buffer_dns *state, unsigned id, enum dns_qtype type, const char *name, unsigned name_len, bool edns)
 {
     state->id = id;
     state->type = type;
@@ -149,8 +174,23 @@ static bool dns_make_query(struct mobile_buffer_dns *state, unsigned id, enum dn
     question[1] = (state->type >> 0) & 0xFF;
     question[2] = 0;
     question[3] = 1;  // QCLASS = IN
+    offset += DNS_QD_SIZE;
+
+    if (edns) {
+        // RFC6891 Section 6.1.2. Wire Format
+        if (offset + 1 + DNS_RR_SIZE > MOBILE_DNS_PACKET_SIZE) return false;
+        unsigned char *opt = state->data + offset;
+        opt[0] = 0;  // NAME = root
+        opt[1] = (DNS_QTYPE_OPT >> 8) & 0xFF;
+        opt[2] = (DNS_QTYPE_OPT >> 0) & 0xFF;
+        opt[3] = (MOBILE_DNS_PACKET_SIZE >> 8) & 0xFF;  // UDP payload size
+        opt[4] = (MOBILE_DNS_PACKET_SIZE >> 0) & 0xFF;
+        memset(opt + 5, 0, 6);  // Extended RCODE and flags, RDLENGTH = 0
+        offset += 1 + DNS_RR_SIZE;
+        state->data[11] = 1;  // Additional records: 1
+    }
 
-    state->size = offset + DNS_QD_SIZE;
+    state->size = offset;
     return true;
 }
 
@@ -167,6 +207,7 @@ static int dns_verify_response(struct mobile_buffer_dns *state, unsigned *offset
     // - The recursion bit is set (bit 7)
     // - No error has happened (bits 12-15)
     unsigned flags = state->data[2] << 8 | state->data[3];
+    if ((flags & 0x8200) == 0x8200) return -20;
     if ((flags & 0xFB0F) != 0x8100) {
         return -2 - (flags & 0xF);
     }
@@ -192,7 +233,7 @@ static int dns_verify_response(struct mobile_buffer_dns *state, unsigned *offset
     return ancount;
 }
 
-static int dns_get_answer(struct mobile_buffer_dns *state, unsigned *offset, const char *name, unsigned name_len)
+static int dns_get_answer(struct mobile_buffer_dns *state, unsigned *offset, const char *name, unsigned name_len, uint32_t *ttl)
 {
     // Get the start of the RR info and make sure it all fits in the buffer
     int rname_len = dns_name_len(state, *offset);
@@ -207,47 +248,251 @@ static int dns_get_answer(struct mobile_buffer_dns *state, unsigned *offset, con
         return -1;
     }
 
+    // Skip over the whole record, even if it isn't used
+    unsigned rname = *offset;
+    *offset = rdata + rdlength;
+
     // Make sure this is the kind of response we asked for
-    if (!dns_name_compare(state, offset, name, name_len)) return -2;
+    if (!dns_name_compare(state, &rname, name, name_len)) return -2;
     if ((unsigned)(info[0] << 8 | info[1]) != state->type) return -2;
     if ((info[2] << 8 | info[3]) != 1) return -2;  // QCLASS = IN
     if (state->type == DNS_QTYPE_A && rdlength != 4) return -2;
     if (state->type == DNS_QTYPE_AAAA && rdlength != 16) return -2;
 
-    *offset += DNS_RR_SIZE + rdlength;
+    // RFC2181 Section 8. Time to Live (TTL)
+    *ttl = (uint32_t)info[4] << 24 | (uint32_t)info[5] << 16 |
+        (uint32_t)info[6] << 8 | info[7];
+    if (*ttl & 0x80000000) *ttl = 0;
+
     return rdata;
 }
 
-bool mobile_dns_request_send(struct mobile_adapter *adapter, unsigned conn, const struct mobile_addr *addr_send, const char *host, unsigned host_len)
+#if MOBILE_DNS_CACHE_SIZE
+static bool dns_cache_match(const struct mobile_dns_cache *entry, const char *host, unsigned host_len)
+{
+    return entry->host_len == host_len &&
+        memcmp(entry->host, host, host_len) == 0;
+}
+
+static void dns_cache_remove(struct mobile_adapter_dns *s, unsigned i)
+{
+    s->cache_count--;
+    memmove(&s->cache[i], &s->cache[i + 1],
+        (s->cache_count - i) * sizeof(*s->cache));
+}
+
+static bool dns_cache_valid(struct mobile_adapter *adapter, const struct mobile_dns_cache *entry)
+{
+    if (mobile_timer_has_clock(adapter)) {
+        return (int32_t)(entry->expire - adapter->timer.now) > 0;
+    }
+    return !mobile_timer_check_ms(adapter, MOBILE_TIMER_DNS, entry->expire);
+}
+
+static void dns_cache_store(struct mobile_adapter *adapter, const char *host, unsigned host_len, const unsigned char *ip, uint32_t ttl)
+{
+    struct mobile_adapter_dns *s = &adapter->dns;
+
+    if (host_len > MOBILE_DNS_CACHE_HOST_SIZE) return;
+    if (!ttl) return;
+
+    // Replace any previous answer for the same host
+    for (unsigned i = 0; i < s->cache_count; i++) {
+        if (!dns_cache_match(&s->cache[i], host, host_len)) continue;
+        dns_cache_remove(s, i);
+        break;
+    }
+
+    uint32_t expire;
+    if (mobile_timer_has_clock(adapter)) {
+        if (ttl > DNS_CACHE_TTL_MAX) ttl = DNS_CACHE_TTL_MAX;
+        expire = adapter->timer.now + ttl * 1000;
+    } else {
+        // Every answer expires relative to the time the timer was latched.
+        // Restart it for the new answer, moving the expiration of the
+        //   previous ones back by the time that passed since.
+        if (ttl > DNS_CACHE_TTL_MAX_NOCLOCK) ttl = DNS_CACHE_TTL_MAX_NOCLOCK;
+        uint32_t last = 0;
+        for (unsigned i = 0; i < s->cache_count; i++) {
+            if (s->cache[i].expire > last) last = s->cache[i].expire;
+        }
+        uint32_t elapsed = mobile_timer_elapsed_ms(adapter, MOBILE_TIMER_DNS,
+            last);
+        unsigned i = 0;
+        while (i < s->cache_count) {
+            if (s->cache[i].expire <= elapsed) {
+                dns_cache_remove(s, i);
+            } else {
+                s->cache[i++].expire -= elapsed;
+            }
+        }
+        mobile_timer_latch(adapter, MOBILE_TIMER_DNS);
+        expire = ttl * 1000;
+    }
+
+    // Evict the least recently used answer if necessary
+    if (s->cache_count >= MOBILE_DNS_CACHE_SIZE) s->cache_count--;
+    memmove(&s->cache[1], &s->cache[0], s->cache_count * sizeof(*s->cache));
+    s->cache_count++;
+
+    struct mobile_dns_cache *entry = &s->cache[0];
+    entry->expire = expire;
+    entry->host_len = host_len;
+    memcpy(entry->host, host, host_len);
+    memcpy(entry->ip, ip, MOBILE_HOSTLEN_IPV4);
+}
+
+#if MOBILE_IPV6_TOKENS
+// Forget the answers that point to an address
+static void dns_cache_forget(struct mobile_adapter *adapter, const unsigned char *ip)
+{
+    struct mobile_adapter_dns *s = &adapter->dns;
+
+    unsigned i = 0;
+    while (i < s->cache_count) {
+        if (memcmp(s->cache[i].ip, ip, MOBILE_HOSTLEN_IPV4) == 0) {
+            dns_cache_remove(s, i);
+        } else {
+            i++;
+        }
+    }
+}
+#endif
+#endif
+
+#if MOBILE_IPV6_TOKENS
+// The tokens are taken from the 240.0.0.0/4 block, which is reserved (RFC1112)
+//   and thus never used by any real host.
+static void dns_token_ip(unsigned token, unsigned char *ip)
+{
+    ip[0] = 240;
+    ip[1] = 0;
+    ip[2] = 0;
+    ip[3] = token + 1;
+}
+
+// Get the token for an IPv6 host, reusing the oldest one if they're all taken
+void mobile_dns_token_new(struct mobile_adapter *adapter, const unsigned char *host, unsigned char *ip)
+{
+    struct mobile_adapter_dns *s = &adapter->dns;
+
+    unsigned token;
+    for (token = 0; token < s->token_count; token++) {
+        if (memcmp(s->token_host[token], host, MOBILE_HOSTLEN_IPV6) == 0) {
+            dns_token_ip(token, ip);
+            return;
+        }
+    }
+
+    if (s->token_count < MOBILE_IPV6_TOKENS) {
+        token = s->token_count++;
+    } else {
+        token = s->token_next;
+        s->token_next = (token + 1) % MOBILE_IPV6_TOKENS;
+    }
+    memcpy(s->token_host[token], host, MOBILE_HOSTLEN_IPV6);
+    dns_token_ip(token, ip);
+
+#if MOBILE_DNS_CACHE_SIZE
+    // The token might've pointed to a different host before
+    dns_cache_forget(adapter, ip);
+#endif
+}
+#endif
+
+// Get the IPv6 host behind a token handed out by mobile_dns_request_recv()
+bool mobile_dns_token_get(struct mobile_adapter *adapter, const unsigned char *ip, unsigned char *host)
+{
+#if MOBILE_IPV6_TOKENS
+    struct mobile_adapter_dns *s = &adapter->dns;
+
+    if (ip[0] != 240 || ip[1] != 0 || ip[2] != 0) return false;
+    if (ip[3] < 1 || ip[3] > s->token_count) return false;
+    memcpy(host, s->token_host[ip[3] - 1], MOBILE_HOSTLEN_IPV6);
+    return true;
+#else
+    (void)adapter;
+    (void)ip;
+    (void)host;
+    return false;
+#endif
+}
+
+bool mobile_dns_cache_lookup(struct mobile_adapter *adapter, const char *host, unsigned host_len, unsigned char *ip)
+{
+#if MOBILE_DNS_CACHE_SIZE
+    struct mobile_adapter_dns *s = &adapter->dns;
+
+    for (unsigned i = 0; i < s->cache_count; i++) {
+        if (!dns_cache_match(&s->cache[i], host, host_len)) continue;
+        if (!dns_cache_valid(adapter, &s->cache[i])) {
+            dns_cache_remove(s, i);
+            return false;
+        }
+
+        // Move the answer to the front
+        struct mobile_dns_cache entry = s->cache[i];
+        memmove(&s->cache[1], &s->cache[0], i * sizeof(*s->cache));
+        s->cache[0] = entry;
+
+        memcpy(ip, entry.ip, MOBILE_HOSTLEN_IPV4);
+        return true;
+    }
+    return false;
+#else
+    (void)adapter;
+    (void)host;
+    (void)host_len;
+    (void)ip;
+    return false;
+#endif
+}
+
+// Every query uses a different ID, which is returned in *id, and must be passed
+//   to mobile_dns_request_recv() to match the response. This allows several
+//   queries to be in flight on the same connection.
+bool mobile_dns_request_send(struct mobile_adapter *adapter, unsigned conn, const struct mobile_addr *addr_send, enum mobile_addrtype type, const char *host, unsigned host_len, unsigned *id)
 {
     struct mobile_adapter_dns *s = &adapter->dns;
     struct mobile_buffer_dns *b = &adapter->buffer.dns;
 
-    if (!dns_make_query(b, ++s->id, DNS_QTYPE_A, host, host_len)) return false;
+    enum dns_qtype qtype = DNS_QTYPE_A;
+    if (type == MOBILE_ADDRTYPE_IPV6) qtype = DNS_QTYPE_AAAA;
+
+    // The ID field is 16 bits long
+    s->id = (s->id + 1) & 0xFFFF;
+    if (!dns_make_query(b, s->id, qtype, host, host_len, DNS_EDNS)) {
+        return false;
+    }
 
     if (!mobile_cb_sock_send(adapter, conn, b->data, b->size, addr_send)) {
         return false;
     }
 
+    *id = b->id;
     return true;
 }
 
-// Returns: -1 on error, 0 if processing, 1 on success
-int mobile_dns_request_recv(struct mobile_adapter *adapter, unsigned conn, const struct mobile_addr *addr_send, const char *host, unsigned host_len, unsigned char *ip)
+// Parse the response in the buffer, which has to match the ID and type of the
+//   query in it.
+// Returns: -1 on error, 1 on success, 2 if the response was truncated
+static int dns_parse_response(struct mobile_adapter *adapter, const char *host, unsigned host_len, unsigned char *ip)
 {
     struct mobile_buffer_dns *b = &adapter->buffer.dns;
 
-    struct mobile_addr addr_recv = {0};
-    int recv = mobile_cb_sock_recv(adapter, conn, b->data,
-        MOBILE_DNS_PACKET_SIZE, &addr_recv);
-    if (recv <= 0) return recv;
-    b->size = recv;
-
-    // Verify sender, discard if incorrect
-    if (!mobile_addr_compare(addr_send, &addr_recv)) return 0;
-
     unsigned offset;
     int ancount = dns_verify_response(b, &offset, host, host_len);
+    if (ancount == -20) {
+        debug_prefix(adapter);
+        mobile_debug_print(adapter, PSTR("Response truncated"));
+        mobile_debug_endl(adapter);
+        return 2;
+    }
+#ifdef MOBILE_ENABLE_DNS_EDNS
+    // A server that doesn't understand EDNS may answer with FORMERR, the
+    //   query is then repeated over TCP without it.
+    if (ancount == -3) return 2;
+#endif
     if (ancount < 0) {
         debug_prefix(adapter);
         mobile_debug_print(adapter, PSTR("Query result error: %d"), ancount);
@@ -256,10 +501,24 @@ int mobile_dns_request_recv(struct mobile_adapter *adapter, unsigned conn, const
     }
 
     while (ancount--) {
-        int anoffset = dns_get_answer(b, &offset, host, host_len);
+        uint32_t ttl;
+        int anoffset = dns_get_answer(b, &offset, host, host_len, &ttl);
         if (anoffset < -1) continue;
         if (anoffset == -1) break;
+#if MOBILE_IPV6_TOKENS
+        if (b->type == DNS_QTYPE_AAAA) {
+            mobile_dns_token_new(adapter, b->data + anoffset, ip);
+        } else {
+            memcpy(ip, b->data + anoffset, MOBILE_HOSTLEN_IPV4);
+        }
+#else
         memcpy(ip, b->data + anoffset, MOBILE_HOSTLEN_IPV4);
+#endif
+#if MOBILE_DNS_CACHE_SIZE
+        dns_cache_store(adapter, host, host_len, ip, ttl);
+#else
+        (void)ttl;
+#endif
         return 1;
     }
     debug_prefix(adapter);
@@ -267,3 +526,246 @@ int mobile_dns_request_recv(struct mobile_adapter *adapter, unsigned conn, const
     mobile_debug_endl(adapter);
     return -1;
 }
+
+// Receives the response to any of the queries that are in flight on a
+//   connection, discarding anything else, such as late responses to queries
+//   that have been given up on.
+// Returns: -1 on error, 0 if processing, 1 on success, 2 if the response has to
+//   be requested again over TCP, see mobile_dns_request_tcp_query().
+//   On error or success, *query is the index of the query that was answered,
+//   or count if the connection itself failed.
+// The address is always an IPv4 one. IPv6 addresses are replaced by a token,
+//   see mobile_dns_token_get().
+int mobile_dns_request_recv(struct mobile_adapter *adapter, unsigned conn, const struct mobile_dns_query *queries, unsigned count, const char *host, unsigned host_len, unsigned char *ip, unsigned *query)
+{
+    struct mobile_buffer_dns *b = &adapter->buffer.dns;
+
+    struct mobile_addr addr_recv = {0};
+    int recv = mobile_cb_sock_recv(adapter, conn, b->data,
+        MOBILE_DNS_PACKET_SIZE, &addr_recv);
+    if (recv < 0) *query = count;
+    if (recv <= 0) return recv;
+    b->size = recv;
+
+    // Verify sender and ID, discard if incorrect
+    if (b->size < DNS_HEADER_SIZE) return 0;
+    unsigned id = b->data[0] << 8 | b->data[1];
+    unsigned i;
+    for (i = 0; i < count; i++) {
+        if (queries[i].id != id) continue;
+        if (mobile_addr_compare(queries[i].addr, &addr_recv)) break;
+    }
+    if (i >= count) return 0;
+    *query = i;
+
+    b->id = id;
+    b->type = DNS_QTYPE_A;
+    if (queries[i].type == MOBILE_ADDRTYPE_IPV6) b->type = DNS_QTYPE_AAAA;
+    return dns_parse_response(adapter, host, host_len, ip);
+}
+
+// Queries are sent over TCP when a response doesn't fit in a UDP datagram.
+//   The connection has to be opened by the caller, after which the query is
+//   sent through mobile_dns_request_tcp_send(), and the response received
+//   through mobile_dns_request_tcp_recv(). The data is prefixed by its length.
+bool mobile_dns_request_tcp_query(struct mobile_adapter *adapter, enum mobile_addrtype type, const char *host, unsigned host_len)
+{
+    struct mobile_adapter_dns *s = &adapter->dns;
+    struct mobile_buffer_dns *b = &adapter->buffer.dns;
+
+    enum dns_qtype qtype = DNS_QTYPE_A;
+    if (type == MOBILE_ADDRTYPE_IPV6) qtype = DNS_QTYPE_AAAA;
+
+    s->id = (s->id + 1) & 0xFFFF;
+    if (!dns_make_query(b, s->id, qtype, host, host_len, false)) return false;
+    if (b->size + DNS_TCP_LENGTH_SIZE > MOBILE_DNS_PACKET_SIZE) return false;
+
+    memmove(b->data + DNS_TCP_LENGTH_SIZE, b->data, b->size);
+    b->data[0] = (b->size >> 8) & 0xFF;
+    b->data[1] = (b->size >> 0) & 0xFF;
+    b->size += DNS_TCP_LENGTH_SIZE;
+    b->pos = 0;
+    return true;
+}
+
+// Returns: -1 on error, 0 if processing, 1 once the query has been sent
+int mobile_dns_request_tcp_send(struct mobile_adapter *adapter, unsigned conn)
+{
+    struct mobile_buffer_dns *b = &adapter->buffer.dns;
+
+    int sent = mobile_cb_sock_send(adapter, conn, b->data + b->pos,
+        b->size - b->pos, NULL);
+    if (sent < 0) return -1;
+    b->pos += sent;
+    if (b->pos < b->size) return 0;
+
+    b->pos = 0;
+    return 1;
+}
+
+// Responses bigger than the buffer are cut short, and only the answers that
+//   fit in it are used.
+// Returns: -1 on error, 0 if processing, 1 on success
+int mobile_dns_request_tcp_recv(struct mobile_adapter *adapter, unsigned conn, const char *host, unsigned host_len, unsigned char *ip)
+{
+    struct mobile_buffer_dns *b = &adapter->buffer.dns;
+
+    // Receive the length first
+    if (b->pos < DNS_TCP_LENGTH_SIZE) {
+        int recv = mobile_cb_sock_recv(adapter, conn, b->data + b->pos,
+            DNS_TCP_LENGTH_SIZE - b->pos, NULL);
+        if (recv < 0) return -1;
+        b->pos += recv;
+        if (b->pos < DNS_TCP_LENGTH_SIZE) return 0;
+
+        b->size = b->data[0] << 8 | b->data[1];
+        if (b->size > MOBILE_DNS_PACKET_SIZE) {
+            b->size = MOBILE_DNS_PACKET_SIZE;
+        }
+    }
+
+    unsigned pos = b->pos - DNS_TCP_LENGTH_SIZE;
+    if (pos < b->size) {
+        int recv = mobile_cb_sock_recv(adapter, conn, b->data + pos,
+            b->size - pos, NULL);
+        if (recv < 0) return -1;
+        b->pos += recv;
+        if (pos + recv < b->size) return 0;
+    }
+
+    if (dns_parse_response(adapter, host, host_len, ip) != 1) return -1;
+    return 1;
+}
+
+bool mobile_dns_prefetch_set(struct mobile_adapter *adapter, unsigned num, const char *host)
+{
+#if MOBILE_DNS_PREFETCH_SIZE
+    if (num >= MOBILE_DNS_PREFETCH_SIZE) return false;
+    struct mobile_dns_prefetch *entry = &adapter->dns.prefetch[num];
+    if (host) {
+        size_t host_len = strlen(host);
+        if (!host_len || host_len >= MOBILE_CONFIG_HOST_SIZE) return false;
+        entry->host_len = host_len;
+        memcpy(entry->host, host, host_len);
+    } else {
+        entry->host_len = 0;
+    }
+    entry->pending = false;
+    return true;
+#else
+    (void)adapter;
+    (void)num;
+    (void)host;
+    return false;
+#endif
+}
+
+bool mobile_dns_prefetch_get(struct mobile_adapter *adapter, unsigned num, char *host)
+{
+#if MOBILE_DNS_PREFETCH_SIZE
+    if (num >= MOBILE_DNS_PREFETCH_SIZE) return false;
+    const struct mobile_dns_prefetch *entry = &adapter->dns.prefetch[num];
+    if (!entry->host_len) return false;
+    memcpy(host, entry->host, entry->host_len);
+    host[entry->host_len] = '\0';
+    return true;
+#else
+    (void)adapter;
+    (void)num;
+    (void)host;
+    return false;
+#endif
+}
+
+#if MOBILE_DNS_PREFETCH_SIZE
+// Sends a query for every host in the prefetch list that can't be answered
+//   already, to be received through mobile_dns_prefetch_recv(). Only IPv4
+//   addresses are asked for.
+bool mobile_dns_prefetch_send(struct mobile_adapter *adapter, unsigned conn, const struct mobile_addr *addr)
+{
+    struct mobile_adapter_dns *s = &adapter->dns;
+
+    mobile_addr_copy(&s->prefetch_addr, addr);
+    for (unsigned i = 0; i < MOBILE_DNS_PREFETCH_SIZE; i++) {
+        struct mobile_dns_prefetch *entry = &s->prefetch[i];
+        entry->pending = false;
+        if (!entry->host_len) continue;
+
+        unsigned char ip[MOBILE_HOSTLEN_IPV4];
+        if (mobile_config_host_lookup(adapter, (char *)entry->host,
+                    entry->host_len, ip) ||
+                mobile_dns_cache_lookup(adapter, (char *)entry->host,
+                    entry->host_len, ip)) {
+            continue;
+        }
+
+        if (!mobile_dns_request_send(adapter, conn, addr,
+                MOBILE_ADDRTYPE_IPV4, (char *)entry->host, entry->host_len,
+                &entry->id)) {
+            mobile_dns_prefetch_cancel(adapter);
+            return false;
+        }
+        entry->pending = true;
+    }
+    return true;
+}
+
+// Receives the answer to any of the prefetch queries, and stores it in the
+//   cache. Anything else received on the connection is discarded.
+// Returns: -1 on error, 0 if nothing was answered, 1 if a query was answered
+int mobile_dns_prefetch_recv(struct mobile_adapter *adapter, unsigned conn)
+{
+    struct mobile_adapter_dns *s = &adapter->dns;
+    struct mobile_buffer_dns *b = &adapter->buffer.dns;
+
+    struct mobile_addr addr_recv = {0};
+    int recv = mobile_cb_sock_recv(adapter, conn, b->data,
+        MOBILE_DNS_PACKET_SIZE, &addr_recv);
+    if (recv <= 0) return recv;
+    b->size = recv;
+
+    if (b->size < DNS_HEADER_SIZE) return 0;
+    if (!mobile_addr_compare(&s->prefetch_addr, &addr_recv)) return 0;
+    unsigned id = b->data[0] << 8 | b->data[1];
+    for (unsigned i = 0; i < MOBILE_DNS_PREFETCH_SIZE; i++) {
+        struct mobile_dns_prefetch *entry = &s->prefetch[i];
+        if (!entry->pending || entry->id != id) continue;
+        entry->pending = false;
+
+        // The answer ends up in the cache, if it's valid
+        unsigned char ip[MOBILE_HOSTLEN_IPV4];
+        b->id = id;
+        b->type = DNS_QTYPE_A;
+        dns_parse_response(adapter, (char *)entry->host, entry->host_len, ip);
+        return 1;
+    }
+    return 0;
+}
+
+// Whether the query for a host is waiting for its answer, or if <host> is
+//   NULL, whether any of them are.
+bool mobile_dns_prefetch_pending(struct mobile_adapter *adapter, const char *host, unsigned host_len)
+{
+    struct mobile_adapter_dns *s = &adapter->dns;
+
+    for (unsigned i = 0; i < MOBILE_DNS_PREFETCH_SIZE; i++) {
+        const struct mobile_dns_prefetch *entry = &s->prefetch[i];
+        if (!entry->pending) continue;
+        if (!host) return true;
+        if (entry->host_len == host_len &&
+                memcmp(entry->host, host, host_len) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void mobile_dns_prefetch_cancel(struct mobile_adapter *adapter)
+{
+    struct mobile_adapter_dns *s = &adapter->dns;
+
+    for (unsigned i = 0; i < MOBILE_DNS_PREFETCH_SIZE; i++) {
+        s->prefetch[i].pending = false;
+    }
+}
+#endif
@@ -2,23 +2,113 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
 
-struct mobile_adapter;
-struct mobile_addr;
+#include "mobile.h"
 
+#ifdef MOBILE_LIBCONF_USE
+#include <mobile_config.h>
+#endif
+
+#ifndef MOBILE_DNS_CACHE_SIZE
+#define MOBILE_DNS_CACHE_SIZE 0
+#endif
+#ifndef MOBILE_IPV6_TOKENS
+#define MOBILE_IPV6_TOKENS 0
+#endif
+#if MOBILE_IPV6_TOKENS > 255
+#error "MOBILE_IPV6_TOKENS can't be bigger than 255"
+#endif
+
+#ifndef MOBILE_DNS_PACKET_SIZE
 #define MOBILE_DNS_PACKET_SIZE 512
+#endif
+#if MOBILE_DNS_PACKET_SIZE < 512 || MOBILE_DNS_PACKET_SIZE > 65535
+#error "MOBILE_DNS_PACKET_SIZE must be between 512 and 65535"
+#endif
+
+#ifndef MOBILE_DNS_PREFETCH_SIZE
+#define MOBILE_DNS_PREFETCH_SIZE 0
+#endif
+#if MOBILE_DNS_PREFETCH_SIZE && !MOBILE_DNS_CACHE_SIZE
+#error "MOBILE_DNS_PREFETCH_SIZE requires MOBILE_DNS_CACHE_SIZE"
+#endif
+#if MOBILE_DNS_PREFETCH_SIZE && !MOBILE_INTERNAL_CONNECTIONS
+#error "MOBILE_DNS_PREFETCH_SIZE requires MOBILE_INTERNAL_CONNECTIONS"
+#endif
+
+#define MOBILE_DNS_CACHE_HOST_SIZE 0x20
 
 struct mobile_buffer_dns {
     unsigned id;
     unsigned type;
     unsigned size;
+    unsigned pos;  // Data sent or received so far over TCP
     unsigned char data[MOBILE_DNS_PACKET_SIZE];
 };
 
+// A query that's waiting for a response, see mobile_dns_request_recv()
+struct mobile_dns_query {
+    const struct mobile_addr *addr;
+    unsigned id;
+    enum mobile_addrtype type;  // Type of address that was asked for
+};
+
+#if MOBILE_DNS_CACHE_SIZE
+struct mobile_dns_cache {
+    // Time at which the answer stops being valid, or without
+    //   mobile_func_time_now_ms(), the time since MOBILE_TIMER_DNS was
+    //   latched at which it does.
+    uint32_t expire;
+    unsigned char host_len;
+    unsigned char host[MOBILE_DNS_CACHE_HOST_SIZE];
+    unsigned char ip[MOBILE_HOSTLEN_IPV4];
+};
+#endif
+
+#if MOBILE_DNS_PREFETCH_SIZE
+// A host looked up ahead of time, see mobile_dns_prefetch_set()
+struct mobile_dns_prefetch {
+    unsigned char host_len;  // 0 if unused
+    unsigned char host[MOBILE_CONFIG_HOST_SIZE - 1];
+    bool pending;  // Query sent, waiting for its answer
+    unsigned id;
+};
+#endif
+
 struct mobile_adapter_dns {
     unsigned id;
+#if MOBILE_DNS_CACHE_SIZE
+    // Most recently used first
+    struct mobile_dns_cache cache[MOBILE_DNS_CACHE_SIZE];
+    unsigned cache_count;
+#endif
+#if MOBILE_IPV6_TOKENS
+    // IPv6 hosts handed to the game as 240.0.0.<token + 1>
+    unsigned char token_host[MOBILE_IPV6_TOKENS][MOBILE_HOSTLEN_IPV6];
+    unsigned token_count;
+    unsigned token_next;  // Token to be reused once all of them are in use
+#endif
+#if MOBILE_DNS_PREFETCH_SIZE
+    struct mobile_dns_prefetch prefetch[MOBILE_DNS_PREFETCH_SIZE];
+    struct mobile_addr prefetch_addr;  // Server the queries were sent to
+#endif
 };
 
 void mobile_dns_init(struct mobile_adapter *adapter);
-bool mobile_dns_request_send(struct mobile_adapter *adapter, unsigned conn, const struct mobile_addr *addr_send, const char *host, unsigned host_len);
-int mobile_dns_request_recv(struct mobile_adapter *adapter, unsigned conn, const struct mobile_addr *addr_send, const char *host, unsigned host_len, unsigned char *ip);
+#if MOBILE_IPV6_TOKENS
+void mobile_dns_token_new(struct mobile_adapter *adapter, const unsigned char *host, unsigned char *ip);
+#endif
+bool mobile_dns_token_get(struct mobile_adapter *adapter, const unsigned char *ip, unsigned char *host);
+bool mobile_dns_request_send(struct mobile_adapter *adapter, unsigned conn, const struct mobile_addr *addr_send, enum mobile_addrtype type, const char *host, unsigned host_len, unsigned *id);
+bool mobile_dns_cache_lookup(struct mobile_adapter *adapter, const char *host, unsigned host_len, unsigned char *ip);
+int mobile_dns_request_recv(struct mobile_adapter *adapter, unsigned conn, const struct mobile_dns_query *queries, unsigned count, const char *host, unsigned host_len, unsigned char *ip, unsigned *query);
+bool mobile_dns_request_tcp_query(struct mobile_adapter *adapter, enum mobile_addrtype type, const char *host, unsigned host_len);
+int mobile_dns_request_tcp_send(struct mobile_adapter *adapter, unsigned conn);
+int mobile_dns_request_tcp_recv(struct mobile_adapter *adapter, unsigned conn, const char *host, unsigned host_len, unsigned char *ip);
+#if MOBILE_DNS_PREFETCH_SIZE
+bool mobile_dns_prefetch_send(struct mobile_adapter *adapter, unsigned conn, const struct mobile_addr *addr);
+int mobile_dns_prefetch_recv(struct mobile_adapter *adapter, unsigned conn);
+bool mobile_dns_prefetch_pending(struct mobile_adapter *adapter, const char *host, unsigned host_len);
+void mobile_dns_prefetch_cancel(struct mobile_adapter *adapter);
+#endif
@@ -21,6 +21,9 @@ struct mobile_adapter_global {
     // Whether the relay connection is currently open
     bool number_fetch_active: 1;
 
+    // Whether the current packet was submitted through mobile_packet_submit()
+    bool packet_hle: 1;
+
     // Remaining retries for initializing the relay number
     unsigned char number_fetch_retries;
 };
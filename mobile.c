@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
+#include <limits.h>
 
 #include "mobile_data.h"
 #include "compat.h"
@@ -12,7 +13,7 @@
 #include <mobile_config.h>
 #endif
 
-static const int number_fetch_conn = 0;
+static const int number_fetch_conn = MOBILE_NUMBER_FETCH_CONN;
 
 static void mobile_global_init(struct mobile_adapter *adapter)
 {
@@ -20,6 +21,7 @@ static void mobile_global_init(struct mobile_adapter *adapter)
     adapter->global.active = false;
     adapter->global.packet_parsed = false;
     adapter->global.number_fetch_active = false;
+    adapter->global.packet_hle = false;
     adapter->global.number_fetch_retries = 3;
 }
 
@@ -41,6 +43,7 @@ static void mobile_reset(struct mobile_adapter *adapter)
     mobile_serial_init(adapter);
     adapter->global.active = false;
     adapter->global.packet_parsed = false;
+    adapter->global.packet_hle = false;
 }
 
 static struct mobile_packet packet_parse(struct mobile_adapter *adapter)
@@ -57,20 +60,45 @@ static struct mobile_packet packet_parse(struct mobile_adapter *adapter)
     return packet;
 }
 
-static void packet_create(struct mobile_adapter *adapter, struct mobile_packet packet)
+// Sums the bytes of a buffer, for the packet checksum
+static unsigned packet_checksum(const unsigned char *data, unsigned size)
+{
+    unsigned checksum = 0;
+
+#if UINT_MAX > 0xFFFF
+    // Add up every other byte of a word at once, into two 16-bit halves.
+    // Neither half can overflow within MOBILE_MAX_DATA_SIZE bytes.
+    uint32_t sum = 0;
+    for (; size >= 4; size -= 4, data += 4) {
+        uint32_t word;
+        memcpy(&word, data, sizeof(word));
+        sum += (word & 0x00FF00FF) + (word >> 8 & 0x00FF00FF);
+    }
+    checksum = (sum & 0xFFFF) + (sum >> 16);
+#endif
+
+    while (size--) checksum += *data++;
+    return checksum;
+}
+
+static void packet_create(struct mobile_adapter *adapter, const struct mobile_packet *packet)
 {
     struct mobile_adapter_serial *s = &adapter->serial;
     struct mobile_buffer_serial *b = &adapter->buffer.serial;
 
-    b->header[0] = packet.command | 0x80;
+    // Command handlers build their reply in place, so the data is already in
+    //   the serial buffer (see packet_parse()).
+    // The packet shares its memory with the serial buffer's header, so it
+    //   must be read before the header is written.
+    unsigned char command = packet->command | 0x80;
+    unsigned char length = packet->length;
+
+    b->header[0] = command;
     b->header[1] = 0;
     b->header[2] = 0;
-    b->header[3] = packet.length;
-    memmove(s->buffer, packet.data, packet.length);
+    b->header[3] = length;
 
-    unsigned checksum = 0;
-    for (unsigned i = 0; i < sizeof(b->header); i++) checksum += b->header[i];
-    for (unsigned i = 0; i < packet.length; i++) checksum += s->buffer[i];
+    unsigned checksum = command + length + packet_checksum(s->buffer, length);
     b->footer[0] = checksum >> 8;
     b->footer[1] = checksum;
 }
@@ -86,6 +114,10 @@ static bool command_handle(struct mobile_adapter *adapter)
         *packet = packet_parse(adapter);
         mobile_debug_command(adapter, packet, false);
         adapter->buffer.commands.processing = 0;
+#ifdef MOBILE_ENABLE_STATS
+        adapter->commands.stats_start = adapter->timer.now;
+        adapter->commands.stats_loops = 0;
+#endif
         s->packet_parsed = true;
     }
 
@@ -94,7 +126,14 @@ static bool command_handle(struct mobile_adapter *adapter)
     // If there's a packet to be sent, write it out and return true
     if (send) {
         mobile_debug_command(adapter, send, true);
-        packet_create(adapter, *send);
+        if (s->packet_hle) {
+            // Never sent over the serial, only the header is necessary
+            struct mobile_buffer_serial *b = &adapter->buffer.serial;
+            b->header[0] = send->command | 0x80;
+            b->header[3] = send->length;
+        } else {
+            packet_create(adapter, send);
+        }
         s->packet_parsed = false;
         return true;
     }
@@ -132,11 +171,11 @@ static void number_fetch_handle(struct mobile_adapter *adapter)
             adapter->global.number_fetch_retries--;
         }
         mobile_relay_init(adapter);
-        mobile_cb_time_latch(adapter, MOBILE_TIMER_COMMAND);
+        mobile_timer_latch(adapter, MOBILE_TIMER_COMMAND);
         mobile_cb_sock_open(adapter, number_fetch_conn, MOBILE_SOCKTYPE_TCP,
             adapter->config.relay.type, 0);
         adapter->global.number_fetch_active = true;
-    } else if (mobile_cb_time_check_ms(adapter, MOBILE_TIMER_COMMAND, 3000)) {
+    } else if (mobile_timer_check_ms(adapter, MOBILE_TIMER_COMMAND, 3000)) {
         debug_prefix(adapter);
         mobile_debug_print(adapter, PSTR("Timeout"));
         mobile_debug_endl(adapter);
@@ -159,19 +198,23 @@ enum mobile_action mobile_actions_get(struct mobile_adapter *adapter)
 
     enum mobile_action actions = MOBILE_ACTION_NONE;
 
+    // Every check of the serial timer is done below
+    mobile_timer_update(adapter);
+    mobile_timer_arm(adapter, MOBILE_TIMER_SERIAL);
+
     // If the serial has been active at all, latch the timer
     if (adapter->serial.active) {
         // NOTE: Race condition possible, but not critical.
         adapter->serial.active = false;
         adapter->global.active = true;
-        mobile_cb_time_latch(adapter, MOBILE_TIMER_SERIAL);
+        mobile_timer_latch(adapter, MOBILE_TIMER_SERIAL);
     }
 
     // If the adapter is stuck waiting, with no signal from the game,
     //   put it out of its misery.
     // Timeout has been verified on hardware.
     if (adapter->commands.session_started &&
-            mobile_cb_time_check_ms(adapter, MOBILE_TIMER_SERIAL, 3000)) {
+            mobile_timer_check_ms(adapter, MOBILE_TIMER_SERIAL, 3000)) {
         actions |= MOBILE_ACTION_DROP_CONNECTION;
     }
 
@@ -179,7 +222,7 @@ enum mobile_action mobile_actions_get(struct mobile_adapter *adapter)
     //   ended, perform a reset.
     if (adapter->global.active &&
             !adapter->commands.session_started &&
-            mobile_cb_time_check_ms(adapter, MOBILE_TIMER_SERIAL, 3000)) {
+            mobile_timer_check_ms(adapter, MOBILE_TIMER_SERIAL, 3000)) {
         actions |= MOBILE_ACTION_RESET;
     }
 
@@ -192,7 +235,7 @@ enum mobile_action mobile_actions_get(struct mobile_adapter *adapter)
     //   in an attempt to synchronize.
     if (!adapter->global.active &&
             !adapter->commands.session_started &&
-            mobile_cb_time_check_ms(adapter, MOBILE_TIMER_SERIAL, 500)) {
+            mobile_timer_check_ms(adapter, MOBILE_TIMER_SERIAL, 500)) {
         actions |= MOBILE_ACTION_RESET_SERIAL;
     }
 
@@ -215,11 +258,18 @@ enum mobile_action mobile_actions_get(struct mobile_adapter *adapter)
         actions |= MOBILE_ACTION_INIT_NUMBER;
     }
 
+    // Read ahead from the connections while nothing else is using them
+    if (mobile_commands_socket_io_pending(adapter)) {
+        actions |= MOBILE_ACTION_SOCKET_IO;
+    }
+
     return actions;
 }
 
 void mobile_actions_process(struct mobile_adapter *adapter, enum mobile_action actions)
 {
+    mobile_timer_update(adapter);
+
     // End the session and reset everything
     if (actions & MOBILE_ACTION_DROP_CONNECTION &&
             adapter->commands.session_started) {
@@ -230,7 +280,7 @@ void mobile_actions_process(struct mobile_adapter *adapter, enum mobile_action a
         mobile_debug_endl(adapter);
 
         mobile_reset(adapter);
-        mobile_cb_time_latch(adapter, MOBILE_TIMER_SERIAL);
+        mobile_timer_latch(adapter, MOBILE_TIMER_SERIAL);
         mobile_cb_serial_enable(adapter, adapter->serial.mode_32bit);
         return;
     }
@@ -244,7 +294,7 @@ void mobile_actions_process(struct mobile_adapter *adapter, enum mobile_action a
         // Avoid resetting the serial subsystem, and retain the parsed packet
         adapter->global.active = false;
 
-        mobile_cb_time_latch(adapter, MOBILE_TIMER_SERIAL);
+        mobile_timer_latch(adapter, MOBILE_TIMER_SERIAL);
         mobile_cb_serial_enable(adapter, adapter->serial.mode_32bit);
         return;
     }
@@ -253,6 +303,7 @@ void mobile_actions_process(struct mobile_adapter *adapter, enum mobile_action a
     if (actions & MOBILE_ACTION_PROCESS_COMMAND) {
         if (adapter->serial.state != MOBILE_SERIAL_RESPONSE_WAITING) return;
 
+        mobile_timer_arm(adapter, MOBILE_TIMER_COMMAND);
         if (command_handle(adapter)) {
             adapter->serial.state = MOBILE_SERIAL_RESPONSE_INIT;
         }
@@ -262,7 +313,7 @@ void mobile_actions_process(struct mobile_adapter *adapter, enum mobile_action a
     // Reset the serial's current bit state in an attempt to synchronize
     if (actions & MOBILE_ACTION_RESET_SERIAL) {
         mobile_cb_serial_disable(adapter);
-        mobile_cb_time_latch(adapter, MOBILE_TIMER_SERIAL);
+        mobile_timer_latch(adapter, MOBILE_TIMER_SERIAL);
         mobile_cb_serial_enable(adapter, adapter->serial.mode_32bit);
         return;
     }
@@ -285,9 +336,16 @@ void mobile_actions_process(struct mobile_adapter *adapter, enum mobile_action a
 
     // Use free time to initialize the phone number
     if (actions & MOBILE_ACTION_INIT_NUMBER) {
+        mobile_timer_arm(adapter, MOBILE_TIMER_COMMAND);
         number_fetch_handle(adapter);
         return;
     }
+
+    // Move data between the connections and their buffers
+    if (actions & MOBILE_ACTION_SOCKET_IO) {
+        mobile_commands_socket_io(adapter);
+        return;
+    }
 }
 
 void mobile_loop(struct mobile_adapter *adapter)
@@ -295,6 +353,60 @@ void mobile_loop(struct mobile_adapter *adapter)
     mobile_actions_process(adapter, mobile_actions_get(adapter));
 }
 
+unsigned mobile_next_deadline_ms(struct mobile_adapter *adapter)
+{
+    if (!adapter->global.start) return MOBILE_DEADLINE_NONE;
+    mobile_timer_update(adapter);
+
+    // The serial timer must be latched
+    if (adapter->serial.active) return 0;
+
+    // Any of these actions don't wait for anything
+    if (adapter->serial.state == MOBILE_SERIAL_WAITING &&
+            adapter->commands.mode_32bit != adapter->serial.mode_32bit) {
+        return 0;
+    }
+    if (adapter->config.dirty) return 0;
+    if (!adapter->global.number_fetch_active &&
+            !adapter->global.active &&
+            adapter->global.number_fetch_retries &&
+            adapter->config.relay.type != MOBILE_ADDRTYPE_NONE) {
+        return 0;
+    }
+
+    unsigned deadline = mobile_timer_remaining_ms(adapter, MOBILE_TIMER_SERIAL);
+
+    // A command or the number fetch are waiting on the command timer.
+    // If they didn't check it last time, they're not waiting on anything.
+    if (adapter->serial.state == MOBILE_SERIAL_RESPONSE_WAITING ||
+            adapter->global.number_fetch_active) {
+        unsigned command = mobile_timer_remaining_ms(adapter,
+            MOBILE_TIMER_COMMAND);
+        if (command == MOBILE_DEADLINE_NONE) return 0;
+        if (command < deadline) deadline = command;
+    }
+
+#if MOBILE_DNS_PREFETCH_SIZE
+    // Hosts being looked up ahead of time are given up on after a while
+    if (mobile_dns_prefetch_pending(adapter, NULL, 0)) {
+        unsigned prefetch = mobile_timer_remaining_ms(adapter,
+            MOBILE_TIMER_DNS_PREFETCH);
+        if (prefetch == MOBILE_DEADLINE_NONE) return 0;
+        if (prefetch < deadline) deadline = prefetch;
+    }
+#endif
+
+    // Sockets that can't be polled are tried every once in a while
+    if (mobile_commands_socket_io_waiting(adapter)) {
+        unsigned io = mobile_timer_remaining_ms(adapter,
+            MOBILE_TIMER_SOCKET_IO);
+        if (io == MOBILE_DEADLINE_NONE) return 0;
+        if (io < deadline) deadline = io;
+    }
+
+    return deadline;
+}
+
 uint8_t mobile_transfer(struct mobile_adapter *adapter, uint8_t c)
 {
     adapter->serial.active = true;
@@ -323,6 +435,77 @@ uint32_t mobile_transfer_32bit(struct mobile_adapter *adapter, uint32_t c)
     return mobile_serial_transfer_32bit(adapter, c);
 }
 
+size_t mobile_transfer_buffer(struct mobile_adapter *adapter, const uint8_t *in, uint8_t *out, size_t size)
+{
+    adapter->serial.active = true;
+    return mobile_serial_transfer_buffer(adapter, in, out, size);
+}
+
+size_t mobile_transfer_buffer_32bit(struct mobile_adapter *adapter, const uint32_t *in, uint32_t *out, size_t size)
+{
+    adapter->serial.active = true;
+    return mobile_serial_transfer_buffer_32bit(adapter, in, out, size);
+}
+
+bool mobile_packet_submit(struct mobile_adapter *adapter, unsigned command, const void *data, unsigned size)
+{
+    struct mobile_adapter_serial *s = &adapter->serial;
+    struct mobile_buffer_serial *b = &adapter->buffer.serial;
+
+    if (!adapter->global.start) return false;
+    if (size > MOBILE_MAX_DATA_SIZE) return false;
+
+    // A previous packet is still being processed, or its reply wasn't read
+    if (s->state != MOBILE_SERIAL_INIT && s->state != MOBILE_SERIAL_WAITING) {
+        return false;
+    }
+
+    // Mirror the checks done in serial.c:mobile_serial_transfer() when the
+    //   header is received, except that there's nobody to send an error to.
+    unsigned char flags = mobile_commands_flags(command);
+    if (!adapter->commands.session_started) {
+        if (!(flags & MOBILE_COMMAND_FLAG_SESSIONLESS)) return false;
+
+        // Update device type
+        unsigned char d = adapter->config.device;
+        s->device = d & ~MOBILE_CONFIG_DEVICE_UNMETERED;
+        s->device_unmetered = d & MOBILE_CONFIG_DEVICE_UNMETERED;
+    }
+    if (command == MOBILE_COMMAND_NULL) return false;
+    if (!(flags & MOBILE_COMMAND_FLAG_EXISTS)) return false;
+
+    b->header[0] = command;
+    b->header[1] = 0;
+    b->header[2] = 0;
+    b->header[3] = size;
+    b->error = 0;
+    if (size) memcpy(s->buffer, data, size);
+
+    adapter->global.packet_hle = true;
+    s->active = true;
+    s->state = MOBILE_SERIAL_RESPONSE_WAITING;
+    mobile_callback_notify(adapter);
+    return true;
+}
+
+int mobile_packet_poll_reply(struct mobile_adapter *adapter, unsigned *command, void *data)
+{
+    struct mobile_adapter_serial *s = &adapter->serial;
+    struct mobile_buffer_serial *b = &adapter->buffer.serial;
+
+    if (!adapter->global.packet_hle) return -1;
+    if (s->state != MOBILE_SERIAL_RESPONSE_INIT) return -1;
+
+    unsigned size = b->header[3];
+    *command = b->header[0] & ~0x80;
+    memcpy(data, s->buffer, size);
+
+    adapter->global.packet_hle = false;
+    s->active = true;
+    s->state = MOBILE_SERIAL_WAITING;
+    return (int)size;
+}
+
 void mobile_start(struct mobile_adapter *adapter)
 {
     if (adapter->global.start) return;
@@ -330,7 +513,8 @@ void mobile_start(struct mobile_adapter *adapter)
     if (!adapter->config.loaded) mobile_config_load(adapter);
 
     adapter->global.start = true;
-    mobile_cb_time_latch(adapter, MOBILE_TIMER_SERIAL);
+    mobile_timer_update(adapter);
+    mobile_timer_latch(adapter, MOBILE_TIMER_SERIAL);
     mobile_cb_serial_enable(adapter, adapter->serial.mode_32bit);
 }
 
@@ -357,6 +541,7 @@ void mobile_init(struct mobile_adapter *adapter, void *user)
 
     mobile_global_init(adapter);
     mobile_callback_init(adapter);
+    mobile_timer_init(adapter);
     mobile_config_init(adapter);
     mobile_debug_init(adapter);
     mobile_commands_init(adapter);
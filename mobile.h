@@ -13,19 +13,34 @@ extern "C" {
 #include <stdint.h>
 #include <stdbool.h>
 
+#ifdef MOBILE_LIBCONF_USE
+#include <mobile_config.h>
+#endif
+
+#ifndef MOBILE_GAME_CONNECTIONS
+#define MOBILE_GAME_CONNECTIONS 2
+#endif
+#ifndef MOBILE_INTERNAL_CONNECTIONS
+#define MOBILE_INTERNAL_CONNECTIONS 0
+#endif
+
 struct mobile_adapter;
 
 // Limits any user of this library should abide by
-#define MOBILE_MAX_CONNECTIONS 2
-#define MOBILE_MAX_TIMERS 4
+#define MOBILE_MAX_CONNECTIONS \
+    (MOBILE_GAME_CONNECTIONS + MOBILE_INTERNAL_CONNECTIONS)
+#define MOBILE_MAX_TIMERS 5
 #define MOBILE_MAX_TRANSFER_SIZE 0xFE  // MOBILE_MAX_DATA_SIZE - 1
 #define MOBILE_MAX_NUMBER_SIZE 0x20  // Allowed phone number length: 7-16
 #define MOBILE_CONFIG_SIZE 0x200
 #define MOBILE_RELAY_TOKEN_SIZE 0x10
+#define MOBILE_CONFIG_HOSTS 4
+#define MOBILE_CONFIG_HOST_SIZE 0x20  // Including the terminating zero
 
 // Utility defines
 #define MOBILE_SERIAL_IDLE_BYTE 0xD2
 #define MOBILE_SERIAL_IDLE_WORD 0xD2D2D2D2
+#define MOBILE_DEADLINE_NONE ((unsigned)-1)
 #define MOBILE_DNS_PORT 53
 #define MOBILE_DEFAULT_P2P_PORT 1027
 #define MOBILE_DEFAULT_RELAY_PORT 31227
@@ -33,6 +48,8 @@ struct mobile_adapter;
 #define MOBILE_HOSTLEN_IPV4 4
 #define MOBILE_HOSTLEN_IPV6 16
 
+#define MOBILE_STATS_BUCKETS 16
+
 enum mobile_adapter_device {
     // The clients.
     MOBILE_ADAPTER_GAMEBOY,
@@ -53,7 +70,8 @@ enum mobile_action {
     MOBILE_ACTION_RESET_SERIAL = 1 << 3,
     MOBILE_ACTION_CHANGE_32BIT_MODE = 1 << 4,
     MOBILE_ACTION_WRITE_CONFIG = 1 << 5,
-    MOBILE_ACTION_INIT_NUMBER = 1 << 6
+    MOBILE_ACTION_INIT_NUMBER = 1 << 6,
+    MOBILE_ACTION_SOCKET_IO = 1 << 7
 };
 
 enum mobile_socktype {
@@ -61,6 +79,12 @@ enum mobile_socktype {
     MOBILE_SOCKTYPE_UDP
 };
 
+enum mobile_sockpoll {
+    MOBILE_SOCKPOLL_READABLE = 1 << 0,
+    MOBILE_SOCKPOLL_WRITABLE = 1 << 1,
+    MOBILE_SOCKPOLL_HANGUP = 1 << 2
+};
+
 enum mobile_addrtype {
     MOBILE_ADDRTYPE_NONE,
     MOBILE_ADDRTYPE_IPV4,
@@ -227,6 +251,27 @@ typedef bool (*mobile_func_time_check_ms)(void *user, unsigned timer, unsigned m
 bool mobile_impl_time_check_ms(void *user, unsigned timer, unsigned ms);
 void mobile_def_time_check_ms(struct mobile_adapter *adapter, mobile_func_time_check_ms func);
 
+// mobile_func_time_now_ms - Get the current time
+//
+// Alternative to mobile_func_time_latch() and mobile_func_time_check_ms().
+// Returns the current value of a millisecond counter, the same notes on time
+// measurement apply. The counter must never go backwards, but is allowed to
+// wrap around, and its starting value doesn't matter.
+//
+// When this function is defined, libmobile keeps track of its own timers, and
+// neither mobile_func_time_latch() nor mobile_func_time_check_ms() will ever
+// be called. This is cheaper, as the time is only requested once every time
+// mobile_loop() runs, and it allows mobile_next_deadline_ms() to be computed
+// precisely.
+//
+// This function is optional. When using MOBILE_ENABLE_IMPL_WEAK, it's only
+// used if it's defined, and the toolchain supports weak symbols.
+//
+// Returns: current time in milliseconds
+typedef uint32_t (*mobile_func_time_now_ms)(void *user);
+uint32_t mobile_impl_time_now_ms(void *user);
+void mobile_def_time_now_ms(struct mobile_adapter *adapter, mobile_func_time_now_ms func);
+
 // mobile_func_sock_open - Open a socket
 //
 // Creates a socket of the specified type and address type. The available
@@ -393,6 +438,77 @@ typedef int (*mobile_func_sock_recv)(void *user, unsigned conn, void *data, unsi
 int mobile_impl_sock_recv(void *user, unsigned conn, void *data, unsigned size, struct mobile_addr *addr);
 void mobile_def_sock_recv(struct mobile_adapter *adapter, mobile_func_sock_recv func);
 
+// mobile_func_sock_poll - Check which operations a socket is ready for
+//
+// Checks, without blocking, whether the specified socket has data that can be
+// received, has room for more data to be sent, or has been disconnected by the
+// remote, and returns the matching MOBILE_SOCKPOLL_* flags. A socket that has
+// been disconnected must report MOBILE_SOCKPOLL_HANGUP, so the disconnect can
+// be reported to the game right away.
+//
+// When defined, libmobile skips the calls to mobile_func_sock_recv() and
+// mobile_func_sock_send() that wouldn't do anything, while waiting on data for
+// the DATA command, and while buffering data in the background. It's only
+// called for connected TCP sockets, and UDP sockets opened by the game, for
+// which MOBILE_SOCKPOLL_HANGUP is meaningless.
+//
+// This function is optional. When using MOBILE_ENABLE_IMPL_WEAK, it's only
+// used if it's defined, and the toolchain supports weak symbols.
+//
+// Returns: MOBILE_SOCKPOLL_* flags on success, -1 on error
+// Parameters:
+// - conn: Socket number
+typedef int (*mobile_func_sock_poll)(void *user, unsigned conn);
+int mobile_impl_sock_poll(void *user, unsigned conn);
+void mobile_def_sock_poll(struct mobile_adapter *adapter, mobile_func_sock_poll func);
+
+// mobile_func_dns_resolve - Start looking up a host name
+//
+// Starts looking up the address of <host> through whatever means the
+// implementation has available, such as the system's resolver, without
+// blocking. The result is then picked up through mobile_func_dns_poll(). The
+// <host> parameter isn't NULL-terminated, and contains <size> characters.
+//
+// Only one lookup is in progress at any time. A lookup may be abandoned by
+// libmobile without being polled to completion, in which case calling this
+// function again must cancel it.
+//
+// When defined along with mobile_func_dns_poll(), libmobile sends its DNS
+// queries through these two functions instead of querying the DNS servers
+// itself, though hosts set through mobile_config_set_host() and the DNS cache
+// are still checked first.
+//
+// This function is optional. When using MOBILE_ENABLE_IMPL_WEAK, it's only
+// used if it's defined, and the toolchain supports weak symbols.
+//
+// Returns: true if the lookup has started, false on error
+// Parameters:
+// - host: Host name to look up
+// - size: Length of the host name
+typedef bool (*mobile_func_dns_resolve)(void *user, const char *host, unsigned size);
+bool mobile_impl_dns_resolve(void *user, const char *host, unsigned size);
+void mobile_def_dns_resolve(struct mobile_adapter *adapter, mobile_func_dns_resolve func);
+
+// mobile_func_dns_poll - Check on a host name lookup
+//
+// Checks, without blocking, whether the lookup started by
+// mobile_func_dns_resolve() has finished, and if so, stores its result in the
+// buffer pointed to by <addr>. The port of the address is ignored. IPv6
+// addresses are only usable if libmobile has been built with
+// MOBILE_IPV6_TOKENS, otherwise an IPv4 address must be returned.
+//
+// This function is called repeatedly until the lookup either finishes, or
+// libmobile gives up on it.
+//
+// This function is optional, see mobile_func_dns_resolve().
+//
+// Returns: 1 on success, 0 if the lookup is in progress, -1 on error
+// Parameters:
+// - addr: Address buffer
+typedef int (*mobile_func_dns_poll)(void *user, struct mobile_addr *addr);
+int mobile_impl_dns_poll(void *user, struct mobile_addr *addr);
+void mobile_def_dns_poll(struct mobile_adapter *adapter, mobile_func_dns_poll func);
+
 // mobile_func_update_number - Receive number
 //
 // This function is called whenever the library either connects to the relay to
@@ -416,6 +532,29 @@ typedef void (*mobile_func_update_number)(void *user, enum mobile_number type, c
 void mobile_impl_update_number(void *user, enum mobile_number type, const char *number);
 void mobile_def_update_number(struct mobile_adapter *adapter, mobile_func_update_number func);
 
+// mobile_func_notify - Wake up the mobile_loop() thread
+//
+// Called whenever something happened that requires mobile_loop() to be run,
+// such as a packet having been fully received through mobile_transfer() and
+// being ready for processing, the serial mode having to be switched between 8
+// and 32 bits, or the configuration data having to be written out. This
+// allows implementations that run mobile_transfer() and mobile_loop() in
+// separate threads to block until there's work to be done, instead of
+// continuously calling mobile_loop(). It's fired once per event.
+//
+// This function may be called from within mobile_transfer() and any of the
+// mobile_config_set_* functions, and thus from any thread or an interrupt
+// handler, so it must not block, and may not call any libmobile function. A
+// typical implementation signals a condition variable, semaphore or eventfd.
+//
+// Note that mobile_loop() must still be called periodically, to keep track of
+// the various timeouts.
+//
+// This function is completely optional.
+typedef void (*mobile_func_notify)(void *user);
+void mobile_impl_notify(void *user);
+void mobile_def_notify(struct mobile_adapter *adapter, mobile_func_notify func);
+
 void mobile_config_set_device(struct mobile_adapter *adapter, enum mobile_adapter_device device, bool unmetered);
 void mobile_config_get_device(struct mobile_adapter *adapter, enum mobile_adapter_device *device, bool *unmetered);
 void mobile_config_set_dns(struct mobile_adapter *adapter, const struct mobile_addr *dns, enum mobile_dns num);
@@ -427,6 +566,37 @@ void mobile_config_get_relay(struct mobile_adapter *adapter, struct mobile_addr
 void mobile_config_set_relay_token(struct mobile_adapter *adapter, const unsigned char *token);
 bool mobile_config_get_relay_token(struct mobile_adapter *adapter, unsigned char *token);
 
+// mobile_config_set_host - Resolve a host without querying the DNS servers
+//
+// Makes the adapter answer any DNS query for <host> with <ip>, without any
+// network traffic. There's room for MOBILE_CONFIG_HOSTS of these, and <num>
+// picks which one to replace. The host name is zero-terminated, and must fit
+// in MOBILE_CONFIG_HOST_SIZE. It's matched exactly, including its case.
+// Setting <host> to NULL removes the entry.
+//
+// mobile_config_get_host() returns false if the entry is unused.
+void mobile_config_set_host(struct mobile_adapter *adapter, unsigned num, const char *host, const unsigned char *ip);
+bool mobile_config_get_host(struct mobile_adapter *adapter, unsigned num, char *host, unsigned char *ip);
+
+// mobile_dns_prefetch_set - Look up a host as soon as the game connects
+//
+// Makes the adapter look up the IPv4 address of <host> in the background as
+// soon as the game connects to the internet, and store it in the DNS cache.
+// Games tend to look up the same few hosts right after connecting, and these
+// requests are then answered without waiting for another round trip. There's
+// room for MOBILE_DNS_PREFETCH_SIZE of these, and <num> picks which one to
+// replace. The host name is zero-terminated, and must fit in
+// MOBILE_CONFIG_HOST_SIZE. Setting <host> to NULL removes the entry.
+//
+// Hosts aren't looked up ahead of time when using mobile_func_dns_resolve().
+// The list isn't part of the configuration, and isn't saved along with it.
+//
+// These functions return false if the library was built without
+// MOBILE_DNS_PREFETCH_SIZE, or if the entry is out of range or unused.
+// They must be called from the same thread as mobile_loop().
+bool mobile_dns_prefetch_set(struct mobile_adapter *adapter, unsigned num, const char *host);
+bool mobile_dns_prefetch_get(struct mobile_adapter *adapter, unsigned num, char *host);
+
 // mobile_config_load - Manually force a load of the configuration values
 //
 // Makes sure the configuration has been loaded, by forcing the configuration
@@ -496,6 +666,31 @@ void mobile_actions_process(struct mobile_adapter *adapter, enum mobile_action a
 // - adapter: Library state
 void mobile_loop(struct mobile_adapter *adapter);
 
+// mobile_next_deadline_ms - Time until mobile_loop() has to be called again
+//
+// Returns the amount of milliseconds mobile_loop() may be left uncalled without
+// missing any of the library's timeouts, as of the last time it was called.
+// This allows the user to put the main loop thread to sleep, instead of
+// calling mobile_loop() continuously. When 0 is returned, mobile_loop() has
+// work to do right away. When MOBILE_DEADLINE_NONE is returned, there's no
+// timeout to wait for, and mobile_loop() only needs to be called again once
+// something else happens.
+//
+// Timeouts aren't the only thing mobile_loop() may have to wait for. It must
+// also be called whenever mobile_transfer() has been called, or whenever a
+// socket becomes ready for reading or writing. See mobile_func_notify() for a
+// way to be notified of the former. Without mobile_func_sock_poll(), sockets
+// are instead tried periodically, which is accounted for in the deadline.
+//
+// When using the mobile_func_time_check_ms() callback instead of
+// mobile_func_time_now_ms(), this function has to call it several times to
+// measure the time that's left.
+//
+// Parameters:
+// - adapter: Library state
+// Returns: milliseconds until the next timeout, or MOBILE_DEADLINE_NONE
+unsigned mobile_next_deadline_ms(struct mobile_adapter *adapter);
+
 // mobile_transfer - Exchange a byte between the adapter and the console
 // mobile_transfer_32bit - Exchange a word between the adapter and the console
 //
@@ -541,6 +736,107 @@ void mobile_loop(struct mobile_adapter *adapter);
 uint8_t mobile_transfer(struct mobile_adapter *adapter, uint8_t c);
 uint32_t mobile_transfer_32bit(struct mobile_adapter *adapter, uint32_t c);
 
+// mobile_transfer_buffer - Exchange multiple bytes between adapter and console
+// mobile_transfer_buffer_32bit - Exchange multiple words
+//
+// Equivalent to calling mobile_transfer() or mobile_transfer_32bit() for each
+// element of <in> in order, storing the results into the same position of
+// <out>, but much cheaper when the exchanged data is already known in bulk,
+// such as in an emulator that only synchronizes the link port every frame.
+//
+// These functions stop early whenever the adapter requires mobile_loop() to
+// run before the exchange can meaningfully continue: when a packet has been
+// received and must be processed, or when the serial mode is about to change.
+// The elements of <out> past the returned amount aren't written to, and the
+// corresponding elements of <in> haven't been consumed, so these may be
+// passed again once mobile_loop() has been called.
+//
+// The same thread-safety rules as mobile_transfer() apply. Only the variant
+// matching the current serial mode may be used.
+//
+// Parameters:
+// - adapter: Library state
+// - in: Data received from the console
+// - out: Data to send to the console
+// - size: Amount of elements in <in> and <out>
+// Returns: Amount of elements that were exchanged
+size_t mobile_transfer_buffer(struct mobile_adapter *adapter, const uint8_t *in, uint8_t *out, size_t size);
+size_t mobile_transfer_buffer_32bit(struct mobile_adapter *adapter, const uint32_t *in, uint32_t *out, size_t size);
+
+// mobile_packet_submit - Submit a whole packet, bypassing the serial protocol
+// mobile_packet_poll_reply - Retrieve the reply to a submitted packet
+//
+// High-level emulators that already know where each packet sent by the
+// console starts and ends may use these functions in place of
+// mobile_transfer(), avoiding the need to encode and decode every byte of the
+// serial protocol. The packet is handed to the command processing as-is, and
+// its reply is returned as-is, without any of the header, checksum and
+// acknowledgement bytes.
+//
+// After a packet is submitted, mobile_loop() must be called until
+// mobile_packet_poll_reply() returns a reply, after which a new packet may be
+// submitted. Only a single packet may be in flight at any time.
+//
+// These functions must be called from the same thread as mobile_loop(), and
+// may not be mixed with mobile_transfer() and its variants. Unlike those
+// functions, they may be used regardless of the current serial mode.
+//
+// mobile_packet_submit() returns false if the packet was ignored, and no reply
+// will be produced. This happens when the adapter would ignore the packet if
+// it was sent over the serial, for example if the session hasn't been started
+// yet, if the command doesn't exist, or if a previous packet is still being
+// processed.
+//
+// mobile_packet_poll_reply() writes up to MOBILE_MAX_TRANSFER_SIZE + 1 bytes
+// into <data>, and returns the amount of bytes written, or -1 if no reply is
+// available yet. The reply command is stored in <command>, without the 0x80
+// bit that is set when the reply is sent over the serial.
+//
+// Parameters:
+// - adapter: Library state
+// - command: Packet command ID
+// - data: Packet data, may be NULL if <size> is 0
+// - size: Size of the packet data (max MOBILE_MAX_TRANSFER_SIZE + 1)
+// Returns: see above
+bool mobile_packet_submit(struct mobile_adapter *adapter, unsigned command, const void *data, unsigned size);
+int mobile_packet_poll_reply(struct mobile_adapter *adapter, unsigned *command, void *data);
+
+// mobile_stats_get - Retrieve the processing statistics of a command
+// mobile_stats_reset - Clear the statistics of every command
+//
+// When the library is built with MOBILE_ENABLE_STATS, every packet the
+// adapter answers is counted under the command it was sent with, along with
+// the time it took from receiving the packet to having its reply ready, and
+// the amount of mobile_loop() iterations that went by without a reply. The
+// time is only measured if mobile_func_time_now_ms() has been provided.
+//
+// Besides the totals, both values are kept in a log2 histogram of
+// MOBILE_STATS_BUCKETS buckets: bucket 0 counts the packets answered in 0
+// milliseconds (or iterations), bucket N counts those answered in 2^(N-1) up
+// to 2^N - 1, and the last bucket counts everything above that. The
+// histogram counters stop at UINT16_MAX.
+//
+// mobile_stats_get() returns false if the library was built without
+// MOBILE_ENABLE_STATS, or if the command doesn't exist. Commands that are
+// answered with an error are counted as well.
+//
+// These functions must be called from the same thread as mobile_loop().
+//
+// Parameters:
+// - adapter: Library state
+// - command: Packet command ID
+// - stats: Statistics of the command
+// Returns: see above
+struct mobile_stats_command {
+    uint32_t count;  // Amount of packets answered
+    uint32_t time_ms;  // Total time spent answering them
+    uint32_t loops;  // Total mobile_loop() iterations spent without a reply
+    uint16_t time_hist[MOBILE_STATS_BUCKETS];  // Time histogram, in ms
+    uint16_t loops_hist[MOBILE_STATS_BUCKETS];  // Iterations histogram
+};
+bool mobile_stats_get(struct mobile_adapter *adapter, unsigned command, struct mobile_stats_command *stats);
+void mobile_stats_reset(struct mobile_adapter *adapter);
+
 // mobile_start - Begin the library operation
 //
 // Does necessary post-initialization, such as making sure the configuration is
@@ -16,6 +16,7 @@
 #include "mobile.h"
 #include "global.h"
 #include "callback.h"
+#include "timer.h"
 #include "config.h"
 #include "debug.h"
 #include "serial.h"
@@ -27,6 +28,7 @@ struct mobile_adapter {
     void *user;
     struct mobile_adapter_global global;
     struct mobile_adapter_callback callback;
+    struct mobile_adapter_timer timer;
     struct mobile_adapter_config config;
     struct mobile_adapter_debug debug;
     struct mobile_adapter_serial serial;
@@ -10,18 +10,93 @@ void mobile_serial_init(struct mobile_adapter *adapter)
     adapter->serial.active = false;
 }
 
-uint8_t mobile_serial_transfer(struct mobile_adapter *adapter, uint8_t c)
+// Parses the packet header once it has been received.
+static void serial_header_done(struct mobile_adapter *adapter, enum mobile_serial_state *state)
 {
     struct mobile_adapter_serial *s = &adapter->serial;
     struct mobile_buffer_serial *b = &adapter->buffer.serial;
 
-    // Workaround for atomic load in clang...
-    enum mobile_serial_state state = s->state;
+    // Done receiving the header, read content size.
+    b->data_size = b->header[3];
+
+    // Data size is a u16be, but it may not be bigger than 0xff...
+    if (b->header[2] != 0) {
+        b->current = 0;
+        *state = MOBILE_SERIAL_WAITING;
+    }
+
+    unsigned char flags = mobile_commands_flags(b->header[0]);
+
+    if (!adapter->commands.session_started) {
+        // If we haven't begun a session, this is as good as any place
+        //   to stop parsing, as we shouldn't react to this.
+        // TODO: Re-verify this behavior on hardware.
+        if (!(flags & MOBILE_COMMAND_FLAG_SESSIONLESS)) {
+            b->current = 0;
+            *state = MOBILE_SERIAL_WAITING;
+        }
+
+        // Update device type
+        unsigned char d = adapter->config.device;
+        s->device = d & ~MOBILE_CONFIG_DEVICE_UNMETERED;
+        s->device_unmetered = d & MOBILE_CONFIG_DEVICE_UNMETERED;
+    }
+
+    // If the command doesn't exist, set the error...
+    if (!(flags & MOBILE_COMMAND_FLAG_EXISTS)) {
+        b->error = MOBILE_SERIAL_ERROR_UNKNOWN_COMMAND;
+    }
+
+    b->current = 0;
+    if (b->data_size) {
+        *state = MOBILE_SERIAL_DATA;
+    } else {
+        *state = MOBILE_SERIAL_CHECKSUM;
+    }
+}
+
+// Switches to the next state once the packet data has been received.
+static void serial_data_done(struct mobile_adapter *adapter, enum mobile_serial_state *state)
+{
+    struct mobile_adapter_serial *s = &adapter->serial;
+    struct mobile_buffer_serial *b = &adapter->buffer.serial;
+
+    if (s->mode_32bit && b->current % 4) {
+        b->current = 4 - (b->current % 4);
+        *state = MOBILE_SERIAL_DATA_PAD;
+    } else {
+        b->current = 0;
+        *state = MOBILE_SERIAL_CHECKSUM;
+    }
+}
+
+// Switches to the next state once the reply data has been sent.
+static void serial_response_data_done(struct mobile_adapter *adapter, enum mobile_serial_state *state)
+{
+    struct mobile_adapter_serial *s = &adapter->serial;
+    struct mobile_buffer_serial *b = &adapter->buffer.serial;
+
+    if (s->mode_32bit && b->current % 4) {
+        b->current = 4 - (b->current % 4);
+        *state = MOBILE_SERIAL_RESPONSE_DATA_PAD;
+    } else {
+        b->current = 0;
+        *state = MOBILE_SERIAL_RESPONSE_CHECKSUM;
+    }
+}
+
+// Runs the serial state machine for a single byte.
+// The state is kept in <state> instead of being accessed atomically through
+//   the adapter structure, so the caller may decide when to store it.
+static uint8_t serial_transfer(struct mobile_adapter *adapter, enum mobile_serial_state *state, uint8_t c)
+{
+    struct mobile_adapter_serial *s = &adapter->serial;
+    struct mobile_buffer_serial *b = &adapter->buffer.serial;
 
-    switch (state) {
+    switch (*state) {
     case MOBILE_SERIAL_INIT:
         b->current = 0;
-        s->state = MOBILE_SERIAL_WAITING;
+        *state = MOBILE_SERIAL_WAITING;
         // fallthrough
 
     case MOBILE_SERIAL_WAITING:
@@ -35,7 +110,7 @@ uint8_t mobile_serial_transfer(struct mobile_adapter *adapter, uint8_t c)
             b->error = 0;
 
             b->current = 0;
-            s->state = MOBILE_SERIAL_HEADER;
+            *state = MOBILE_SERIAL_HEADER;
         } else {
             b->current = 0;
         }
@@ -47,62 +122,19 @@ uint8_t mobile_serial_transfer(struct mobile_adapter *adapter, uint8_t c)
         b->checksum += c;
 
         if (b->current < sizeof(b->header)) break;
-
-        // Done receiving the header, read content size.
-        b->data_size = b->header[3];
-
-        // Data size is a u16be, but it may not be bigger than 0xff...
-        if (b->header[2] != 0) {
-            b->current = 0;
-            s->state = MOBILE_SERIAL_WAITING;
-        }
-
-        if (!adapter->commands.session_started) {
-            // If we haven't begun a session, this is as good as any place
-            //   to stop parsing, as we shouldn't react to this.
-            // TODO: Re-verify this behavior on hardware.
-            if (b->header[0] != MOBILE_COMMAND_START) {
-                b->current = 0;
-                s->state = MOBILE_SERIAL_WAITING;
-            }
-
-            // Update device type
-            unsigned char d = adapter->config.device;
-            s->device = d & ~MOBILE_CONFIG_DEVICE_UNMETERED;
-            s->device_unmetered = d & MOBILE_CONFIG_DEVICE_UNMETERED;
-        }
-
-        // If the command doesn't exist, set the error...
-        if (!mobile_commands_exists(b->header[0])) {
-            b->error = MOBILE_SERIAL_ERROR_UNKNOWN_COMMAND;
-        }
-
-        b->current = 0;
-        if (b->data_size) {
-            s->state = MOBILE_SERIAL_DATA;
-        } else {
-            s->state = MOBILE_SERIAL_CHECKSUM;
-        }
+        serial_header_done(adapter, state);
         break;
 
     case MOBILE_SERIAL_DATA:
         // Receive the data
         s->buffer[b->current++] = c;
         b->checksum += c;
-        if (b->current >= b->data_size) {
-            if (s->mode_32bit && b->current % 4) {
-                b->current = 4 - (b->current % 4);
-                s->state = MOBILE_SERIAL_DATA_PAD;
-            } else {
-                b->current = 0;
-                s->state = MOBILE_SERIAL_CHECKSUM;
-            }
-        }
+        if (b->current >= b->data_size) serial_data_done(adapter, state);
         break;
 
     case MOBILE_SERIAL_DATA_PAD:
         // In 32bit mode, we must add some extra padding
-        if (!--b->current) s->state = MOBILE_SERIAL_CHECKSUM;
+        if (!--b->current) *state = MOBILE_SERIAL_CHECKSUM;
         break;
 
     case MOBILE_SERIAL_CHECKSUM:
@@ -114,7 +146,7 @@ uint8_t mobile_serial_transfer(struct mobile_adapter *adapter, uint8_t c)
                 b->error = MOBILE_SERIAL_ERROR_CHECKSUM;
             }
             b->current = 0;
-            s->state = MOBILE_SERIAL_ACKNOWLEDGE;
+            *state = MOBILE_SERIAL_ACKNOWLEDGE;
             return s->device | 0x80;
         }
         break;
@@ -127,7 +159,7 @@ uint8_t mobile_serial_transfer(struct mobile_adapter *adapter, uint8_t c)
         //   emulators that only implement 8-bit mode.
         if (s->mode_32bit) {
             b->current = 2;
-            s->state = MOBILE_SERIAL_ACKNOWLEDGE_PAD;
+            *state = MOBILE_SERIAL_ACKNOWLEDGE_PAD;
             return b->error ? b->error : b->header[0] ^ 0x80;
         }
 
@@ -136,21 +168,21 @@ uint8_t mobile_serial_transfer(struct mobile_adapter *adapter, uint8_t c)
         if (s->device != MOBILE_ADAPTER_BLUE &&
                 c != (MOBILE_ADAPTER_GAMEBOY | 0x80) &&
                 c != (MOBILE_ADAPTER_GAMEBOY_ADVANCE | 0x80)) {
-            s->state = MOBILE_SERIAL_WAITING;
+            *state = MOBILE_SERIAL_WAITING;
             // Yellow/Red adapters are probably bugged to return the
             //   device ID again, instead of the idle byte.
             break;
         }
 
         b->current = 1;
-        s->state = MOBILE_SERIAL_IDLE_CHECK;
+        *state = MOBILE_SERIAL_IDLE_CHECK;
         return b->error ? b->error : b->header[0] ^ 0x80;
 
     case MOBILE_SERIAL_ACKNOWLEDGE_PAD:
         // In 32bit mode, we must add some extra padding
         if (!--b->current) {
             b->current = 1;
-            s->state = MOBILE_SERIAL_IDLE_CHECK;
+            *state = MOBILE_SERIAL_IDLE_CHECK;
         }
         return 0;
 
@@ -160,20 +192,20 @@ uint8_t mobile_serial_transfer(struct mobile_adapter *adapter, uint8_t c)
 
         // If an error was raised or the empty command was sent, reset here.
         if (b->header[0] == MOBILE_COMMAND_NULL || b->error) {
-            s->state = MOBILE_SERIAL_WAITING;
+            *state = MOBILE_SERIAL_WAITING;
             if (c == 0x99) b->current = 1;
             break;
         }
 
         // If an idle byte isn't received, reset here.
         if (c != 0x4B) {
-            s->state = MOBILE_SERIAL_WAITING;
+            *state = MOBILE_SERIAL_WAITING;
             if (c == 0x99) b->current = 1;
             break;
         }
 
         // Otherwise, start processing
-        s->state = MOBILE_SERIAL_RESPONSE_WAITING;
+        *state = MOBILE_SERIAL_RESPONSE_WAITING;
         break;
 
     case MOBILE_SERIAL_RESPONSE_WAITING:
@@ -182,7 +214,7 @@ uint8_t mobile_serial_transfer(struct mobile_adapter *adapter, uint8_t c)
 
     case MOBILE_SERIAL_RESPONSE_INIT:
         b->current = 0;
-        s->state = MOBILE_SERIAL_RESPONSE_START;
+        *state = MOBILE_SERIAL_RESPONSE_START;
         // fallthrough
 
     case MOBILE_SERIAL_RESPONSE_START:
@@ -193,7 +225,7 @@ uint8_t mobile_serial_transfer(struct mobile_adapter *adapter, uint8_t c)
             b->data_size = b->header[3];
             b->error = 0;
             b->current = 0;
-            s->state = MOBILE_SERIAL_RESPONSE_HEADER;
+            *state = MOBILE_SERIAL_RESPONSE_HEADER;
             return 0x66;
         }
 
@@ -202,9 +234,9 @@ uint8_t mobile_serial_transfer(struct mobile_adapter *adapter, uint8_t c)
         if (b->current >= sizeof(b->header)) {
             b->current = 0;
             if (b->data_size) {
-                s->state = MOBILE_SERIAL_RESPONSE_DATA;
+                *state = MOBILE_SERIAL_RESPONSE_DATA;
             } else {
-                s->state = MOBILE_SERIAL_RESPONSE_CHECKSUM;
+                *state = MOBILE_SERIAL_RESPONSE_CHECKSUM;
             }
         }
         return c;
@@ -214,26 +246,20 @@ uint8_t mobile_serial_transfer(struct mobile_adapter *adapter, uint8_t c)
         // This includes the header, content and the checksum.
         c = s->buffer[b->current++];
         if (b->current >= b->data_size) {
-            if (s->mode_32bit && b->current % 4) {
-                b->current = 4 - (b->current % 4);
-                s->state = MOBILE_SERIAL_RESPONSE_DATA_PAD;
-            } else {
-                b->current = 0;
-                s->state = MOBILE_SERIAL_RESPONSE_CHECKSUM;
-            }
+            serial_response_data_done(adapter, state);
         }
         return c;
 
     case MOBILE_SERIAL_RESPONSE_DATA_PAD:
         // In 32bit mode, we must add some extra padding
-        if (!--b->current) s->state = MOBILE_SERIAL_RESPONSE_CHECKSUM;
+        if (!--b->current) *state = MOBILE_SERIAL_RESPONSE_CHECKSUM;
         return 0;
 
     case MOBILE_SERIAL_RESPONSE_CHECKSUM:
         c = b->footer[b->current++];
         if (b->current >= sizeof(b->footer)) {
             b->current = 0;
-            s->state = MOBILE_SERIAL_RESPONSE_ACKNOWLEDGE;
+            *state = MOBILE_SERIAL_RESPONSE_ACKNOWLEDGE;
         }
         return c;
 
@@ -261,18 +287,22 @@ uint8_t mobile_serial_transfer(struct mobile_adapter *adapter, uint8_t c)
         if (b->error == MOBILE_SERIAL_ERROR_UNKNOWN_COMMAND ||
                 b->error == MOBILE_SERIAL_ERROR_CHECKSUM ||
                 b->error == MOBILE_SERIAL_ERROR_INTERNAL) {
-            s->state = MOBILE_SERIAL_RESPONSE_START;
+            *state = MOBILE_SERIAL_RESPONSE_START;
             break;
         }
         // Start over after this
-        s->state = MOBILE_SERIAL_WAITING;
+        *state = MOBILE_SERIAL_WAITING;
         break;
     }
 
     return MOBILE_SERIAL_IDLE_BYTE;
 }
 
-uint32_t mobile_serial_transfer_32bit(struct mobile_adapter *adapter, uint32_t c)
+// Runs the 32bit serial state machine for a single word.
+// The bulk of the packet (its header, data and padding) is handled as
+//   contiguous spans of bytes within the word, without going through the
+//   8-bit state machine for every byte. Everything else is delegated to it.
+static uint32_t serial_transfer_32bit(struct mobile_adapter *adapter, enum mobile_serial_state *state, uint32_t c)
 {
     struct mobile_adapter_serial *s = &adapter->serial;
     struct mobile_buffer_serial *b = &adapter->buffer.serial;
@@ -280,9 +310,70 @@ uint32_t mobile_serial_transfer_32bit(struct mobile_adapter *adapter, uint32_t c
     // Unpack the data
     uint8_t d[4] = {c >> 24, c >> 16, c >> 8, c >> 0};
 
-    // Use the 8-bit logic for most things
-    for (unsigned i = 0; i < 4; i++) {
-        d[i] = mobile_serial_transfer(adapter, d[i]);
+    unsigned i = 0;
+    while (i < 4) {
+        // Amount of bytes left in the word that belong to the current state
+        unsigned n = 4 - i;
+        unsigned sum = 0;
+
+        switch (*state) {
+        case MOBILE_SERIAL_HEADER:
+            if (n > sizeof(b->header) - b->current) {
+                n = sizeof(b->header) - b->current;
+            }
+            while (n--) {
+                sum += d[i];
+                b->header[b->current++] = d[i];
+                d[i++] = MOBILE_SERIAL_IDLE_BYTE;
+            }
+            b->checksum += sum;
+            if (b->current >= sizeof(b->header)) {
+                serial_header_done(adapter, state);
+            }
+            break;
+
+        case MOBILE_SERIAL_DATA:
+            if (n > (unsigned)b->data_size - b->current) {
+                n = b->data_size - b->current;
+            }
+            while (n--) {
+                sum += d[i];
+                s->buffer[b->current++] = d[i];
+                d[i++] = MOBILE_SERIAL_IDLE_BYTE;
+            }
+            b->checksum += sum;
+            if (b->current >= b->data_size) serial_data_done(adapter, state);
+            break;
+
+        case MOBILE_SERIAL_DATA_PAD:
+            if (n > b->current) n = b->current;
+            b->current -= n;
+            while (n--) d[i++] = MOBILE_SERIAL_IDLE_BYTE;
+            if (!b->current) *state = MOBILE_SERIAL_CHECKSUM;
+            break;
+
+        case MOBILE_SERIAL_RESPONSE_DATA:
+            if (n > (unsigned)b->data_size - b->current) {
+                n = b->data_size - b->current;
+            }
+            while (n--) d[i++] = s->buffer[b->current++];
+            if (b->current >= b->data_size) {
+                serial_response_data_done(adapter, state);
+            }
+            break;
+
+        case MOBILE_SERIAL_RESPONSE_DATA_PAD:
+            if (n > b->current) n = b->current;
+            b->current -= n;
+            while (n--) d[i++] = 0;
+            if (!b->current) *state = MOBILE_SERIAL_RESPONSE_CHECKSUM;
+            break;
+
+        default:
+            d[i] = serial_transfer(adapter, state, d[i]);
+            i++;
+            break;
+        }
     }
 
     // Handle acknowledgement footer separately
@@ -290,7 +381,7 @@ uint32_t mobile_serial_transfer_32bit(struct mobile_adapter *adapter, uint32_t c
     //   isn't available in the 8bit function by the time the error byte has to
     //   be sent.
     // For this same reason, the received device byte can't be verified either.
-    if (s->state == MOBILE_SERIAL_ACKNOWLEDGE) {
+    if (*state == MOBILE_SERIAL_ACKNOWLEDGE) {
         d[0] = s->device | 0x80;
         d[1] = b->error ? b->error : b->header[0] ^ 0x80;
         d[2] = 0;
@@ -298,9 +389,96 @@ uint32_t mobile_serial_transfer_32bit(struct mobile_adapter *adapter, uint32_t c
 
         // Ignore the next packet, we can't do anything with it.
         b->current = 4;
-        s->state = MOBILE_SERIAL_IDLE_CHECK;
+        *state = MOBILE_SERIAL_IDLE_CHECK;
     }
 
     // Repack the data
-    return d[0] << 24 | d[1] << 16 | d[2] << 8 | d[3] << 0;
+    return (uint32_t)d[0] << 24 | (uint32_t)d[1] << 16 | d[2] << 8 | d[3] << 0;
+}
+
+// Check if the serial should stop exchanging data until mobile_loop() runs.
+static bool serial_transfer_stop(struct mobile_adapter *adapter, enum mobile_serial_state state, bool mode_32bit)
+{
+    // A packet is waiting to be processed
+    if (state == MOBILE_SERIAL_RESPONSE_WAITING) return true;
+
+    // The serial mode is about to be changed
+    if (state == MOBILE_SERIAL_WAITING &&
+            adapter->serial.mode_32bit != mode_32bit) {
+        return true;
+    }
+
+    return false;
+}
+
+// Stores the updated serial state, waking up mobile_loop() if the serial
+//   can't continue without it.
+static void serial_state_store(struct mobile_adapter *adapter, enum mobile_serial_state state, enum mobile_serial_state prev)
+{
+    // Only store the state when it changes, to avoid overwriting the change
+    //   to MOBILE_SERIAL_RESPONSE_INIT made by mobile_actions_process().
+    if (state == prev) return;
+    adapter->serial.state = state;
+
+    if (serial_transfer_stop(adapter, state, adapter->commands.mode_32bit)) {
+        mobile_callback_notify(adapter);
+    }
+}
+
+uint8_t mobile_serial_transfer(struct mobile_adapter *adapter, uint8_t c)
+{
+    // Workaround for atomic load in clang...
+    enum mobile_serial_state state = adapter->serial.state;
+    enum mobile_serial_state prev = state;
+
+    c = serial_transfer(adapter, &state, c);
+
+    serial_state_store(adapter, state, prev);
+    return c;
+}
+
+uint32_t mobile_serial_transfer_32bit(struct mobile_adapter *adapter, uint32_t c)
+{
+    enum mobile_serial_state state = adapter->serial.state;
+    enum mobile_serial_state prev = state;
+
+    c = serial_transfer_32bit(adapter, &state, c);
+
+    serial_state_store(adapter, state, prev);
+    return c;
+}
+
+size_t mobile_serial_transfer_buffer(struct mobile_adapter *adapter, const uint8_t *in, uint8_t *out, size_t size)
+{
+    enum mobile_serial_state state = adapter->serial.state;
+    enum mobile_serial_state prev = state;
+
+    // Only the mobile_loop() thread changes this
+    bool mode_32bit = adapter->commands.mode_32bit;
+
+    size_t i;
+    for (i = 0; i < size; i++) {
+        if (serial_transfer_stop(adapter, state, mode_32bit)) break;
+        out[i] = serial_transfer(adapter, &state, in[i]);
+    }
+
+    serial_state_store(adapter, state, prev);
+    return i;
+}
+
+size_t mobile_serial_transfer_buffer_32bit(struct mobile_adapter *adapter, const uint32_t *in, uint32_t *out, size_t size)
+{
+    enum mobile_serial_state state = adapter->serial.state;
+    enum mobile_serial_state prev = state;
+
+    bool mode_32bit = adapter->commands.mode_32bit;
+
+    size_t i;
+    for (i = 0; i < size; i++) {
+        if (serial_transfer_stop(adapter, state, mode_32bit)) break;
+        out[i] = serial_transfer_32bit(adapter, &state, in[i]);
+    }
+
+    serial_state_store(adapter, state, prev);
+    return i;
 }
@@ -1,6 +1,7 @@
 // SPDX-License-Identifier: LGPL-3.0-or-later
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 
@@ -69,5 +70,7 @@ struct mobile_adapter_serial {
 void mobile_serial_init(struct mobile_adapter *adapter);
 uint8_t mobile_serial_transfer(struct mobile_adapter *adapter, uint8_t c);
 uint32_t mobile_serial_transfer_32bit(struct mobile_adapter *adapter, uint32_t c);
+size_t mobile_serial_transfer_buffer(struct mobile_adapter *adapter, const uint8_t *in, uint8_t *out, size_t size);
+size_t mobile_serial_transfer_buffer_32bit(struct mobile_adapter *adapter, const uint32_t *in, uint32_t *out, size_t size);
 
 #undef _Atomic  // "atomic.h"
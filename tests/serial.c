@@ -0,0 +1,330 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+
+// Differential test of the 32bit serial state machine
+//
+// mobile_transfer_32bit() handles most of a packet as spans of bytes within
+// each word. Its reference is the 8bit state machine: four mobile_transfer()
+// calls, followed by the acknowledgement footer that only the 32bit path can
+// send (see serial_transfer_32bit()).
+//
+// Two adapters are started in the same serial state, with the same random
+// buffer contents, and are fed the same word stream. Streams are either
+// random, or valid packets with some of their bytes corrupted. The outputs,
+// states and serial buffers must be identical after every word.
+//
+// Usage: mobile_serial_test [seed]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mobile.h>
+#include <mobile_data.h>
+
+#define RUNS_PER_STATE 2000
+#define WORDS_PER_RUN 96
+
+static const char *const state_names[] = {
+    [MOBILE_SERIAL_INIT] = "INIT",
+    [MOBILE_SERIAL_WAITING] = "WAITING",
+    [MOBILE_SERIAL_HEADER] = "HEADER",
+    [MOBILE_SERIAL_DATA] = "DATA",
+    [MOBILE_SERIAL_DATA_PAD] = "DATA_PAD",
+    [MOBILE_SERIAL_CHECKSUM] = "CHECKSUM",
+    [MOBILE_SERIAL_ACKNOWLEDGE] = "ACKNOWLEDGE",
+    [MOBILE_SERIAL_ACKNOWLEDGE_PAD] = "ACKNOWLEDGE_PAD",
+    [MOBILE_SERIAL_IDLE_CHECK] = "IDLE_CHECK",
+    [MOBILE_SERIAL_RESPONSE_WAITING] = "RESPONSE_WAITING",
+    [MOBILE_SERIAL_RESPONSE_INIT] = "RESPONSE_INIT",
+    [MOBILE_SERIAL_RESPONSE_START] = "RESPONSE_START",
+    [MOBILE_SERIAL_RESPONSE_HEADER] = "RESPONSE_HEADER",
+    [MOBILE_SERIAL_RESPONSE_DATA] = "RESPONSE_DATA",
+    [MOBILE_SERIAL_RESPONSE_DATA_PAD] = "RESPONSE_DATA_PAD",
+    [MOBILE_SERIAL_RESPONSE_CHECKSUM] = "RESPONSE_CHECKSUM",
+    [MOBILE_SERIAL_RESPONSE_ACKNOWLEDGE] = "RESPONSE_ACKNOWLEDGE",
+};
+#define NUM_STATES (sizeof(state_names) / sizeof(*state_names))
+
+// xorshift32, so failures can be reproduced from the seed
+static uint32_t rng_state;
+
+static uint32_t rng(void)
+{
+    uint32_t x = rng_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return rng_state = x;
+}
+
+static unsigned rng_range(unsigned min, unsigned max)
+{
+    return min + rng() % (max - min + 1);
+}
+
+// Reference implementation, on top of the 8bit state machine
+static uint32_t transfer_reference(struct mobile_adapter *adapter, uint32_t c)
+{
+    struct mobile_adapter_serial *s = &adapter->serial;
+    struct mobile_buffer_serial *b = &adapter->buffer.serial;
+
+    uint8_t d[4];
+    for (unsigned i = 0; i < 4; i++) {
+        d[i] = mobile_transfer(adapter, c >> (24 - i * 8));
+    }
+
+    if (s->state == MOBILE_SERIAL_ACKNOWLEDGE) {
+        d[0] = s->device | 0x80;
+        d[1] = b->error ? b->error : b->header[0] ^ 0x80;
+        d[2] = 0;
+        d[3] = 0;
+        b->current = 4;
+        s->state = MOBILE_SERIAL_IDLE_CHECK;
+    }
+
+    return (uint32_t)d[0] << 24 | (uint32_t)d[1] << 16 | d[2] << 8 | d[3];
+}
+
+static void random_bytes(unsigned char *data, unsigned size)
+{
+    for (unsigned i = 0; i < size; i++) data[i] = rng();
+}
+
+static const unsigned char commands[] = {
+    MOBILE_COMMAND_NULL,
+    MOBILE_COMMAND_START,
+    MOBILE_COMMAND_END,
+    MOBILE_COMMAND_TEL,
+    MOBILE_COMMAND_DATA,
+    MOBILE_COMMAND_PPP_CONNECT,
+    MOBILE_COMMAND_DNS_REQUEST,
+    MOBILE_COMMAND_ERROR,
+};
+
+static unsigned char random_command(void)
+{
+    if (rng() % 4 == 0) return rng();
+    return commands[rng() % sizeof(commands)];
+}
+
+// Puts the serial in <state>, with buffer contents that are consistent with
+//   what the state machine could have left there.
+static void random_state(struct mobile_adapter *adapter, enum mobile_serial_state state)
+{
+    static const unsigned char errors[] = {
+        0,
+        MOBILE_SERIAL_ERROR_UNKNOWN_COMMAND,
+        MOBILE_SERIAL_ERROR_CHECKSUM,
+        MOBILE_SERIAL_ERROR_INTERNAL
+    };
+
+    struct mobile_adapter_serial *s = &adapter->serial;
+    struct mobile_buffer_serial *b = &adapter->buffer.serial;
+
+    adapter->commands.session_started = rng() % 2;
+    adapter->config.device = rng_range(MOBILE_ADAPTER_BLUE,
+        MOBILE_ADAPTER_RED) | (rng() % 2 ? MOBILE_CONFIG_DEVICE_UNMETERED : 0);
+    s->device = rng_range(MOBILE_ADAPTER_BLUE, MOBILE_ADAPTER_RED);
+    s->device_unmetered = rng() % 2;
+    s->mode_32bit = true;
+    adapter->commands.mode_32bit = true;
+
+    random_bytes(s->buffer, sizeof(s->buffer));
+    b->error = errors[rng() % sizeof(errors)];
+    b->checksum = rng();
+    random_bytes(b->header, sizeof(b->header));
+    b->header[0] = random_command();
+    b->header[2] = rng() % 8 ? 0 : rng();
+    random_bytes(b->footer, sizeof(b->footer));
+    b->data_size = b->header[3];
+    b->current = 0;
+
+    switch (state) {
+    case MOBILE_SERIAL_WAITING: b->current = rng_range(0, 1); break;
+    case MOBILE_SERIAL_HEADER: b->current = rng_range(0, 3); break;
+    case MOBILE_SERIAL_DATA:
+    case MOBILE_SERIAL_RESPONSE_DATA:
+        b->data_size = rng_range(1, MOBILE_MAX_DATA_SIZE);
+        b->current = rng_range(0, b->data_size - 1);
+        break;
+    case MOBILE_SERIAL_DATA_PAD:
+    case MOBILE_SERIAL_RESPONSE_DATA_PAD:
+        b->current = rng_range(1, 3);
+        break;
+    case MOBILE_SERIAL_CHECKSUM:
+    case MOBILE_SERIAL_RESPONSE_START:
+    case MOBILE_SERIAL_RESPONSE_CHECKSUM:
+        b->current = rng_range(0, 1);
+        break;
+    case MOBILE_SERIAL_ACKNOWLEDGE_PAD: b->current = rng_range(1, 2); break;
+    case MOBILE_SERIAL_IDLE_CHECK: b->current = rng_range(0, 4); break;
+    case MOBILE_SERIAL_RESPONSE_HEADER: b->current = rng_range(0, 3); break;
+    case MOBILE_SERIAL_RESPONSE_ACKNOWLEDGE:
+        b->current = rng_range(0, 4);
+        break;
+    default: break;
+    }
+
+    s->state = state;
+}
+
+// Replaces the packet received by the serial with a reply, the same way
+//   mobile_actions_process() does.
+static void random_reply(struct mobile_adapter *adapter)
+{
+    struct mobile_adapter_serial *s = &adapter->serial;
+    struct mobile_buffer_serial *b = &adapter->buffer.serial;
+
+    b->header[0] = random_command() | 0x80;
+    b->header[1] = 0;
+    b->header[2] = 0;
+    b->header[3] = rng() % 4 ? rng() % 0x20 : rng();
+    random_bytes(s->buffer, b->header[3]);
+    random_bytes(b->footer, sizeof(b->footer));
+    s->state = MOBILE_SERIAL_RESPONSE_INIT;
+}
+
+// Word stream, as sent by the console
+struct stream {
+    uint32_t words[WORDS_PER_RUN];
+};
+
+// Appends a packet, as a console would send it in 32bit mode, followed by
+//   the acknowledgement and a few idle words.
+static unsigned stream_packet(unsigned char *p, unsigned max)
+{
+    unsigned char packet[6 + MOBILE_MAX_DATA_SIZE + 3 + 2 + 4 + 12];
+    unsigned char *q = packet;
+
+    unsigned char command = random_command();
+    unsigned char size = rng() % 4 ? rng() % 0x20 : rng();
+    unsigned checksum = command + size;
+
+    *q++ = 0x99;
+    *q++ = 0x66;
+    *q++ = command;
+    *q++ = 0;
+    *q++ = 0;
+    *q++ = size;
+    for (unsigned i = 0; i < size; i++) {
+        *q = rng();
+        checksum += *q++;
+    }
+    while ((q - packet) % 4 != 2) *q++ = 0;
+    *q++ = checksum >> 8;
+    *q++ = checksum;
+    *q++ = MOBILE_ADAPTER_GAMEBOY | 0x80;
+    *q++ = 0;
+    *q++ = 0;
+    *q++ = 0;
+    for (unsigned i = rng_range(1, 3) * 4; i; i--) *q++ = 0x4B;
+
+    unsigned size_packet = q - packet;
+    if (size_packet > max) size_packet = max;
+    memcpy(p, packet, size_packet);
+    return size_packet;
+}
+
+static void stream_fill(struct stream *stream)
+{
+    unsigned char bytes[sizeof(stream->words)];
+
+    if (rng() % 4 == 0) {
+        random_bytes(bytes, sizeof(bytes));
+    } else {
+        // Packets, out of word alignment at times, with corrupted bytes
+        unsigned pos = rng() % 8 ? 0 : rng_range(1, 3);
+        random_bytes(bytes, pos);
+        while (pos < sizeof(bytes)) {
+            pos += stream_packet(bytes + pos, sizeof(bytes) - pos);
+        }
+        for (unsigned i = rng_range(0, 3); i; i--) {
+            bytes[rng() % sizeof(bytes)] = rng();
+        }
+    }
+
+    for (unsigned i = 0; i < WORDS_PER_RUN; i++) {
+        const unsigned char *b = bytes + i * 4;
+        stream->words[i] = (uint32_t)b[0] << 24 | (uint32_t)b[1] << 16 |
+            b[2] << 8 | b[3];
+    }
+}
+
+static bool serial_equal(struct mobile_adapter *a, struct mobile_adapter *b)
+{
+    struct mobile_adapter_serial *sa = &a->serial;
+    struct mobile_adapter_serial *sb = &b->serial;
+    struct mobile_buffer_serial *ba = &a->buffer.serial;
+    struct mobile_buffer_serial *bb = &b->buffer.serial;
+
+    return sa->state == sb->state &&
+        sa->device == sb->device &&
+        sa->device_unmetered == sb->device_unmetered &&
+        memcmp(sa->buffer, sb->buffer, sizeof(sa->buffer)) == 0 &&
+        ba->error == bb->error &&
+        ba->current == bb->current &&
+        ba->data_size == bb->data_size &&
+        ba->checksum == bb->checksum &&
+        memcmp(ba->header, bb->header, sizeof(ba->header)) == 0 &&
+        memcmp(ba->footer, bb->footer, sizeof(ba->footer)) == 0;
+}
+
+static void fail(const char *what, uint32_t seed, enum mobile_serial_state start, unsigned run, unsigned word, struct mobile_adapter *a, struct mobile_adapter *b)
+{
+    fprintf(stderr, "serial: %s differs (seed %lu, start %s, run %u, word %u)\n",
+        what, (unsigned long)seed, state_names[start], run, word);
+    fprintf(stderr, "serial: 32bit: state %s current %u\n",
+        state_names[a->serial.state], a->buffer.serial.current);
+    fprintf(stderr, "serial: 8bit: state %s current %u\n",
+        state_names[b->serial.state], b->buffer.serial.current);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t seed = 1;
+    if (argc > 1) seed = strtoul(argv[1], NULL, 0);
+    rng_state = seed ? seed : 1;
+
+    struct mobile_adapter *a = mobile_new(NULL);
+    struct mobile_adapter *b = mobile_new(NULL);
+    if (!a || !b) abort();
+
+    unsigned long words = 0;
+
+    struct stream stream;
+    for (unsigned state = 0; state < NUM_STATES; state++) {
+        for (unsigned run = 0; run < RUNS_PER_STATE; run++) {
+            uint32_t saved = rng_state;
+            random_state(a, state);
+            rng_state = saved;
+            random_state(b, state);
+            stream_fill(&stream);
+
+            for (unsigned i = 0; i < WORDS_PER_RUN; i++) {
+                uint32_t out_a = mobile_transfer_32bit(a, stream.words[i]);
+                uint32_t out_b = transfer_reference(b, stream.words[i]);
+                words++;
+
+                if (out_a != out_b) fail("output", seed, state, run, i, a, b);
+                if (!serial_equal(a, b)) fail("state", seed, state, run, i, a, b);
+
+                // Answer every packet, to exercise the response states
+                if (a->serial.state == MOBILE_SERIAL_RESPONSE_WAITING &&
+                        rng() % 8) {
+                    uint32_t saved = rng_state;
+                    random_reply(a);
+                    rng_state = saved;
+                    random_reply(b);
+                }
+            }
+        }
+    }
+
+    printf("serial: %lu words identical (seed %lu)\n",
+        words, (unsigned long)seed);
+
+    free(a);
+    free(b);
+    return 0;
+}
@@ -0,0 +1,121 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+#include "timer.h"
+
+#include "mobile_data.h"
+#include "compat.h"
+
+// The time_now_ms callback is optional, check if it has been provided
+#ifdef MOBILE_ENABLE_IMPL_WEAK
+#ifdef A_WEAK
+A_WEAK uint32_t mobile_impl_time_now_ms(void *user);
+#define has_time_now_ms(adapter) (mobile_impl_time_now_ms != NULL)
+#else
+#define has_time_now_ms(adapter) false
+#endif
+#else
+#define has_time_now_ms(adapter) (adapter->callback.time_now_ms != NULL)
+#endif
+
+void mobile_timer_init(struct mobile_adapter *adapter)
+{
+    for (unsigned i = 0; i < _MOBILE_MAX_TIMERS; i++) {
+        adapter->timer.deadline[i] = MOBILE_DEADLINE_NONE;
+        adapter->timer.latch[i] = 0;
+    }
+    adapter->timer.latched = 0;
+    adapter->timer.now = 0;
+}
+
+// Fetch the current time, to be used by every timer until the next update.
+void mobile_timer_update(struct mobile_adapter *adapter)
+{
+    if (!has_time_now_ms(adapter)) return;
+    adapter->timer.now = mobile_cb_time_now_ms(adapter);
+}
+
+// Whether timer.now holds the current time, which may be used to keep track of
+//   more things than there are timers.
+bool mobile_timer_has_clock(struct mobile_adapter *adapter)
+{
+    (void)adapter;
+    return has_time_now_ms(adapter);
+}
+
+// Forget the timeouts a timer has been checked against.
+// Must be called before a set of checks that are performed every time the
+//   timer is being waited on, so the timeouts that aren't relevant anymore
+//   are discarded.
+void mobile_timer_arm(struct mobile_adapter *adapter, enum mobile_timers timer)
+{
+    adapter->timer.deadline[timer] = MOBILE_DEADLINE_NONE;
+}
+
+void mobile_timer_latch(struct mobile_adapter *adapter, enum mobile_timers timer)
+{
+    if (has_time_now_ms(adapter)) {
+        adapter->timer.latch[timer] = adapter->timer.now;
+    } else {
+        mobile_cb_time_latch(adapter, timer);
+    }
+
+    // The timeout isn't known until the timer is checked again
+    adapter->timer.latched |= 1 << timer;
+}
+
+static uint32_t timer_elapsed_ms(struct mobile_adapter *adapter, enum mobile_timers timer)
+{
+    return adapter->timer.now - adapter->timer.latch[timer];
+}
+
+bool mobile_timer_check_ms(struct mobile_adapter *adapter, enum mobile_timers timer, unsigned ms)
+{
+    bool res;
+    if (has_time_now_ms(adapter)) {
+        res = timer_elapsed_ms(adapter, timer) >= ms;
+    } else {
+        res = mobile_cb_time_check_ms(adapter, timer, ms);
+    }
+    adapter->timer.latched &= ~(1 << timer);
+
+    // Keep track of the timeout that will happen first
+    if (res) ms = 0;
+    if (ms < adapter->timer.deadline[timer]) {
+        adapter->timer.deadline[timer] = ms;
+    }
+    return res;
+}
+
+// Calculate the milliseconds passed since a timer was latched, up to <ms>.
+// Unlike mobile_timer_check_ms(), this doesn't affect the timer's deadline.
+unsigned mobile_timer_elapsed_ms(struct mobile_adapter *adapter, enum mobile_timers timer, unsigned ms)
+{
+    if (has_time_now_ms(adapter)) {
+        uint32_t elapsed = timer_elapsed_ms(adapter, timer);
+        if (elapsed >= ms) return ms;
+        return elapsed;
+    }
+
+    // The time_check_ms callback can only tell whether a certain amount of
+    //   time has passed, so search for the elapsed time.
+    if (!ms || mobile_cb_time_check_ms(adapter, timer, ms)) return ms;
+    unsigned elapsed = 0;
+    unsigned step = 1;
+    while (step <= ms / 2) step <<= 1;
+    for (; step; step >>= 1) {
+        if (elapsed + step >= ms) continue;
+        if (mobile_cb_time_check_ms(adapter, timer, elapsed + step)) {
+            elapsed += step;
+        }
+    }
+    return elapsed;
+}
+
+// Calculate the milliseconds left until the shortest timeout a timer has been
+//   checked against expires.
+unsigned mobile_timer_remaining_ms(struct mobile_adapter *adapter, enum mobile_timers timer)
+{
+    if (adapter->timer.latched & (1 << timer)) return 0;
+    unsigned ms = adapter->timer.deadline[timer];
+    if (ms == 0 || ms == MOBILE_DEADLINE_NONE) return ms;
+    return ms - mobile_timer_elapsed_ms(adapter, timer, ms);
+}
@@ -0,0 +1,39 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "callback.h"
+
+// Every timer check performed by the library goes through this module, which
+//   keeps track of the shortest timeout each timer is currently waiting for.
+// This is used by mobile_next_deadline_ms() to tell how long the user may
+//   sleep without missing any timeout.
+
+// If the user provides mobile_func_time_now_ms(), the timers are kept here as
+//   well, instead of being latched and checked through the callbacks.
+
+struct mobile_adapter_timer {
+    // Shortest amount of milliseconds a timer has been checked against,
+    //   since it was last armed. MOBILE_DEADLINE_NONE if not checked, 0 if
+    //   any of the checks succeeded.
+    unsigned deadline[_MOBILE_MAX_TIMERS];
+
+    // Bitmask of the timers that have been latched, but not checked since
+    unsigned char latched;
+
+    // Time at which each timer was latched, and the time of the current
+    //   mobile_loop() iteration, if mobile_func_time_now_ms() is available.
+    uint32_t latch[_MOBILE_MAX_TIMERS];
+    uint32_t now;
+};
+
+void mobile_timer_init(struct mobile_adapter *adapter);
+void mobile_timer_update(struct mobile_adapter *adapter);
+bool mobile_timer_has_clock(struct mobile_adapter *adapter);
+void mobile_timer_arm(struct mobile_adapter *adapter, enum mobile_timers timer);
+void mobile_timer_latch(struct mobile_adapter *adapter, enum mobile_timers timer);
+bool mobile_timer_check_ms(struct mobile_adapter *adapter, enum mobile_timers timer, unsigned ms);
+unsigned mobile_timer_elapsed_ms(struct mobile_adapter *adapter, enum mobile_timers timer, unsigned ms);
+unsigned mobile_timer_remaining_ms(struct mobile_adapter *adapter, enum mobile_timers timer);
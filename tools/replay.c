@@ -0,0 +1,411 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+
+// Replays a trace recorded through trace.h, as fast as possible.
+//
+// The adapter is driven exactly as it was during the recording, with every
+// callback result being read from the trace instead. Any divergence from the
+// recorded session, such as a different byte being sent over the serial, or
+// the callbacks being called in a different order, is reported.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <mobile.h>
+
+#include "trace.h"
+
+struct replay {
+    const unsigned char *data;
+    size_t size;
+    size_t pos;
+    bool verbose;
+
+    // Statistics
+    unsigned long transfers;
+    unsigned long bytes;
+    unsigned long loops;
+    unsigned long mismatches;
+    uint32_t time;
+};
+
+static void fail(struct replay *r, const char *msg)
+{
+    fprintf(stderr, "replay: offset 0x%zx: %s\n", r->pos, msg);
+    exit(1);
+}
+
+static unsigned read_u8(struct replay *r)
+{
+    if (r->pos >= r->size) fail(r, "unexpected end of trace");
+    return r->data[r->pos++];
+}
+
+static unsigned read_u16(struct replay *r)
+{
+    unsigned val = read_u8(r);
+    return val | read_u8(r) << 8;
+}
+
+static uint32_t read_u32(struct replay *r)
+{
+    uint32_t val = read_u16(r);
+    return val | (uint32_t)read_u16(r) << 16;
+}
+
+static void read_data(struct replay *r, void *dest, size_t size)
+{
+    if (r->size - r->pos < size) fail(r, "unexpected end of trace");
+    if (dest) memcpy(dest, r->data + r->pos, size);
+    r->pos += size;
+}
+
+static void read_addr(struct replay *r, struct mobile_addr *addr)
+{
+    struct mobile_addr tmp;
+    if (!addr) addr = &tmp;
+
+    unsigned type = read_u8(r);
+    if (type == MOBILE_ADDRTYPE_IPV4) {
+        struct mobile_addr4 *addr4 = (struct mobile_addr4 *)addr;
+        addr4->type = type;
+        addr4->port = read_u16(r);
+        read_data(r, addr4->host, sizeof(addr4->host));
+    } else if (type == MOBILE_ADDRTYPE_IPV6) {
+        struct mobile_addr6 *addr6 = (struct mobile_addr6 *)addr;
+        addr6->type = type;
+        addr6->port = read_u16(r);
+        read_data(r, addr6->host, sizeof(addr6->host));
+    } else {
+        addr->type = MOBILE_ADDRTYPE_NONE;
+    }
+}
+
+// Reads the next event, skipping over any timestamps
+static unsigned read_event(struct replay *r)
+{
+    for (;;) {
+        unsigned event = read_u8(r);
+        if (event != MOBILE_TRACE_TIME) return event;
+        r->time = read_u32(r);
+    }
+}
+
+// Reads the result of the callback that's expected to be called next
+static void expect(struct replay *r, enum mobile_trace_event event)
+{
+    if (read_event(r) != event) {
+        r->pos--;
+        fail(r, "callbacks called out of order");
+    }
+}
+
+static void replay_debug_log(void *user, const char *line)
+{
+    struct replay *r = user;
+    if (r->verbose) fprintf(stderr, "%s\n", line);
+}
+
+static void replay_serial_disable(void *user)
+{
+    (void)user;
+}
+
+static void replay_serial_enable(void *user, bool mode_32bit)
+{
+    (void)user;
+    (void)mode_32bit;
+}
+
+static bool replay_config_read(void *user, void *dest, uintptr_t offset, size_t size)
+{
+    struct replay *r = user;
+    expect(r, MOBILE_TRACE_CONFIG_READ);
+    bool res = read_u8(r);
+    if (read_u16(r) != offset || read_u16(r) != size) {
+        fail(r, "config read doesn't match");
+    }
+    read_data(r, dest, size);
+    return res;
+}
+
+static bool replay_config_write(void *user, const void *src, uintptr_t offset, size_t size)
+{
+    struct replay *r = user;
+    (void)src;
+    (void)offset;
+    (void)size;
+    expect(r, MOBILE_TRACE_CONFIG_WRITE);
+    return read_u8(r);
+}
+
+static void replay_time_latch(void *user, unsigned timer)
+{
+    (void)user;
+    (void)timer;
+}
+
+static bool replay_time_check_ms(void *user, unsigned timer, unsigned ms)
+{
+    struct replay *r = user;
+    (void)timer;
+    (void)ms;
+    expect(r, MOBILE_TRACE_TIME_CHECK_MS);
+    return read_u8(r);
+}
+
+static uint32_t replay_time_now_ms(void *user)
+{
+    struct replay *r = user;
+    expect(r, MOBILE_TRACE_TIME_NOW_MS);
+    return read_u32(r);
+}
+
+static bool replay_sock_open(void *user, unsigned conn, enum mobile_socktype type, enum mobile_addrtype addrtype, unsigned bindport)
+{
+    struct replay *r = user;
+    (void)conn;
+    (void)type;
+    (void)addrtype;
+    (void)bindport;
+    expect(r, MOBILE_TRACE_SOCK_OPEN);
+    return read_u8(r);
+}
+
+static void replay_sock_close(void *user, unsigned conn)
+{
+    (void)user;
+    (void)conn;
+}
+
+static int replay_sock_connect(void *user, unsigned conn, const struct mobile_addr *addr)
+{
+    struct replay *r = user;
+    (void)conn;
+    (void)addr;
+    expect(r, MOBILE_TRACE_SOCK_CONNECT);
+    return (signed char)read_u8(r);
+}
+
+static bool replay_sock_listen(void *user, unsigned conn)
+{
+    struct replay *r = user;
+    (void)conn;
+    expect(r, MOBILE_TRACE_SOCK_LISTEN);
+    return read_u8(r);
+}
+
+static bool replay_sock_accept(void *user, unsigned conn)
+{
+    struct replay *r = user;
+    (void)conn;
+    expect(r, MOBILE_TRACE_SOCK_ACCEPT);
+    return read_u8(r);
+}
+
+static int replay_sock_send(void *user, unsigned conn, const void *data, unsigned size, const struct mobile_addr *addr)
+{
+    struct replay *r = user;
+    (void)conn;
+    (void)data;
+    (void)size;
+    (void)addr;
+    expect(r, MOBILE_TRACE_SOCK_SEND);
+    return (int16_t)read_u16(r);
+}
+
+static int replay_sock_recv(void *user, unsigned conn, void *data, unsigned size, struct mobile_addr *addr)
+{
+    struct replay *r = user;
+    (void)conn;
+    expect(r, MOBILE_TRACE_SOCK_RECV);
+    int res = (int16_t)read_u16(r);
+    if (res > 0) {
+        if ((unsigned)res > size) fail(r, "received too much data");
+        read_addr(r, addr);
+        read_data(r, data, res);
+    }
+    return res;
+}
+
+static int replay_sock_poll(void *user, unsigned conn)
+{
+    struct replay *r = user;
+    (void)conn;
+    expect(r, MOBILE_TRACE_SOCK_POLL);
+    return (signed char)read_u8(r);
+}
+
+static bool replay_dns_resolve(void *user, const char *host, unsigned size)
+{
+    struct replay *r = user;
+    (void)host;
+    (void)size;
+    expect(r, MOBILE_TRACE_DNS_RESOLVE);
+    return read_u8(r);
+}
+
+static int replay_dns_poll(void *user, struct mobile_addr *addr)
+{
+    struct replay *r = user;
+    expect(r, MOBILE_TRACE_DNS_POLL);
+    int res = (signed char)read_u8(r);
+    if (res > 0) read_addr(r, addr);
+    return res;
+}
+
+static void replay_update_number(void *user, enum mobile_number type, const char *number)
+{
+    struct replay *r = user;
+    if (!r->verbose) return;
+    fprintf(stderr, "number %s: %s\n",
+        type == MOBILE_NUMBER_USER ? "user" : "peer",
+        number ? number : "(none)");
+}
+
+static void replay_notify(void *user)
+{
+    (void)user;
+}
+
+static double clock_s(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void replay_run(struct replay *r, struct mobile_adapter *adapter)
+{
+    while (r->pos < r->size) {
+        unsigned event = read_event(r);
+        switch (event) {
+        case MOBILE_TRACE_START:
+            mobile_start(adapter);
+            break;
+        case MOBILE_TRACE_STOP:
+            mobile_stop(adapter);
+            break;
+        case MOBILE_TRACE_LOOP:
+            mobile_loop(adapter);
+            r->loops++;
+            break;
+        case MOBILE_TRACE_NEXT_DEADLINE:
+            mobile_next_deadline_ms(adapter);
+            break;
+        case MOBILE_TRACE_TRANSFER: {
+            unsigned in = read_u8(r);
+            unsigned out = read_u8(r);
+            if (mobile_transfer(adapter, in) != out) r->mismatches++;
+            r->transfers++;
+            r->bytes += 1;
+            break;
+        }
+        case MOBILE_TRACE_TRANSFER_32BIT: {
+            uint32_t in = read_u32(r);
+            uint32_t out = read_u32(r);
+            if (mobile_transfer_32bit(adapter, in) != out) r->mismatches++;
+            r->transfers++;
+            r->bytes += 4;
+            break;
+        }
+        default:
+            r->pos--;
+            fail(r, "unexpected callback result");
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    struct replay r = {0};
+    const char *fname = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-v") == 0) {
+            r.verbose = true;
+        } else if (!fname) {
+            fname = argv[i];
+        } else {
+            fname = NULL;
+            break;
+        }
+    }
+    if (!fname) {
+        fprintf(stderr, "Usage: %s [-v] <trace>\n", argv[0]);
+        return 1;
+    }
+
+    FILE *f = fopen(fname, "rb");
+    if (!f) {
+        perror(fname);
+        return 1;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    unsigned char *data = malloc(size);
+    if (!data || fread(data, 1, size, f) != (size_t)size) {
+        perror(fname);
+        return 1;
+    }
+    fclose(f);
+    r.data = data;
+    r.size = size;
+
+    char magic[sizeof(MOBILE_TRACE_MAGIC) - 1];
+    read_data(&r, magic, sizeof(magic));
+    if (memcmp(magic, MOBILE_TRACE_MAGIC, sizeof(magic)) != 0 ||
+            read_u8(&r) != MOBILE_TRACE_VERSION) {
+        fprintf(stderr, "%s: not a supported trace\n", fname);
+        return 1;
+    }
+    unsigned flags = read_u8(&r);
+
+    struct mobile_adapter *adapter = mobile_new(&r);
+    mobile_def_debug_log(adapter, replay_debug_log);
+    mobile_def_serial_disable(adapter, replay_serial_disable);
+    mobile_def_serial_enable(adapter, replay_serial_enable);
+    mobile_def_config_read(adapter, replay_config_read);
+    mobile_def_config_write(adapter, replay_config_write);
+    mobile_def_time_latch(adapter, replay_time_latch);
+    mobile_def_time_check_ms(adapter, replay_time_check_ms);
+    if (flags & MOBILE_TRACE_FLAG_TIME_NOW_MS) {
+        mobile_def_time_now_ms(adapter, replay_time_now_ms);
+    }
+    mobile_def_sock_open(adapter, replay_sock_open);
+    mobile_def_sock_close(adapter, replay_sock_close);
+    mobile_def_sock_connect(adapter, replay_sock_connect);
+    mobile_def_sock_listen(adapter, replay_sock_listen);
+    mobile_def_sock_accept(adapter, replay_sock_accept);
+    mobile_def_sock_send(adapter, replay_sock_send);
+    mobile_def_sock_recv(adapter, replay_sock_recv);
+    if (flags & MOBILE_TRACE_FLAG_SOCK_POLL) {
+        mobile_def_sock_poll(adapter, replay_sock_poll);
+    }
+    if (flags & MOBILE_TRACE_FLAG_DNS_RESOLVE) {
+        mobile_def_dns_resolve(adapter, replay_dns_resolve);
+        mobile_def_dns_poll(adapter, replay_dns_poll);
+    }
+    mobile_def_update_number(adapter, replay_update_number);
+    mobile_def_notify(adapter, replay_notify);
+
+    double start = clock_s();
+    replay_run(&r, adapter);
+    double elapsed = clock_s() - start;
+
+    printf("transfers\t%lu\n", r.transfers);
+    printf("bytes\t%lu\n", r.bytes);
+    printf("loops\t%lu\n", r.loops);
+    printf("mismatches\t%lu\n", r.mismatches);
+    printf("recorded_s\t%.3f\n", r.time / 1e3);
+    printf("replay_s\t%.6f\n", elapsed);
+    if (elapsed > 0) {
+        printf("bytes_per_s\t%.0f\n", r.bytes / elapsed);
+    }
+
+    free(adapter);
+    free(data);
+    return r.mismatches ? 2 : 0;
+}
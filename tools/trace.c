@@ -0,0 +1,346 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+#include "trace.h"
+
+#include <string.h>
+#include <time.h>
+
+static uint64_t clock_ms(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void write_u8(struct mobile_trace *trace, unsigned val)
+{
+    fputc(val & 0xFF, trace->file);
+}
+
+static void write_u16(struct mobile_trace *trace, unsigned val)
+{
+    write_u8(trace, val);
+    write_u8(trace, val >> 8);
+}
+
+static void write_u32(struct mobile_trace *trace, uint32_t val)
+{
+    write_u16(trace, val);
+    write_u16(trace, val >> 16);
+}
+
+static void write_data(struct mobile_trace *trace, const void *data, size_t size)
+{
+    fwrite(data, 1, size, trace->file);
+}
+
+static void write_event(struct mobile_trace *trace, enum mobile_trace_event event)
+{
+    // Only write timestamps when they change
+    uint32_t time = clock_ms() - trace->start;
+    if (time != trace->time) {
+        trace->time = time;
+        write_u8(trace, MOBILE_TRACE_TIME);
+        write_u32(trace, time);
+    }
+    write_u8(trace, event);
+}
+
+static void write_addr(struct mobile_trace *trace, const struct mobile_addr *addr)
+{
+    if (!addr) {
+        write_u8(trace, MOBILE_ADDRTYPE_NONE);
+        return;
+    }
+
+    write_u8(trace, addr->type);
+    if (addr->type == MOBILE_ADDRTYPE_IPV4) {
+        const struct mobile_addr4 *addr4 = (struct mobile_addr4 *)addr;
+        write_u16(trace, addr4->port);
+        write_data(trace, addr4->host, sizeof(addr4->host));
+    } else if (addr->type == MOBILE_ADDRTYPE_IPV6) {
+        const struct mobile_addr6 *addr6 = (struct mobile_addr6 *)addr;
+        write_u16(trace, addr6->port);
+        write_data(trace, addr6->host, sizeof(addr6->host));
+    }
+}
+
+// Callback wrappers
+// These call the user's callback, or the library default, and record the
+//   result if there is any.
+
+#define call(name, ...) (trace->cb.name ? \
+    trace->cb.name(trace->user, ##__VA_ARGS__) : \
+    mobile_impl_ ## name(trace->user, ##__VA_ARGS__))
+
+static void trace_debug_log(void *user, const char *line)
+{
+    struct mobile_trace *trace = user;
+    call(debug_log, line);
+}
+
+static void trace_serial_disable(void *user)
+{
+    struct mobile_trace *trace = user;
+    call(serial_disable);
+}
+
+static void trace_serial_enable(void *user, bool mode_32bit)
+{
+    struct mobile_trace *trace = user;
+    call(serial_enable, mode_32bit);
+}
+
+static bool trace_config_read(void *user, void *dest, uintptr_t offset, size_t size)
+{
+    struct mobile_trace *trace = user;
+    bool res = call(config_read, dest, offset, size);
+    write_event(trace, MOBILE_TRACE_CONFIG_READ);
+    write_u8(trace, res);
+    write_u16(trace, offset);
+    write_u16(trace, size);
+    write_data(trace, dest, size);
+    return res;
+}
+
+static bool trace_config_write(void *user, const void *src, uintptr_t offset, size_t size)
+{
+    struct mobile_trace *trace = user;
+    bool res = call(config_write, src, offset, size);
+    write_event(trace, MOBILE_TRACE_CONFIG_WRITE);
+    write_u8(trace, res);
+    return res;
+}
+
+static void trace_time_latch(void *user, unsigned timer)
+{
+    struct mobile_trace *trace = user;
+    call(time_latch, timer);
+}
+
+static bool trace_time_check_ms(void *user, unsigned timer, unsigned ms)
+{
+    struct mobile_trace *trace = user;
+    bool res = call(time_check_ms, timer, ms);
+    write_event(trace, MOBILE_TRACE_TIME_CHECK_MS);
+    write_u8(trace, res);
+    return res;
+}
+
+static uint32_t trace_time_now_ms(void *user)
+{
+    struct mobile_trace *trace = user;
+
+    // Only used if the user provided it
+    uint32_t res = trace->cb.time_now_ms(trace->user);
+    write_event(trace, MOBILE_TRACE_TIME_NOW_MS);
+    write_u32(trace, res);
+    return res;
+}
+
+static bool trace_sock_open(void *user, unsigned conn, enum mobile_socktype type, enum mobile_addrtype addrtype, unsigned bindport)
+{
+    struct mobile_trace *trace = user;
+    bool res = call(sock_open, conn, type, addrtype, bindport);
+    write_event(trace, MOBILE_TRACE_SOCK_OPEN);
+    write_u8(trace, res);
+    return res;
+}
+
+static void trace_sock_close(void *user, unsigned conn)
+{
+    struct mobile_trace *trace = user;
+    call(sock_close, conn);
+}
+
+static int trace_sock_connect(void *user, unsigned conn, const struct mobile_addr *addr)
+{
+    struct mobile_trace *trace = user;
+    int res = call(sock_connect, conn, addr);
+    write_event(trace, MOBILE_TRACE_SOCK_CONNECT);
+    write_u8(trace, res);
+    return res;
+}
+
+static bool trace_sock_listen(void *user, unsigned conn)
+{
+    struct mobile_trace *trace = user;
+    bool res = call(sock_listen, conn);
+    write_event(trace, MOBILE_TRACE_SOCK_LISTEN);
+    write_u8(trace, res);
+    return res;
+}
+
+static bool trace_sock_accept(void *user, unsigned conn)
+{
+    struct mobile_trace *trace = user;
+    bool res = call(sock_accept, conn);
+    write_event(trace, MOBILE_TRACE_SOCK_ACCEPT);
+    write_u8(trace, res);
+    return res;
+}
+
+static int trace_sock_send(void *user, unsigned conn, const void *data, unsigned size, const struct mobile_addr *addr)
+{
+    struct mobile_trace *trace = user;
+    int res = call(sock_send, conn, data, size, addr);
+    write_event(trace, MOBILE_TRACE_SOCK_SEND);
+    write_u16(trace, res);
+    return res;
+}
+
+static int trace_sock_recv(void *user, unsigned conn, void *data, unsigned size, struct mobile_addr *addr)
+{
+    struct mobile_trace *trace = user;
+    int res = call(sock_recv, conn, data, size, addr);
+    write_event(trace, MOBILE_TRACE_SOCK_RECV);
+    write_u16(trace, res);
+    if (res > 0) {
+        write_addr(trace, addr);
+        write_data(trace, data, res);
+    }
+    return res;
+}
+
+static int trace_sock_poll(void *user, unsigned conn)
+{
+    struct mobile_trace *trace = user;
+
+    // Only used if the user provided it
+    int res = trace->cb.sock_poll(trace->user, conn);
+    write_event(trace, MOBILE_TRACE_SOCK_POLL);
+    write_u8(trace, res);
+    return res;
+}
+
+static bool trace_dns_resolve(void *user, const char *host, unsigned size)
+{
+    struct mobile_trace *trace = user;
+
+    // Only used if the user provided it
+    bool res = trace->cb.dns_resolve(trace->user, host, size);
+    write_event(trace, MOBILE_TRACE_DNS_RESOLVE);
+    write_u8(trace, res);
+    return res;
+}
+
+static int trace_dns_poll(void *user, struct mobile_addr *addr)
+{
+    struct mobile_trace *trace = user;
+
+    // Only used if the user provided it
+    int res = trace->cb.dns_poll(trace->user, addr);
+    write_event(trace, MOBILE_TRACE_DNS_POLL);
+    write_u8(trace, res);
+    if (res > 0) write_addr(trace, addr);
+    return res;
+}
+
+static void trace_update_number(void *user, enum mobile_number type, const char *number)
+{
+    struct mobile_trace *trace = user;
+    call(update_number, type, number);
+}
+
+static void trace_notify(void *user)
+{
+    struct mobile_trace *trace = user;
+
+    // Only used if the user provided it
+    trace->cb.notify(trace->user);
+}
+
+void mobile_trace_init(struct mobile_trace *trace, FILE *file, void *user)
+{
+    memset(trace, 0, sizeof(*trace));
+    trace->file = file;
+    trace->user = user;
+}
+
+void mobile_trace_attach(struct mobile_trace *trace, struct mobile_adapter *adapter)
+{
+    mobile_def_debug_log(adapter, trace_debug_log);
+    mobile_def_serial_disable(adapter, trace_serial_disable);
+    mobile_def_serial_enable(adapter, trace_serial_enable);
+    mobile_def_config_read(adapter, trace_config_read);
+    mobile_def_config_write(adapter, trace_config_write);
+    mobile_def_time_latch(adapter, trace_time_latch);
+    mobile_def_time_check_ms(adapter, trace_time_check_ms);
+    if (trace->cb.time_now_ms) {
+        mobile_def_time_now_ms(adapter, trace_time_now_ms);
+    }
+    mobile_def_sock_open(adapter, trace_sock_open);
+    mobile_def_sock_close(adapter, trace_sock_close);
+    mobile_def_sock_connect(adapter, trace_sock_connect);
+    mobile_def_sock_listen(adapter, trace_sock_listen);
+    mobile_def_sock_accept(adapter, trace_sock_accept);
+    mobile_def_sock_send(adapter, trace_sock_send);
+    mobile_def_sock_recv(adapter, trace_sock_recv);
+    if (trace->cb.sock_poll) {
+        mobile_def_sock_poll(adapter, trace_sock_poll);
+    }
+    if (trace->cb.dns_resolve && trace->cb.dns_poll) {
+        mobile_def_dns_resolve(adapter, trace_dns_resolve);
+        mobile_def_dns_poll(adapter, trace_dns_poll);
+    }
+    mobile_def_update_number(adapter, trace_update_number);
+    if (trace->cb.notify) {
+        mobile_def_notify(adapter, trace_notify);
+    }
+
+    unsigned flags = 0;
+    if (trace->cb.time_now_ms) flags |= MOBILE_TRACE_FLAG_TIME_NOW_MS;
+    if (trace->cb.sock_poll) flags |= MOBILE_TRACE_FLAG_SOCK_POLL;
+    if (trace->cb.dns_resolve && trace->cb.dns_poll) {
+        flags |= MOBILE_TRACE_FLAG_DNS_RESOLVE;
+    }
+
+    write_data(trace, MOBILE_TRACE_MAGIC, sizeof(MOBILE_TRACE_MAGIC) - 1);
+    write_u8(trace, MOBILE_TRACE_VERSION);
+    write_u8(trace, flags);
+
+    trace->start = clock_ms();
+    trace->time = 0;
+}
+
+void mobile_trace_start(struct mobile_trace *trace, struct mobile_adapter *adapter)
+{
+    write_event(trace, MOBILE_TRACE_START);
+    mobile_start(adapter);
+}
+
+void mobile_trace_stop(struct mobile_trace *trace, struct mobile_adapter *adapter)
+{
+    write_event(trace, MOBILE_TRACE_STOP);
+    mobile_stop(adapter);
+    fflush(trace->file);
+}
+
+void mobile_trace_loop(struct mobile_trace *trace, struct mobile_adapter *adapter)
+{
+    write_event(trace, MOBILE_TRACE_LOOP);
+    mobile_loop(adapter);
+}
+
+unsigned mobile_trace_next_deadline_ms(struct mobile_trace *trace, struct mobile_adapter *adapter)
+{
+    write_event(trace, MOBILE_TRACE_NEXT_DEADLINE);
+    return mobile_next_deadline_ms(adapter);
+}
+
+uint8_t mobile_trace_transfer(struct mobile_trace *trace, struct mobile_adapter *adapter, uint8_t c)
+{
+    uint8_t res = mobile_transfer(adapter, c);
+    write_event(trace, MOBILE_TRACE_TRANSFER);
+    write_u8(trace, c);
+    write_u8(trace, res);
+    return res;
+}
+
+uint32_t mobile_trace_transfer_32bit(struct mobile_trace *trace, struct mobile_adapter *adapter, uint32_t c)
+{
+    uint32_t res = mobile_transfer_32bit(adapter, c);
+    write_event(trace, MOBILE_TRACE_TRANSFER_32BIT);
+    write_u32(trace, c);
+    write_u32(trace, res);
+    return res;
+}
@@ -0,0 +1,124 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+#pragma once
+
+// Serial traffic recorder
+//
+// Records everything that goes in and out of a struct mobile_adapter into a
+// compact binary trace: the data received through mobile_transfer(), the
+// calls to mobile_loop(), and the results of every callback that returns
+// anything. Such a trace can be replayed with the mobile_replay tool, which
+// drives a fresh adapter with stubbed callbacks, as fast as possible.
+//
+// Usage:
+//     struct mobile_trace trace;
+//     mobile_trace_init(&trace, fopen("session.trace", "wb"), my_user);
+//     trace.cb.sock_recv = my_sock_recv;  // And any other callback...
+//     struct mobile_adapter *adapter = mobile_new(&trace);
+//     mobile_trace_attach(&trace, adapter);
+//     mobile_trace_start(&trace, adapter);
+//     ...
+//     SB = mobile_trace_transfer(&trace, adapter, SB);
+//     ...
+//     mobile_trace_loop(&trace, adapter);
+//
+// The adapter must be created with the trace as its user pointer, and the
+// callbacks must be set through the <cb> member of the trace instead of the
+// mobile_def_* functions. They will receive the <user> pointer passed to
+// mobile_trace_init(). Callbacks left as NULL use the library defaults.
+//
+// Only the library functions wrapped here are recorded. Calling any other
+// function that may call a callback, such as mobile_config_load() or
+// mobile_actions_get(), will make the trace impossible to replay. Similarly,
+// the configuration must be provided through mobile_func_config_read(), as
+// the mobile_config_set_* functions aren't recorded.
+//
+// None of these functions are thread-safe. If mobile_transfer() and
+// mobile_loop() are called from different threads, the user must make sure
+// the recorder is never entered from both at the same time.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <mobile.h>
+
+#define MOBILE_TRACE_MAGIC "MOBTRACE"
+#define MOBILE_TRACE_VERSION 1
+
+// Flags stored in the header of the trace
+#define MOBILE_TRACE_FLAG_TIME_NOW_MS (1 << 0)
+#define MOBILE_TRACE_FLAG_SOCK_POLL (1 << 1)
+#define MOBILE_TRACE_FLAG_DNS_RESOLVE (1 << 2)
+
+// Every event is a single byte, followed by its data.
+// Multi-byte integers are stored in little endian.
+enum mobile_trace_event {
+    // Markers for library functions called by the user
+    MOBILE_TRACE_TIME = 1,       // u32 ms since the start of the recording
+    MOBILE_TRACE_START,
+    MOBILE_TRACE_STOP,
+    MOBILE_TRACE_LOOP,
+    MOBILE_TRACE_NEXT_DEADLINE,
+    MOBILE_TRACE_TRANSFER,       // u8 in, u8 out
+    MOBILE_TRACE_TRANSFER_32BIT, // u32 in, u32 out
+
+    // Callback results, in the order they're called by the library
+    MOBILE_TRACE_CONFIG_READ,    // u8 result, u16 offset, u16 size, data
+    MOBILE_TRACE_CONFIG_WRITE,   // u8 result
+    MOBILE_TRACE_TIME_CHECK_MS,  // u8 result
+    MOBILE_TRACE_TIME_NOW_MS,    // u32 result
+    MOBILE_TRACE_SOCK_OPEN,      // u8 result
+    MOBILE_TRACE_SOCK_CONNECT,   // s8 result
+    MOBILE_TRACE_SOCK_LISTEN,    // u8 result
+    MOBILE_TRACE_SOCK_ACCEPT,    // u8 result
+    MOBILE_TRACE_SOCK_SEND,      // s16 result
+    MOBILE_TRACE_SOCK_RECV,      // s16 result, if > 0: addr, data
+    // The address is stored as a u8 type, and unless MOBILE_ADDRTYPE_NONE,
+    //   a u16 port followed by the host.
+    MOBILE_TRACE_SOCK_POLL,      // s8 result
+    MOBILE_TRACE_DNS_RESOLVE,    // u8 result
+    MOBILE_TRACE_DNS_POLL        // s8 result, if > 0: addr
+};
+
+struct mobile_trace_callbacks {
+    mobile_func_debug_log debug_log;
+    mobile_func_serial_disable serial_disable;
+    mobile_func_serial_enable serial_enable;
+    mobile_func_config_read config_read;
+    mobile_func_config_write config_write;
+    mobile_func_time_latch time_latch;
+    mobile_func_time_check_ms time_check_ms;
+    mobile_func_time_now_ms time_now_ms;
+    mobile_func_sock_open sock_open;
+    mobile_func_sock_close sock_close;
+    mobile_func_sock_connect sock_connect;
+    mobile_func_sock_listen sock_listen;
+    mobile_func_sock_accept sock_accept;
+    mobile_func_sock_send sock_send;
+    mobile_func_sock_recv sock_recv;
+    mobile_func_sock_poll sock_poll;
+    mobile_func_dns_resolve dns_resolve;
+    mobile_func_dns_poll dns_poll;
+    mobile_func_update_number update_number;
+    mobile_func_notify notify;
+};
+
+struct mobile_trace {
+    FILE *file;
+    void *user;
+    struct mobile_trace_callbacks cb;
+
+    // Recording start time and the last written timestamp
+    uint64_t start;
+    uint32_t time;
+};
+
+void mobile_trace_init(struct mobile_trace *trace, FILE *file, void *user);
+void mobile_trace_attach(struct mobile_trace *trace, struct mobile_adapter *adapter);
+
+void mobile_trace_start(struct mobile_trace *trace, struct mobile_adapter *adapter);
+void mobile_trace_stop(struct mobile_trace *trace, struct mobile_adapter *adapter);
+void mobile_trace_loop(struct mobile_trace *trace, struct mobile_adapter *adapter);
+unsigned mobile_trace_next_deadline_ms(struct mobile_trace *trace, struct mobile_adapter *adapter);
+uint8_t mobile_trace_transfer(struct mobile_trace *trace, struct mobile_adapter *adapter, uint8_t c);
+uint32_t mobile_trace_transfer_32bit(struct mobile_trace *trace, struct mobile_adapter *adapter, uint32_t c);
@@ -0,0 +1,122 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+
+// Records a session of the simulated Game Boy client (see bench/gbclient.h)
+// through trace.h, and replays it with the mobile_replay tool, whose path is
+// passed as the only argument. The replay must go through without any
+// mismatch.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mobile_data.h>
+
+#include "gbclient.h"
+
+#define TRACE_FILE "trace_test.trace"
+#define DATA_PACKETS 20
+
+// Send a packet, and make sure the adapter replied to it without an error
+static void packet(struct gbclient *client, unsigned char command, const void *data, unsigned size)
+{
+    if (!gbclient_packet(client, command, data, size)) {
+        fprintf(stderr, "trace_test: packet 0x%02X: serial error\n", command);
+        exit(1);
+    }
+    if (client->reply_command != (command | 0x80)) {
+        fprintf(stderr, "trace_test: packet 0x%02X: replied 0x%02X\n",
+            command, client->reply_command);
+        exit(1);
+    }
+}
+
+static void data_packets(struct gbclient *client, unsigned char conn)
+{
+    unsigned char data[1 + MOBILE_MAX_TRANSFER_SIZE];
+    data[0] = conn;
+    for (unsigned i = 0; i < DATA_PACKETS; i++) {
+        for (unsigned x = 1; x < sizeof(data); x++) data[x] = x + i;
+        packet(client, MOBILE_COMMAND_DATA, data, sizeof(data));
+        if (client->reply_size != sizeof(data) ||
+                memcmp(client->reply + 1, data + 1, sizeof(data) - 1) != 0) {
+            fprintf(stderr, "trace_test: DATA wasn't echoed\n");
+            exit(1);
+        }
+    }
+}
+
+static void record(FILE *file)
+{
+    struct gbclient *client = malloc(sizeof(struct gbclient));
+    if (!client) abort();
+    gbclient_init_trace(client, file);
+
+    packet(client, MOBILE_COMMAND_START, "NINTENDO", 8);
+    packet(client, MOBILE_COMMAND_TEL, "\x00" "#9677", 6);
+
+    // ID, password, DNS1 and DNS2
+    static const unsigned char login[] = {
+        4, 'g', '1', '0', '0',
+        4, 'p', 'a', 's', 's',
+        10, 0, 0, 1,
+        10, 0, 0, 2
+    };
+    packet(client, MOBILE_COMMAND_PPP_CONNECT, login, sizeof(login));
+
+    static const char host[] = "gameboy.datacenter.ne.jp";
+    packet(client, MOBILE_COMMAND_DNS_REQUEST, host, sizeof(host) - 1);
+    if (client->reply_size != 4) {
+        fprintf(stderr, "trace_test: DNS request failed\n");
+        exit(1);
+    }
+
+    unsigned char addr[6];
+    memcpy(addr, client->reply, 4);
+    addr[4] = 80 >> 8;
+    addr[5] = 80 & 0xFF;
+    packet(client, MOBILE_COMMAND_TCP_CONNECT, addr, sizeof(addr));
+    unsigned char conn = client->reply[0];
+    data_packets(client, conn);
+
+    // Record the 32bit serial mode as well
+    packet(client, MOBILE_COMMAND_CHANGE_CLOCK, "\x01", 1);
+    data_packets(client, conn);
+
+    packet(client, MOBILE_COMMAND_TCP_DISCONNECT, &conn, 1);
+    packet(client, MOBILE_COMMAND_PPP_DISCONNECT, NULL, 0);
+    packet(client, MOBILE_COMMAND_OFFLINE, NULL, 0);
+    packet(client, MOBILE_COMMAND_END, NULL, 0);
+
+    gbclient_free(client);
+    free(client);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <mobile_replay>\n", argv[0]);
+        return 1;
+    }
+
+    FILE *file = fopen(TRACE_FILE, "wb");
+    if (!file) {
+        perror(TRACE_FILE);
+        return 1;
+    }
+    record(file);
+    if (fclose(file) != 0) {
+        perror(TRACE_FILE);
+        return 1;
+    }
+
+    char command[4096];
+    snprintf(command, sizeof(command), "\"%s\" %s", argv[1], TRACE_FILE);
+    fflush(stdout);
+    int status = system(command);
+    if (status != 0) {
+        fprintf(stderr, "trace_test: replay failed (status %d)\n", status);
+        return 1;
+    }
+    printf("trace_test: replayed without mismatches\n");
+    return 0;
+}